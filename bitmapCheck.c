@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include "libBitmap.h"
+
+// Checks of the free space bitmap that need no disk, run by make check
+
+static int failures;
+
+static void expect(int ok, const char *what) {
+   printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+   if (!ok)
+      failures++;
+}
+
+// A block cleared below the hint without bitmapDefer() must be handed out again
+static void freeBelowHint(void) {
+   block_bitmap *map = bitmapCreate(128);
+   int bNum;
+
+   while (bitmapAlloc(map) >= 0)
+      ;
+   bitmapClear(map, 5, 1);
+   expect(map->num_free == 1, "clear below the hint counts the block as free");
+   expect(bitmapAlloc(map) == 5, "bitmapAlloc returns the cleared block");
+   bitmapClear(map, 5, 1);
+   expect(bitmapAllocRun(map, 1) == 5, "bitmapAllocRun returns the cleared block");
+   bitmapClear(map, 70, 3);
+   bNum = bitmapAllocRun(map, 3);
+   expect(bNum == 70, "a cleared run below the hint is found again");
+   bitmapDestroy(map);
+}
+
+// A deferred block waits for bitmapCommit()
+static void deferUntilCommit(void) {
+   block_bitmap *map = bitmapCreate(128);
+
+   while (bitmapAlloc(map) >= 0)
+      ;
+   bitmapClear(map, 9, 1);
+   bitmapDefer(map, 9, 1);
+   expect(bitmapAlloc(map) == -1, "a deferred block is held back");
+   bitmapCommit(map);
+   expect(bitmapAlloc(map) == 9, "a deferred block is handed out after commit");
+   bitmapDestroy(map);
+}
+
+int main(void) {
+   freeBelowHint();
+   deferUntilCommit();
+   printf("%d failed\n", failures);
+   return failures != 0;
+}
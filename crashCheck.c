@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <string.h>
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "libJournal.h"
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+
+// Crashes in the middle of a metadata transaction, run by make check. Every
+// operation is run once for each point diskFailAfter() can stop the disk at,
+// and the volume mounted after the crash has to match a volume that never
+// crashed, from before or from after the operation
+
+#define CRASH_IMAGE "crashCheck.img"
+#define CRASH_BLOCKS 512
+#define CRASH_FILES 8 //most files a volume of the check holds
+#define CRASH_RUNS 1000 //failure points tried before giving up on an operation
+
+//what a volume holds, in name order
+typedef struct volume_state {
+   int num_files;
+   char names[CRASH_FILES][9];
+   int sizes[CRASH_FILES];
+   unsigned int sums[CRASH_FILES]; //of the contents of each file
+   int room; //bytes tfs_append() could still add to a new file
+} volume_state;
+
+typedef void (*crash_op)(tfs_volume *vol);
+
+static int failures;
+
+static void expect(int ok, const char *what) {
+   printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+   if (!ok)
+      failures++;
+}
+
+static void writeNamed(tfs_volume *vol, char *name, int size, char fill) {
+   char data[6000];
+
+   memset(data, fill, size);
+   tfs_writeFile(tfs_openFileOn(vol, name), data, size);
+}
+
+// Two files on a fresh volume, committed
+static tfs_volume* setUp(void) {
+   tfs_volume *vol;
+
+   if (tfs_mkfs(CRASH_IMAGE, CRASH_BLOCKS * BLOCKSIZE) != MAKEFS_SUCCESS ||
+    tfs_mountVolume(CRASH_IMAGE, &vol) != MOUNT_SUCCESS)
+      return NULL;
+   writeNamed(vol, "keep", 3000, 'k');
+   writeNamed(vol, "old", 1000, 'o');
+   tfs_syncOn(vol);
+   return vol;
+}
+
+static void openNew(tfs_volume *vol) {
+   tfs_openFileOn(vol, "new");
+}
+
+static void rewriteOld(tfs_volume *vol) {
+   writeNamed(vol, "old", 5000, 'w');
+}
+
+static void deleteOld(tfs_volume *vol) {
+   tfs_deleteFile(tfs_openFileOn(vol, "old"));
+}
+
+static void renameOld(tfs_volume *vol) {
+   tfs_renameOn(vol, "moved", "old");
+}
+
+static void openTwo(tfs_volume *vol) {
+   tfs_openFileOn(vol, "two");
+}
+
+// Lists the files of vol with a checksum of their contents
+static int listState(tfs_volume *vol, volume_state *state) {
+   tfs_dirent entries[CRASH_FILES];
+   char data[6000];
+   tfs_dir dir;
+   unsigned int sum;
+   int count, idx, pos, n;
+
+   memset(state, 0, sizeof(volume_state));
+   tfs_opendirOn(vol, &dir, NULL);
+   count = tfs_readdirNext(&dir, entries, CRASH_FILES);
+   if (count < 0 || tfs_readdirNext(&dir, entries, CRASH_FILES) != 0)
+      return -1;
+   for (idx = 0; idx < count; idx++) {
+      fileDescriptor fd = tfs_openFileOn(vol, entries[idx].name);
+
+      // A file opened again keeps its file pointer
+      tfs_seek(fd, 0);
+      n = entries[idx].size > 0 ? tfs_read(fd, data, sizeof(data)) : 0;
+      if (n < 0 || n != entries[idx].size)
+         return -1;
+      for (sum = 2166136261u, pos = 0; pos < n; pos++)
+         sum = (sum ^ (unsigned char)data[pos]) * 16777619u;
+      tfs_closeFile(fd);
+      strcpy(state->names[idx], entries[idx].name);
+      state->sizes[idx] = n;
+      state->sums[idx] = sum;
+   }
+   state->num_files = count;
+   return 0;
+}
+
+static int sameFiles(volume_state *a, volume_state *b) {
+   return a->num_files == b->num_files &&
+    memcmp(a->names, b->names, sizeof(a->names)) == 0 &&
+    memcmp(a->sizes, b->sizes, sizeof(a->sizes)) == 0 &&
+    memcmp(a->sums, b->sums, sizeof(a->sums)) == 0;
+}
+
+/* Mounts the image again and reads what it holds. Then it fills the free space with one more file, which is where blocks the bitmap wrongly calls free would show up. Those blocks are overwritten, so the other files have to read back the same after the fill, and a block the bitmap wrongly calls used makes room come out short. Returns 0 or -1 if the volume does not mount or is unreadable. */
+static int checkImage(volume_state *state) {
+   char chunk[EXTENT_PAYLOAD];
+   volume_state after;
+   tfs_volume *vol;
+   fileDescriptor fd;
+   int n, code = 0;
+
+   if (tfs_mountVolume(CRASH_IMAGE, &vol) != MOUNT_SUCCESS)
+      return -1;
+   if (listState(vol, state) < 0)
+      code = -1;
+   memset(chunk, 'f', sizeof(chunk));
+   fd = tfs_openFileOn(vol, "fill");
+   while ((n = tfs_append(fd, chunk, sizeof(chunk))) > 0)
+      state->room += n;
+   tfs_deleteFile(fd);
+   if (code == 0 && (listState(vol, &after) < 0 || !sameFiles(state, &after)))
+      code = -1;
+   tfs_unmountVolume(vol);
+   return code;
+}
+
+// The state of a volume that ran op, or only set up if op is NULL, without a crash
+static int referenceState(crash_op first, crash_op op, volume_state *state) {
+   tfs_volume *vol = setUp();
+
+   if (vol == NULL)
+      return -1;
+   if (first != NULL) {
+      first(vol);
+      tfs_syncOn(vol);
+   }
+   if (op != NULL) {
+      op(vol);
+      tfs_syncOn(vol);
+   }
+   if (tfs_unmountVolume(vol) != UNMOUNT_SUCCESS)
+      return -1;
+   return checkImage(state);
+}
+
+/* Runs op on a set up volume, after first if that is not NULL, with the disk failing after 0, 1, 2 ... more block writes, until op and the unmount after it get through. Every crash has to leave the volume as it was before op or as it is after it. Returns how many runs left a torn transaction in the journal slot op committed to and came back as before op, or -1 if a crash broke the volume. */
+static int crashRuns(crash_op first, crash_op op) {
+   volume_state before, after, state;
+   char descriptor[BLOCKSIZE];
+   tfs_volume *vol;
+   unsigned int sequence;
+   int run, disk, slot_block, torn = 0;
+
+   if (referenceState(first, NULL, &before) < 0 ||
+    referenceState(first, op, &after) < 0)
+      return -1;
+
+   for (run = 0; run < CRASH_RUNS; run++) {
+      vol = setUp();
+      if (vol == NULL)
+         return -1;
+      if (first != NULL) {
+         first(vol);
+         tfs_syncOn(vol);
+      }
+      sequence = vol->log->sequence + 1;
+      slot_block = vol->log->start + (sequence % 2) * vol->log->slot_blocks;
+      diskFailAfter(vol->disk, run);
+      op(vol);
+      tfs_syncOn(vol);
+      // With the disk failing, unmounting writes nothing more, like a crash
+      if (tfs_unmountVolume(vol) == UNMOUNT_SUCCESS)
+         return torn;
+
+      disk = openDisk(CRASH_IMAGE, 0);
+      if (disk < 0 || readBlock(disk, slot_block, descriptor) < 0)
+         return -1;
+      closeDisk(disk);
+
+      if (checkImage(&state) < 0)
+         return -1;
+      if (sameFiles(&state, &before) && state.room == before.room) {
+         if ((unsigned char)descriptor[JOURNAL_SEQUENCE] == (sequence & 0xFF))
+            torn++;
+      }
+      else if (!sameFiles(&state, &after) || state.room != after.room) {
+         return -1;
+      }
+   }
+   return -1;
+}
+
+int main(void) {
+   setDiskBackend(DISK_MEMORY);
+   expect(crashRuns(NULL, openNew) >= 0, "a crash while creating a file");
+   expect(crashRuns(NULL, rewriteOld) >= 0, "a crash while rewriting a file");
+   expect(crashRuns(NULL, deleteOld) >= 0, "a crash while deleting a file");
+   expect(crashRuns(NULL, renameOld) >= 0, "a crash while renaming a file");
+   expect(crashRuns(openNew, openTwo) > 0, "a torn second journal slot is not replayed");
+   removeMemoryDisk(CRASH_IMAGE);
+   printf("%d failed\n", failures);
+   return failures != 0;
+}
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+#include "libDisk.h"
+
+#define BENCH_DISK "diskBench.img"
+#define BENCH_BLOCKS 1024
+#define BENCH_OPS 200000
+#define MAX_DEPTH 64 //deepest queue measured by queueReads()
+
+// The old libDisk read path: size probe, seek, read (3 syscalls per block)
+static int legacyReadBlock(int fd, int bNum, void *block) {
+   off_t disk_size = lseek(fd, 0, SEEK_END);
+
+   if (disk_size == -1 || (off_t)bNum * BLOCKSIZE + BLOCKSIZE > disk_size)
+      return ERROR_BADREAD;
+   if (lseek(fd, (off_t)bNum * BLOCKSIZE, SEEK_SET) == -1)
+      return ERROR_BADREAD;
+   if (read(fd, block, BLOCKSIZE) == -1)
+      return ERROR_BADREAD;
+   return 0;
+}
+
+// The old libDisk write path: size probe, seek, write (3 syscalls per block)
+static int legacyWriteBlock(int fd, int bNum, void *block) {
+   off_t disk_size = lseek(fd, 0, SEEK_END);
+
+   if (disk_size == -1 || (off_t)bNum * BLOCKSIZE + BLOCKSIZE > disk_size)
+      return ERROR_BADWRITE;
+   if (lseek(fd, (off_t)bNum * BLOCKSIZE, SEEK_SET) == -1)
+      return ERROR_BADWRITE;
+   if (write(fd, block, BLOCKSIZE) == -1)
+      return ERROR_BADWRITE;
+   return 0;
+}
+
+static double now() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char *name, int syscalls, double seconds) {
+   printf("%-22s %d syscall(s)/block %8.0f ns/block %10.0f blocks/s\n",
+    name, syscalls, seconds * 1e9 / BENCH_OPS, BENCH_OPS / seconds);
+}
+
+// Simulated time to write every block of a memory disk 'batch' blocks per call
+static double simulate(const disk_profile *profile, int batch) {
+   char *blocks = (char *)calloc(batch, BLOCKSIZE);
+   long long busy;
+   int disk, bNum;
+
+   disk = openDiskBackend("sim", BENCH_BLOCKS * BLOCKSIZE, DISK_MEMORY);
+   setDiskProfile(disk, profile);
+   for (bNum = 0; bNum < BENCH_BLOCKS; bNum += batch) {
+      if (batch == 1)
+         writeBlock(disk, bNum, blocks);
+      else
+         writeBlocks(disk, bNum, batch, blocks);
+   }
+   syncDisk(disk);
+   busy = diskBusyTime(disk);
+   closeDisk(disk);
+   removeMemoryDisk("sim");
+   free(blocks);
+   return busy / 1e6;
+}
+
+// Compare single block and batched writes on the simulated devices
+static void simulateDevices() {
+   const disk_profile *profiles[] = {&disk_profile_hdd, &disk_profile_ssd,
+    &disk_profile_nvme};
+   char *names[] = {"hdd", "ssd", "nvme"};
+   int idx;
+
+   printf("\nSimulated write of all %d blocks (ms)\n", BENCH_BLOCKS);
+   printf("%-6s %12s %12s %12s\n", "device", "1/call", "16/call", "64/call");
+   for (idx = 0; idx < 3; idx++) {
+      printf("%-6s %12.2f %12.2f %12.2f\n", names[idx],
+       simulate(profiles[idx], 1), simulate(profiles[idx], 16),
+       simulate(profiles[idx], 64));
+   }
+}
+
+/* Random single block reads through a disk queue of the given engine and depth, each request resubmitted as soon as one completes. Returns the blocks read per second, 0 if the engine is not available. */
+static double queueReads(int disk, int *order, int engine, int depth) {
+   char *buffers = (char *)malloc((size_t)depth * BLOCKSIZE);
+   disk_completion done[MAX_DEPTH];
+   disk_queue *queue;
+   double start, seconds;
+   int next, got, idx, slot;
+
+   setAsyncEngine(engine);
+   queue = diskQueueCreate(depth);
+   setAsyncEngine(ASYNC_AUTO);
+   if (queue == NULL) {
+      free(buffers);
+      return 0;
+   }
+
+   start = now();
+   for (next = 0; next < depth; next++)
+      submitRead(queue, disk, order[next], 1, buffers + next * BLOCKSIZE,
+       (void *)(long)next);
+   while ((got = diskQueueWait(queue, 1, done, depth)) > 0) {
+      for (idx = 0; idx < got && next < BENCH_OPS; idx++, next++) {
+         slot = (int)(long)done[idx].token;
+         submitRead(queue, disk, order[next], 1, buffers + slot * BLOCKSIZE,
+          done[idx].token);
+      }
+   }
+   seconds = now() - start;
+   diskQueueDestroy(queue);
+   free(buffers);
+   return BENCH_OPS / seconds;
+}
+
+// Compare the asynchronous engines at growing queue depths
+static void compareQueues(int disk, int *order) {
+   int depths[] = {1, 8, 32, MAX_DEPTH};
+   int idx;
+
+   printf("\nRandom reads through a disk queue (blocks/s)\n");
+   printf("%-6s %12s %12s\n", "depth", "io_uring", "threads");
+   for (idx = 0; idx < 4; idx++) {
+      printf("%-6d %12.0f %12.0f\n", depths[idx],
+       queueReads(disk, order, ASYNC_URING, depths[idx]),
+       queueReads(disk, order, ASYNC_THREADS, depths[idx]));
+   }
+}
+
+int main() {
+   char block[BLOCKSIZE];
+   int *order = (int *)malloc(sizeof(int) * BENCH_OPS);
+   int disk, fd, idx;
+   double start;
+
+   memset(block, 0xAB, BLOCKSIZE);
+   srand(42);
+   for (idx = 0; idx < BENCH_OPS; idx++)
+      order[idx] = rand() % BENCH_BLOCKS;
+
+   disk = openDisk(BENCH_DISK, BENCH_BLOCKS * BLOCKSIZE);
+   if (disk < 0) {
+      printf("Cannot open %s\n", BENCH_DISK);
+      return 1;
+   }
+   fd = open(BENCH_DISK, O_RDWR);
+
+   printf("Random block I/O on a %d block disk, %d ops each\n",
+    BENCH_BLOCKS, BENCH_OPS);
+
+   start = now();
+   for (idx = 0; idx < BENCH_OPS; idx++)
+      legacyReadBlock(fd, order[idx], block);
+   report("lseek+read", 3, now() - start);
+
+   start = now();
+   for (idx = 0; idx < BENCH_OPS; idx++)
+      readBlock(disk, order[idx], block);
+   report("readBlock (pread)", 1, now() - start);
+
+   start = now();
+   for (idx = 0; idx < BENCH_OPS; idx++)
+      legacyWriteBlock(fd, order[idx], block);
+   report("lseek+write", 3, now() - start);
+
+   start = now();
+   for (idx = 0; idx < BENCH_OPS; idx++)
+      writeBlock(disk, order[idx], block);
+   report("writeBlock (pwrite)", 1, now() - start);
+
+   compareQueues(disk, order);
+
+   close(fd);
+   closeDisk(disk);
+   unlink(BENCH_DISK);
+   free(order);
+
+   simulateDevices();
+   return 0;
+}
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libBitmap.h"
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+
+#define FULL_WORD (~(uint64_t)0)
+
+// Number of trailing zero bits of a nonzero word
+#define CTZ(word) __builtin_ctzll(word)
+
+/* Returns how many bitmap blocks a volume of num_blocks blocks needs. */
+int bitmapBlocks(int num_blocks) {
+   return (num_blocks + BITMAP_BITS - 1) / BITMAP_BITS;
+}
+
+/* Creates a bitmap for num_blocks blocks with every block free. The bits past the end of the volume are set so they are never handed out. Returns NULL if memory cannot be allocated. */
+block_bitmap* bitmapCreate(int num_blocks) {
+   block_bitmap *map;
+   int bNum;
+
+   if (num_blocks <= 0)
+      return NULL;
+
+   map = (block_bitmap *)calloc(1, sizeof(block_bitmap));
+   if (map == NULL)
+      return NULL;
+
+   map->num_blocks = num_blocks;
+   map->num_map_blocks = bitmapBlocks(num_blocks);
+   map->num_words = map->num_map_blocks * BITMAP_WORDS;
+   map->words = (uint64_t *)calloc(map->num_words, sizeof(uint64_t));
+   map->pending = (uint64_t *)calloc(map->num_words, sizeof(uint64_t));
+   map->dirty = (char *)calloc(map->num_map_blocks, 1);
+   if (map->words == NULL || map->pending == NULL || map->dirty == NULL) {
+      bitmapDestroy(map);
+      return NULL;
+   }
+
+   for (bNum = num_blocks; bNum < map->num_words * 64; bNum++)
+      map->words[bNum / 64] |= (uint64_t)1 << (bNum % 64);
+   map->num_free = num_blocks;
+   return map;
+}
+
+// 1 if every byte of the block is 0
+static int zeroBlock(const unsigned char *bytes) {
+   int idx;
+
+   for (idx = 0; idx < BLOCKSIZE; idx++) {
+      if (bytes[idx] != 0)
+         return 0;
+   }
+   return 1;
+}
+
+/* Replaces the bits of the bitmap with num_map_blocks bitmap blocks laid out back to back in 'blocks', as read from disk. A block of zeros was never written and leaves every block it covers free, so a format only has to write the bitmap blocks of the metadata. The free count is recomputed with one popcount per word. Returns 0 on success or ERROR_BADREAD if a block is not a bitmap block. */
+int bitmapLoad(block_bitmap *map, const char *blocks) {
+   const unsigned char *bytes;
+   uint64_t word;
+   int index, idx, shift, used = 0;
+
+   for (index = 0; index < map->num_map_blocks; index++) {
+      bytes = (const unsigned char *)blocks + index * BLOCKSIZE;
+      if (bytes[0] != BITMAP || bytes[1] != MAGIC) {
+         if (!zeroBlock(bytes))
+            return ERROR_BADREAD;
+         // Never written since the format, every block it covers is free
+         memset(map->words + index * BITMAP_WORDS, 0, BITMAP_WORDS * 8);
+         map->dirty[index] = 0;
+         continue;
+      }
+      bytes += BITMAP_DATA;
+      for (idx = 0; idx < BITMAP_WORDS; idx++, bytes += 8) {
+         word = 0;
+         for (shift = 0; shift < 8; shift++)
+            word |= (uint64_t)bytes[shift] << (shift * 8);
+         map->words[index * BITMAP_WORDS + idx] = word;
+      }
+      map->dirty[index] = 0;
+   }
+
+   // Whatever the disk says, blocks past the end stay used
+   for (idx = map->num_blocks; idx < map->num_words * 64; idx++)
+      map->words[idx / 64] |= (uint64_t)1 << (idx % 64);
+   for (idx = 0; idx < map->num_words; idx++)
+      used += __builtin_popcountll(map->words[idx]);
+   map->num_free = map->num_words * 64 - used;
+   bitmapCommit(map);
+   return 0;
+}
+
+/* Renders bitmap block 'index' into 'block' and clears its dirty flag. */
+void bitmapStore(block_bitmap *map, int index, char *block) {
+   unsigned char *bytes = (unsigned char *)block + BITMAP_DATA;
+   uint64_t word;
+   int idx, shift;
+
+   memset(block, 0, BLOCKSIZE);
+   block[0] = BITMAP;
+   block[1] = MAGIC;
+   block[BITMAP_INDEX] = index & 0xFF;
+   block[BITMAP_INDEX + 1] = (index >> 8) & 0xFF;
+   block[BITMAP_INDEX + 2] = (index >> 16) & 0xFF;
+   block[BITMAP_INDEX + 3] = (index >> 24) & 0xFF;
+   for (idx = 0; idx < BITMAP_WORDS; idx++) {
+      word = map->words[index * BITMAP_WORDS + idx];
+      for (shift = 0; shift < 8; shift++)
+         *bytes++ = (word >> (shift * 8)) & 0xFF;
+   }
+   map->dirty[index] = 0;
+}
+
+/* Returns 1 if block bNum is in use, 0 if it is free. */
+int bitmapTest(block_bitmap *map, int bNum) {
+   return (map->words[bNum / 64] >> (bNum % 64)) & 1;
+}
+
+// Set or clear count bits from start a word at a time
+static void changeRange(block_bitmap *map, int start, int count, int used) {
+   uint64_t mask, changed;
+   int word, first, bits;
+
+   while (count > 0) {
+      word = start / 64;
+      first = start % 64;
+      bits = 64 - first < count ? 64 - first : count;
+      mask = (bits == 64 ? FULL_WORD : (((uint64_t)1 << bits) - 1)) << first;
+
+      if (used) {
+         changed = mask & ~map->words[word];
+         map->words[word] |= mask;
+         map->num_free -= __builtin_popcountll(changed);
+         // Taking back a block freed since the last commit
+         map->num_pending -= __builtin_popcountll(map->pending[word] & mask);
+         map->pending[word] &= ~mask;
+      }
+      else {
+         changed = mask & map->words[word];
+         map->words[word] &= ~mask;
+         map->num_free += __builtin_popcountll(changed);
+         // A block freed without bitmapDefer() is usable right away
+         if (changed && word < map->hint)
+            map->hint = word;
+      }
+      if (changed)
+         map->dirty[word / BITMAP_WORDS] = 1;
+
+      start += bits;
+      count -= bits;
+   }
+}
+
+/* Marks count blocks starting at start as used. */
+void bitmapSet(block_bitmap *map, int start, int count) {
+   changeRange(map, start, count, 1);
+}
+
+/* Marks count blocks starting at start as free. */
+void bitmapClear(block_bitmap *map, int start, int count) {
+   changeRange(map, start, count, 0);
+}
+
+// Bits of a word that cannot be allocated right now
+#define TAKEN(map, word) ((map)->words[word] | (map)->pending[word])
+
+/* Holds the free blocks among the count blocks from start back from allocation until bitmapCommit(). With a journal, blocks freed by an operation that is not committed yet are deferred, so a crash that rolls the operation back never finds them holding another file's data. */
+void bitmapDefer(block_bitmap *map, int start, int count) {
+   uint64_t mask, added;
+   int word, first, bits;
+
+   while (count > 0) {
+      word = start / 64;
+      first = start % 64;
+      bits = 64 - first < count ? 64 - first : count;
+      mask = (bits == 64 ? FULL_WORD : (((uint64_t)1 << bits) - 1)) << first;
+
+      added = mask & ~map->words[word] & ~map->pending[word];
+      map->pending[word] |= added;
+      map->num_pending += __builtin_popcountll(added);
+
+      start += bits;
+      count -= bits;
+   }
+}
+
+/* Makes every deferred block available again. */
+void bitmapCommit(block_bitmap *map) {
+   if (map->num_pending == 0)
+      return;
+   memset(map->pending, 0, sizeof(uint64_t) * map->num_words);
+   map->num_pending = 0;
+   map->hint = 0;
+}
+
+/* Takes the lowest free block, skipping full words without looking at their bits. Returns the block number or -1 if the volume is full. */
+int bitmapAlloc(block_bitmap *map) {
+   int word, bNum;
+
+   if (map->num_free - map->num_pending == 0)
+      return -1;
+
+   for (word = map->hint; word < map->num_words; word++) {
+      if (TAKEN(map, word) != FULL_WORD)
+         break;
+   }
+   if (word == map->num_words)
+      return -1;
+
+   map->hint = word;
+   bNum = word * 64 + CTZ(~TAKEN(map, word));
+   changeRange(map, bNum, 1, 1);
+   return bNum;
+}
+
+/* Takes the first run of count consecutive free blocks. Runs of clear and set bits are measured with one ctz each, so full and empty words are skipped in a single step. Returns the first block of the run or -1 if no run is long enough. */
+int bitmapAllocRun(block_bitmap *map, int count) {
+   uint64_t rest;
+   int word, bit, span, start = -1, length = 0;
+
+   if (count <= 0 || count > map->num_free - map->num_pending)
+      return -1;
+
+   for (word = map->hint; word < map->num_words; word++) {
+      bit = 0;
+      while (bit < 64) {
+         rest = TAKEN(map, word) >> bit;
+         if (rest & 1) {
+            // Used blocks break the run
+            span = ~rest == 0 ? 64 - bit : CTZ(~rest);
+            length = 0;
+         }
+         else {
+            span = rest == 0 ? 64 - bit : CTZ(rest);
+            if (length == 0)
+               start = word * 64 + bit;
+            length += span;
+            if (length >= count) {
+               changeRange(map, start, count, 1);
+               return start;
+            }
+         }
+         bit += span;
+      }
+   }
+   return -1;
+}
+
+/* Takes the free blocks from start on, up to count of them, stopping at the first one that is used or deferred, so a file can grow its last extent in place. Returns the number of blocks taken. */
+int bitmapExtend(block_bitmap *map, int start, int count) {
+   int length = 0, bNum;
+
+   for (bNum = start; length < count && bNum >= 0 && bNum < map->num_blocks;
+    bNum++, length++) {
+      if ((TAKEN(map, bNum / 64) >> (bNum % 64)) & 1)
+         break;
+   }
+   if (length > 0)
+      changeRange(map, start, length, 1);
+   return length;
+}
+
+/* Frees the bitmap. */
+void bitmapDestroy(block_bitmap *map) {
+   if (map == NULL)
+      return;
+   free(map->words);
+   free(map->pending);
+   free(map->dirty);
+   free(map);
+}
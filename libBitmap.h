@@ -0,0 +1,41 @@
+#ifndef LIBBITMAP_H
+#define LIBBITMAP_H
+
+#include <stdint.h>
+#include "tinyFS.h"
+
+//bitmap block 0-type, 1-magic, 4-index of the block in the bitmap, 8-bits
+//bit n of the volume is bit n%8 of byte n/8, a set bit is a used block
+#define BITMAP_INDEX 4
+#define BITMAP_DATA 8
+#define BITMAP_WORDS ((BLOCKSIZE - BITMAP_DATA) / 8) //64-bit words per bitmap block
+#define BITMAP_BITS (BITMAP_WORDS * 64) //blocks tracked per bitmap block
+
+//in-memory copy of the free space bitmap of a volume
+typedef struct block_bitmap {
+   int num_blocks;
+   int num_words;
+   int num_map_blocks; //bitmap blocks on disk
+   int num_free; //clear bits, blocks that can be allocated
+   int hint; //first word that may have a clear bit
+   uint64_t *words;
+   uint64_t *pending; //free but deferred, not handed out before bitmapCommit()
+   int num_pending;
+   char *dirty; //one flag per bitmap block, set until bitmapStore()
+} block_bitmap;
+
+int bitmapBlocks(int num_blocks);
+block_bitmap* bitmapCreate(int num_blocks);
+int bitmapLoad(block_bitmap *map, const char *blocks);
+void bitmapStore(block_bitmap *map, int index, char *block);
+int bitmapTest(block_bitmap *map, int bNum);
+void bitmapSet(block_bitmap *map, int start, int count);
+void bitmapClear(block_bitmap *map, int start, int count);
+int bitmapAlloc(block_bitmap *map);
+int bitmapAllocRun(block_bitmap *map, int count);
+int bitmapExtend(block_bitmap *map, int start, int count);
+void bitmapDefer(block_bitmap *map, int start, int count);
+void bitmapCommit(block_bitmap *map);
+void bitmapDestroy(block_bitmap *map);
+
+#endif
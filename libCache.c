@@ -0,0 +1,566 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "libDisk.h"
+#include "libCache.h"
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+
+#define WRITE_DEPTH 16 //runs cacheSync() keeps in flight
+
+/* Creates a write-back block cache holding at most 'capacity' blocks of the open disk 'disk'. Returns NULL if capacity is not positive or memory cannot be allocated. */
+block_cache* cacheCreate(int disk, int capacity) {
+   block_cache *cache;
+   int idx;
+
+   if (capacity <= 0)
+      return NULL;
+
+   cache = (block_cache *)calloc(1, sizeof(block_cache));
+   if (cache == NULL)
+      return NULL;
+
+   cache->disk = disk;
+   cache->capacity = capacity;
+   cache->lru_head = -1;
+   cache->lru_tail = -1;
+   // Keep the chains short, two buckets per entry
+   cache->num_buckets = capacity * 2;
+   cache->buckets = (int *)malloc(sizeof(int) * cache->num_buckets);
+   cache->entries = (cache_entry *)calloc(capacity, sizeof(cache_entry));
+   if (cache->buckets == NULL || cache->entries == NULL) {
+      free(cache->buckets);
+      free(cache->entries);
+      free(cache);
+      return NULL;
+   }
+
+   for (idx = 0; idx < cache->num_buckets; idx++)
+      cache->buckets[idx] = -1;
+   for (idx = 0; idx < capacity; idx++)
+      cache->entries[idx].block_number = -1;
+   pthread_mutex_init(&cache->lock, NULL);
+
+   return cache;
+}
+
+// Find the entry caching bNum, -1 if the block is not cached
+static int lookup(block_cache *cache, int bNum) {
+   int idx = cache->buckets[bNum % cache->num_buckets];
+
+   while (idx != -1 && cache->entries[idx].block_number != bNum)
+      idx = cache->entries[idx].hash_next;
+   return idx;
+}
+
+// Unlink an entry from the LRU list
+static void lruRemove(block_cache *cache, int idx) {
+   cache_entry *entry = cache->entries + idx;
+
+   if (entry->prev != -1)
+      cache->entries[entry->prev].next = entry->next;
+   else
+      cache->lru_head = entry->next;
+   if (entry->next != -1)
+      cache->entries[entry->next].prev = entry->prev;
+   else
+      cache->lru_tail = entry->prev;
+}
+
+// Make an entry the most recently used one
+static void lruPush(block_cache *cache, int idx) {
+   cache_entry *entry = cache->entries + idx;
+
+   entry->prev = -1;
+   entry->next = cache->lru_head;
+   if (cache->lru_head != -1)
+      cache->entries[cache->lru_head].prev = idx;
+   cache->lru_head = idx;
+   if (cache->lru_tail == -1)
+      cache->lru_tail = idx;
+}
+
+// Unlink an entry from its hash bucket
+static void hashRemove(block_cache *cache, int idx) {
+   int *link = cache->buckets +
+    (cache->entries[idx].block_number % cache->num_buckets);
+
+   while (*link != idx)
+      link = &cache->entries[*link].hash_next;
+   *link = cache->entries[idx].hash_next;
+}
+
+static int syncEntries(block_cache *cache);
+
+/* Returns a free entry for bNum, evicting the least recently used block (and writing it back if dirty) when the cache is full. With a journal, dirty metadata may only reach its home after its transaction, so the least recently used block that is not dirty metadata goes instead: committing from here could split an operation another thread is halfway through. Only a cache holding nothing else commits everything. The entry is hashed and at the head of the LRU list, its data is left for the caller to fill. Returns a negative error code if the write back fails. */
+static int allocEntry(block_cache *cache, int bNum) {
+   cache_entry *entry;
+   int idx, code;
+
+   if (cache->used < cache->capacity) {
+      idx = cache->used++;
+   }
+   else {
+      for (idx = cache->lru_tail; idx != -1 && cache->log != NULL &&
+       cache->entries[idx].dirty && cache->entries[idx].meta;
+       idx = cache->entries[idx].prev)
+         ;
+      if (idx == -1) {
+         code = syncEntries(cache);
+         if (code < 0)
+            return code;
+         idx = cache->lru_tail;
+      }
+      entry = cache->entries + idx;
+      if (entry->block_number != -1 && entry->dirty) {
+         code = writeBlock(cache->disk, entry->block_number, entry->data);
+         if (code < 0)
+            return code;
+         cache->stats.writebacks++;
+      }
+      lruRemove(cache, idx);
+      if (entry->block_number != -1) {
+         hashRemove(cache, idx);
+         cache->stats.evictions++;
+      }
+   }
+
+   entry = cache->entries + idx;
+   if (entry->dirty && entry->meta)
+      cache->dirty_meta--;
+   entry->block_number = bNum;
+   entry->dirty = 0;
+   entry->meta = 0;
+   entry->hash_next = cache->buckets[bNum % cache->num_buckets];
+   cache->buckets[bNum % cache->num_buckets] = idx;
+   lruPush(cache, idx);
+
+   return idx;
+}
+
+// Drop an entry that could not be filled from disk
+static void discardEntry(block_cache *cache, int idx) {
+   lruRemove(cache, idx);
+   hashRemove(cache, idx);
+   cache->entries[idx].block_number = -1;
+   // Park it at the tail so it is the next one reused
+   cache->entries[idx].prev = cache->lru_tail;
+   cache->entries[idx].next = -1;
+   if (cache->lru_tail != -1)
+      cache->entries[cache->lru_tail].next = idx;
+   else
+      cache->lru_head = idx;
+   cache->lru_tail = idx;
+}
+
+// Find or load the entry for bNum, returns its index or a libDisk error
+static int fetchEntry(block_cache *cache, int bNum) {
+   int idx, code;
+
+   idx = lookup(cache, bNum);
+   if (idx != -1) {
+      cache->stats.hits++;
+      lruRemove(cache, idx);
+      lruPush(cache, idx);
+      return idx;
+   }
+
+   cache->stats.misses++;
+   idx = allocEntry(cache, bNum);
+   if (idx < 0)
+      return idx;
+   code = readBlock(cache->disk, bNum, cache->entries[idx].data);
+   if (code < 0) {
+      discardEntry(cache, idx);
+      return code;
+   }
+   return idx;
+}
+
+/* Copies block bNum into 'block', reading it from disk only on a miss. Returns 0 on success or the libDisk error code. */
+int cacheRead(block_cache *cache, int bNum, void *block) {
+   int idx;
+
+   if (cache == NULL || bNum < 0 || block == NULL)
+      return ERROR_BADREAD;
+
+   pthread_mutex_lock(&cache->lock);
+   idx = fetchEntry(cache, bNum);
+   if (idx >= 0)
+      memcpy(block, cache->entries[idx].data, BLOCKSIZE);
+   pthread_mutex_unlock(&cache->lock);
+   return idx < 0 ? idx : 0;
+}
+
+/* Returns a read-only pointer to the contents of block bNum without copying it. Cached blocks come from the cache, blocks of a DISK_MMAP or DISK_MEMORY disk straight from its memory, anything else is loaded into the cache first. The pointer is only valid until the next call on the cache, by any thread, so a cache shared between threads is read with cacheRead() instead. Returns NULL on a read error. */
+const char* cachePeek(block_cache *cache, int bNum) {
+   char *block = NULL;
+   int idx;
+
+   if (cache == NULL || bNum < 0)
+      return NULL;
+
+   pthread_mutex_lock(&cache->lock);
+   // A dirty cached copy is newer than the mapping, so look in the cache first
+   if (lookup(cache, bNum) == -1) {
+      block = (char *)getBlockPtr(cache->disk, bNum);
+      if (block != NULL)
+         cache->stats.mapped++;
+   }
+   if (block == NULL) {
+      idx = fetchEntry(cache, bNum);
+      if (idx >= 0)
+         block = cache->entries[idx].data;
+   }
+   pthread_mutex_unlock(&cache->lock);
+   return block;
+}
+
+// Shared body of cacheReadRun and cacheSubmitRun, reads synchronously
+// without a queue
+static int readRun(block_cache *cache, disk_queue *queue, int bNum, int count,
+ void *buffer, void *token) {
+   char *out = (char *)buffer;
+   int idx, done = 0, missing, code = 0, submitted = 0;
+
+   if (cache == NULL || bNum < 0 || count < 0 || buffer == NULL)
+      return ERROR_BADREAD;
+
+   pthread_mutex_lock(&cache->lock);
+   while (done < count) {
+      idx = lookup(cache, bNum + done);
+      if (idx != -1) {
+         cache->stats.hits++;
+         memcpy(out + done * BLOCKSIZE, cache->entries[idx].data, BLOCKSIZE);
+         done++;
+         continue;
+      }
+
+      for (missing = 1; done + missing < count &&
+       lookup(cache, bNum + done + missing) == -1; missing++)
+         ;
+      cache->stats.misses += missing;
+      pthread_mutex_unlock(&cache->lock);
+      if (queue != NULL)
+         code = submitRead(queue, cache->disk, bNum + done, missing,
+          out + done * BLOCKSIZE, token);
+      else
+         code = readBlocks(cache->disk, bNum + done, missing,
+          out + done * BLOCKSIZE);
+      pthread_mutex_lock(&cache->lock);
+      if (code < 0)
+         break;
+      submitted += queue != NULL;
+      done += missing;
+   }
+   pthread_mutex_unlock(&cache->lock);
+   return code < 0 ? code : submitted;
+}
+
+/* Copies 'count' consecutive blocks starting at bNum into 'buffer'. Cached blocks are copied from the cache, and every stretch of uncached blocks is read with one readBlocks() call straight into 'buffer' without being added to the cache, so a long sequential read neither costs one I/O per block nor evicts the working set. The lock is dropped while the disk is read, so other threads keep using the cache; the caller has to keep the blocks of the run from being written meanwhile. Returns 0 on success or the libDisk error code. */
+int cacheReadRun(block_cache *cache, int bNum, int count, void *buffer) {
+   int code = readRun(cache, NULL, bNum, count, buffer, NULL);
+
+   return code < 0 ? code : 0;
+}
+
+/* Like cacheReadRun(), but the uncached stretches are submitted to 'queue' with 'token' instead of being read, so the caller can have several runs in flight. Cached blocks are in 'buffer' when the call returns, the rest once every request it submitted has completed, even if it returns an error. Without a queue the run is read synchronously. Returns the number of requests submitted or the libDisk error code. */
+int cacheSubmitRun(block_cache *cache, disk_queue *queue, int bNum, int count,
+ void *buffer, void *token) {
+   return readRun(cache, queue, bNum, count, buffer, token);
+}
+
+/* Loads the blocks bNum..bNum+count-1 that are not cached yet into the cache, each uncached stretch with one readBlocks() call, so blocks a sequential reader is about to ask for one at a time cost a single I/O. They go in clean and most recently used. Nothing is loaded for a DISK_MMAP or DISK_MEMORY disk, its blocks are already in memory. The lock is dropped while the disk is read, the caller has to keep the blocks from being written meanwhile. Returns the number of blocks loaded or the libDisk error code. */
+int cachePrefetch(block_cache *cache, int bNum, int count) {
+   char *buffer;
+   int idx, done = 0, missing, blk, code = 0, loaded = 0;
+
+   if (cache == NULL || bNum < 0 || count <= 0)
+      return 0;
+   if (getBlockPtr(cache->disk, bNum) != NULL)
+      return 0;
+   buffer = (char *)malloc((size_t)count * BLOCKSIZE);
+   if (buffer == NULL)
+      return ERROR_BADREAD;
+
+   pthread_mutex_lock(&cache->lock);
+   while (done < count && code == 0) {
+      if (lookup(cache, bNum + done) != -1) {
+         done++;
+         continue;
+      }
+      for (missing = 1; done + missing < count &&
+       lookup(cache, bNum + done + missing) == -1; missing++)
+         ;
+      pthread_mutex_unlock(&cache->lock);
+      code = readBlocks(cache->disk, bNum + done, missing, buffer);
+      pthread_mutex_lock(&cache->lock);
+      // Another thread may have loaded some of them in the meantime
+      for (blk = 0; code == 0 && blk < missing; blk++) {
+         if (lookup(cache, bNum + done + blk) != -1)
+            continue;
+         idx = allocEntry(cache, bNum + done + blk);
+         if (idx < 0) {
+            code = idx;
+            break;
+         }
+         memcpy(cache->entries[idx].data, buffer + blk * BLOCKSIZE, BLOCKSIZE);
+         cache->stats.prefetched++;
+         loaded++;
+      }
+      done += missing;
+   }
+   pthread_mutex_unlock(&cache->lock);
+   free(buffer);
+   return code < 0 ? code : loaded;
+}
+
+// Shared body of cacheWrite and cacheWriteData
+static int storeEntry(block_cache *cache, int bNum, void *block, int meta) {
+   int idx, code;
+
+   if (cache == NULL || bNum < 0 || block == NULL)
+      return ERROR_BADWRITE;
+
+   pthread_mutex_lock(&cache->lock);
+   // A transaction has to fit the journal, commit before it would overflow
+   if (meta && cache->log != NULL &&
+    cache->dirty_meta >= journalCapacity(cache->log)) {
+      idx = lookup(cache, bNum);
+      if (idx == -1 || !cache->entries[idx].dirty || !cache->entries[idx].meta) {
+         code = syncEntries(cache);
+         if (code < 0) {
+            pthread_mutex_unlock(&cache->lock);
+            return code;
+         }
+      }
+   }
+
+   idx = lookup(cache, bNum);
+   if (idx != -1) {
+      cache->stats.hits++;
+      lruRemove(cache, idx);
+      lruPush(cache, idx);
+   }
+   else {
+      // Whole block is overwritten, no need to read it first
+      cache->stats.misses++;
+      idx = allocEntry(cache, bNum);
+      if (idx < 0) {
+         pthread_mutex_unlock(&cache->lock);
+         return idx;
+      }
+   }
+
+   memcpy(cache->entries[idx].data, block, BLOCKSIZE);
+   if (cache->entries[idx].dirty && cache->entries[idx].meta)
+      cache->dirty_meta--;
+   cache->entries[idx].dirty = 1;
+   cache->entries[idx].meta = meta;
+   if (meta)
+      cache->dirty_meta++;
+   pthread_mutex_unlock(&cache->lock);
+   return 0;
+}
+
+/* Stores 'block' as the new contents of metadata block bNum. The block is only marked dirty, it reaches the disk when it is evicted or on cacheSync(), through the journal if one is attached. Returns 0 on success or a libDisk error code. */
+int cacheWrite(block_cache *cache, int bNum, void *block) {
+   return storeEntry(cache, bNum, block, 1);
+}
+
+/* Same as cacheWrite() for file data, which is written home directly and ahead of any journal commit. */
+int cacheWriteData(block_cache *cache, int bNum, void *block) {
+   return storeEntry(cache, bNum, block, 0);
+}
+
+/* Makes room for an operation that is about to write up to 'blocks' metadata blocks, so all of them land in the same transaction: if they would not fit next to the metadata already dirty, everything dirty is committed first. Does nothing without a journal. Returns 0 on success or a libDisk error code. */
+int cacheReserve(block_cache *cache, int blocks) {
+   int code = 0;
+
+   if (cache == NULL || cache->log == NULL)
+      return 0;
+   if (blocks > journalCapacity(cache->log))
+      blocks = journalCapacity(cache->log);
+   pthread_mutex_lock(&cache->lock);
+   if (cache->dirty_meta + blocks > journalCapacity(cache->log))
+      code = syncEntries(cache);
+   pthread_mutex_unlock(&cache->lock);
+   return code;
+}
+
+/* Routes later metadata writeback of the cache through 'log', NULL detaches it. */
+void cacheAttachJournal(block_cache *cache, journal *log) {
+   pthread_mutex_lock(&cache->lock);
+   cache->log = log;
+   pthread_mutex_unlock(&cache->lock);
+}
+
+// qsort order for dirty entries, by block number
+static int compareEntries(const void *a, const void *b) {
+   return (*(cache_entry **)a)->block_number -
+    (*(cache_entry **)b)->block_number;
+}
+
+// Mark a run of entries that reached the disk clean
+static void markClean(block_cache *cache, cache_entry **run, int count) {
+   int idx;
+
+   for (idx = 0; idx < count; idx++) {
+      if (run[idx]->meta)
+         cache->dirty_meta--;
+      run[idx]->dirty = 0;
+   }
+   cache->stats.writebacks += count;
+}
+
+/* Write sorted dirty entries home, one request per consecutive run. Every run is submitted to the queue of the cache before any is waited for, so the disk has up to WRITE_DEPTH of them at once. They have all completed when it returns, so what follows still comes after them. Without a queue each run goes out with writeBlockv(). */
+static int writeRuns(block_cache *cache, cache_entry **dirty, int count) {
+   void *data[JOURNAL_MAX_BLOCKS > 64 ? JOURNAL_MAX_BLOCKS : 64];
+   disk_completion done[WRITE_DEPTH];
+   disk_queue *queue;
+   int *runs;
+   int idx, run, got, code, result = 0;
+   int limit = sizeof(data) / sizeof(data[0]);
+
+   if (cache->queue == NULL)
+      cache->queue = diskQueueCreate(WRITE_DEPTH);
+   // Run lengths by first entry, for when their completions come back
+   runs = (int *)malloc(sizeof(int) * (count > 0 ? count : 1));
+   queue = runs != NULL ? cache->queue : NULL;
+
+   for (idx = 0; idx < count; idx += run) {
+      data[0] = dirty[idx]->data;
+      for (run = 1; run < limit && idx + run < count &&
+       dirty[idx + run]->block_number == dirty[idx]->block_number + run; run++)
+         data[run] = dirty[idx + run]->data;
+
+      if (queue != NULL) {
+         runs[idx] = run;
+         code = submitWritev(queue, cache->disk, dirty[idx]->block_number, run,
+          data, (void *)(intptr_t)idx);
+      }
+      else {
+         code = writeBlockv(cache->disk, dirty[idx]->block_number, run, data);
+         if (code == 0)
+            markClean(cache, dirty + idx, run);
+      }
+      if (code < 0)
+         result = result ? result : code;
+   }
+
+   while (queue != NULL &&
+    (got = diskQueueWait(queue, 1, done, WRITE_DEPTH)) != 0) {
+      if (got < 0) {
+         result = result ? result : ERROR_BADWRITE;
+         break;
+      }
+      for (idx = 0; idx < got; idx++) {
+         if (done[idx].result < 0) {
+            result = result ? result : done[idx].result;
+            continue;
+         }
+         run = (intptr_t)done[idx].token;
+         markClean(cache, dirty + run, runs[run]);
+      }
+   }
+   free(runs);
+   return result;
+}
+
+// Body of cacheSync(), called with the lock held
+static int syncEntries(block_cache *cache) {
+   cache_entry **dirty;
+   void **data;
+   int *targets;
+   int idx, first, chunk, meta, count = 0, code, result = 0;
+
+   dirty = (cache_entry **)malloc(sizeof(cache_entry *) * cache->capacity);
+   data = (void **)malloc(sizeof(void *) * cache->capacity);
+   targets = (int *)malloc(sizeof(int) * cache->capacity);
+   if (dirty == NULL || data == NULL || targets == NULL) {
+      free(dirty);
+      free(data);
+      free(targets);
+      return ERROR_BADWRITE;
+   }
+
+   for (meta = 0; meta <= 1; meta++) {
+      count = 0;
+      for (idx = 0; idx < cache->used; idx++) {
+         if (cache->entries[idx].block_number != -1 &&
+          cache->entries[idx].dirty && cache->entries[idx].meta == meta)
+            dirty[count++] = cache->entries + idx;
+      }
+      qsort(dirty, count, sizeof(cache_entry *), compareEntries);
+
+      if (!meta || cache->log == NULL) {
+         code = writeRuns(cache, dirty, count);
+         result = result ? result : code;
+         // Metadata must not be committed ahead of data that failed
+         if (result < 0)
+            break;
+         continue;
+      }
+
+      chunk = journalCapacity(cache->log);
+      for (first = 0; first < count; first += chunk) {
+         if (chunk > count - first)
+            chunk = count - first;
+         for (idx = 0; idx < chunk; idx++) {
+            targets[idx] = dirty[first + idx]->block_number;
+            data[idx] = dirty[first + idx]->data;
+         }
+         code = journalCommit(cache->log, chunk, targets, data);
+         if (code == 0)
+            code = writeRuns(cache, dirty + first, chunk);
+         if (code < 0) {
+            result = result ? result : code;
+            break;
+         }
+      }
+   }
+
+   free(dirty);
+   free(data);
+   free(targets);
+   return result;
+}
+
+/* Writes every dirty block back to disk. Dirty blocks are sorted and each run of consecutive block numbers goes out as one request, with many runs in flight at once. File data goes first. With a journal attached, metadata is then committed in transactions of at most journalCapacity() blocks, each written home right after its commit, so a crash leaves either the old or the new metadata. Returns 0 on success or the first libDisk error code, blocks that failed stay dirty. */
+int cacheSync(block_cache *cache) {
+   int code;
+
+   if (cache == NULL)
+      return ERROR_BADWRITE;
+
+   pthread_mutex_lock(&cache->lock);
+   code = syncEntries(cache);
+   pthread_mutex_unlock(&cache->lock);
+   return code;
+}
+
+/* Copies the counters of the cache into stats, and starts them over from zero if reset is set. */
+void cacheStats(block_cache *cache, cache_stats *stats, int reset) {
+   pthread_mutex_lock(&cache->lock);
+   if (stats != NULL)
+      memcpy(stats, &cache->stats, sizeof(cache_stats));
+   if (reset)
+      memset(&cache->stats, 0, sizeof(cache_stats));
+   pthread_mutex_unlock(&cache->lock);
+}
+
+/* Syncs and frees the cache. The disk itself is left open. Returns the result of the final cacheSync(). */
+int cacheDestroy(block_cache *cache) {
+   int code;
+
+   if (cache == NULL)
+      return ERROR_BADWRITE;
+
+   code = cacheSync(cache);
+   diskQueueDestroy(cache->queue);
+   pthread_mutex_destroy(&cache->lock);
+   free(cache->buckets);
+   free(cache->entries);
+   free(cache);
+   return code;
+}
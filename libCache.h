@@ -0,0 +1,63 @@
+#ifndef LIBCACHE_H
+#define LIBCACHE_H
+
+#include <pthread.h>
+#include "tinyFS.h"
+#include "libDisk.h"
+#include "libJournal.h"
+
+//counters used to size the cache, see tfs_cacheStats()
+typedef struct cache_stats {
+   unsigned long hits;
+   unsigned long misses;
+   unsigned long evictions; //blocks pushed out to make room
+   unsigned long writebacks; //dirty blocks written to disk
+   unsigned long mapped; //cachePeek() calls served from a DISK_MMAP mapping
+   unsigned long prefetched; //blocks loaded ahead of use by cachePrefetch()
+} cache_stats;
+
+//one cached block, linked into the LRU list and a hash bucket chain
+typedef struct cache_entry {
+   int block_number; //-1 if the entry is unused
+   int dirty;
+   int meta; //written with cacheWrite(), goes through the journal
+   int prev; //LRU neighbours (indices into entries), -1 terminates
+   int next;
+   int hash_next; //next entry in the same bucket, -1 terminates
+   char data[BLOCKSIZE];
+} cache_entry;
+
+//write-back LRU cache of disk blocks in front of libDisk. Every call holds
+//'lock', so threads may share a cache
+typedef struct block_cache {
+   pthread_mutex_t lock;
+   int disk;
+   int capacity;
+   int used;
+   int lru_head; //most recently used
+   int lru_tail; //least recently used, next to be evicted
+   int num_buckets;
+   int *buckets;
+   cache_entry *entries;
+   journal *log; //NULL if metadata is written home directly
+   int dirty_meta; //dirty entries with meta set
+   disk_queue *queue; //writeback requests, made by the first cacheSync()
+   cache_stats stats;
+} block_cache;
+
+block_cache* cacheCreate(int disk, int capacity);
+int cacheRead(block_cache *cache, int bNum, void *block);
+const char* cachePeek(block_cache *cache, int bNum);
+int cacheReadRun(block_cache *cache, int bNum, int count, void *buffer);
+int cacheSubmitRun(block_cache *cache, disk_queue *queue, int bNum, int count,
+ void *buffer, void *token);
+int cachePrefetch(block_cache *cache, int bNum, int count);
+int cacheWrite(block_cache *cache, int bNum, void *block);
+int cacheWriteData(block_cache *cache, int bNum, void *block);
+int cacheReserve(block_cache *cache, int blocks);
+void cacheAttachJournal(block_cache *cache, journal *log);
+int cacheSync(block_cache *cache);
+void cacheStats(block_cache *cache, cache_stats *stats, int reset);
+int cacheDestroy(block_cache *cache);
+
+#endif
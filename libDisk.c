@@ -6,14 +6,231 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+#endif
 
 #include "tinyFS.h"
 #include "tinyFS_errno.h"
+#include "libDisk.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//open disks, indexed by disk number
+static disk_info disks[MAX_DISKS];
+//guards claiming and releasing disk slots and the memory disk registry, so
+//several threads may open and close disks at once. I/O on an open disk
+//never takes it
+static pthread_mutex_t disks_lock = PTHREAD_MUTEX_INITIALIZER;
+//backend used by openDisk(), see setDiskBackend()
+static int default_backend = DISK_FILE;
+//engine asked for by diskQueueCreate(), see setAsyncEngine()
+static int default_engine = ASYNC_AUTO;
+
+//contents of a DISK_MEMORY disk, outlives closeDisk() like a file would
+typedef struct memory_disk {
+   char *name; //NULL if the slot is unused
+   char *data;
+   off_t size;
+} memory_disk;
+
+static memory_disk memory_disks[MAX_DISKS];
+
+//I/O done by the calling thread on any disk, see diskThreadStats()
+static __thread disk_stats thread_stats;
+
+//rough figures for typical devices, latency in ns and bandwidth in bytes/s
+const disk_profile disk_profile_hdd = {8000000, 8000000, 10000000, 150000000, 0};
+const disk_profile disk_profile_ssd = {90000, 40000, 1000000, 500000000, 0};
+const disk_profile disk_profile_nvme = {20000, 15000, 50000, 3000000000L, 0};
+
+// Look up an open disk, NULL if the disk number is not in use
+static disk_info* getDisk(int disk) {
+   if (disk < 0 || disk >= MAX_DISKS || !disks[disk].open)
+      return NULL;
+   return disks + disk;
+}
+
+//kinds of call counted by accountIO()
+#define IO_READ 0
+#define IO_WRITE 1
+#define IO_SYNC 2
+
+// Add to a counter of a disk that several threads may be using at once
+#define COUNT(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+// Count one call that moves count blocks and charge its simulated time
+static void accountIO(disk_info *info, int kind, int count) {
+   struct timespec pause;
+   long long ns;
+
+   if (kind == IO_READ) {
+      COUNT(info->stats.reads, count);
+      COUNT(info->stats.read_calls, 1);
+      thread_stats.reads += count;
+      thread_stats.read_calls++;
+      ns = info->profile.read_latency;
+   }
+   else if (kind == IO_WRITE) {
+      COUNT(info->stats.writes, count);
+      COUNT(info->stats.write_calls, 1);
+      thread_stats.writes += count;
+      thread_stats.write_calls++;
+      ns = info->profile.write_latency;
+   }
+   else {
+      COUNT(info->stats.syncs, 1);
+      thread_stats.syncs++;
+      ns = info->profile.sync_latency;
+   }
 
-/* This functions opens a regular UNIX file and designates the first nBytes of it as space for the emulated disk. nBytes should be an integral number of the block size. If nBytes > 0 and there is already a file by the given filename, that file’s contents may be overwritten. If nBytes is 0, an existing disk is opened, and should not be overwritten. There is no requirement to maintain integrity of any file content beyond nBytes. The return value is -1 on failure or a disk number on success. */
-int openDisk(char *filename, int nBytes){
-   int index, file = -1;
-   char buffer[nBytes];
+   if (info->profile.bandwidth > 0)
+      ns += (long long)count * BLOCKSIZE * 1000000000LL / info->profile.bandwidth;
+   COUNT(info->busy_ns, ns);
+   if (info->profile.realtime && ns > 0) {
+      pause.tv_sec = ns / 1000000000LL;
+      pause.tv_nsec = ns % 1000000000LL;
+      nanosleep(&pause, NULL);
+   }
+}
+
+// The memory disk called filename, NULL if there is none
+static memory_disk* findMemoryDisk(char *filename) {
+   int idx;
+
+   for (idx = 0; idx < MAX_DISKS; idx++) {
+      if (memory_disks[idx].name != NULL &&
+       strcmp(memory_disks[idx].name, filename) == 0)
+         return memory_disks + idx;
+   }
+   return NULL;
+}
+
+// Whether a disk that is still open uses the memory of mem
+static int memoryInUse(memory_disk *mem) {
+   int disk;
+
+   for (disk = 0; disk < MAX_DISKS; disk++) {
+      if (disks[disk].open && disks[disk].backend == DISK_MEMORY &&
+       disks[disk].map == mem->data)
+         return 1;
+   }
+   return 0;
+}
+
+/* Opens the DISK_MEMORY disk called filename as disk number 'disk'. Like a file, nBytes > 0 creates it or clears it to nBytes of zeros, growing or shrinking it, and nBytes == 0 opens an existing one. Called with disks_lock held. Returns the disk number or ERROR_BADOPEN. */
+static int openMemoryDisk(int disk, char *filename, off_t nBytes) {
+   memory_disk *mem = findMemoryDisk(filename);
+   char *data;
+   int idx;
+
+   if (mem == NULL) {
+      if (nBytes == 0)
+         return ERROR_BADOPEN;
+      for (idx = 0; idx < MAX_DISKS && memory_disks[idx].name != NULL; idx++)
+         ;
+      if (idx == MAX_DISKS)
+         return ERROR_BADOPEN;
+      mem = memory_disks + idx;
+      mem->name = strdup(filename);
+      mem->data = NULL;
+      mem->size = 0;
+   }
+
+   if (nBytes > 0 && !memoryInUse(mem)) {
+      // Nothing to keep, fresh zeroed memory is only paged in once touched
+      data = (char *)calloc(1, nBytes);
+      if (data == NULL)
+         return ERROR_BADOPEN;
+      free(mem->data);
+      mem->data = data;
+      mem->size = nBytes;
+   }
+   else if (nBytes > mem->size) {
+      // Open disks point into the old memory, it cannot move under them
+      return ERROR_BADOPEN;
+   }
+   else if (nBytes > 0) {
+      // Cut to nBytes like a truncated file, the memory past it stays
+      // with the disks still open on it
+      memset(mem->data, 0, nBytes);
+      mem->size = nBytes;
+   }
+
+   disks[disk].fd = -1;
+   disks[disk].map = mem->data;
+   disks[disk].size = mem->size;
+   return disk;
+}
+
+// Give back a slot claimed by a failed openDiskBackend()
+static int releaseSlot(int disk) {
+   pthread_mutex_lock(&disks_lock);
+   disks[disk].claimed = 0;
+   pthread_mutex_unlock(&disks_lock);
+   return ERROR_BADOPEN;
+}
+
+// How many of count block writes may go through before an injected failure
+static int allowWrites(disk_info *info, int count) {
+   if (info->fail_after < 0)
+      return count;
+   if (count > info->fail_after)
+      count = info->fail_after;
+   info->fail_after -= count;
+   return count;
+}
+
+/* This functions opens a regular UNIX file and designates the first nBytes of it as space for the emulated disk. nBytes should be an integral number of the block size. If nBytes > 0 and there is already a file by the given filename, that file’s contents may be overwritten: the file is cut to nBytes of zeros without writing them, so the new disk is sparse and opening it takes the same time whatever its size. If nBytes is 0, an existing disk is opened, and should not be overwritten. There is no requirement to maintain integrity of any file content beyond nBytes. The return value is -1 on failure or a disk number on success. */
+int openDisk(char *filename, off_t nBytes){
+   return openDiskBackend(filename, nBytes, default_backend);
+}
+
+/* Same as openDisk() but with an explicit backend. DISK_FILE serves blocks with pread/pwrite, DISK_MMAP maps the whole disk and serves them with memcpy (and getBlockPtr()). DISK_MEMORY never touches the file system, the disk lives in memory under 'filename' until removeMemoryDisk(), so it can be closed and opened again like a file. */
+int openDiskBackend(char *filename, off_t nBytes, int backend){
+   int disk, file = -1;
+   struct stat info;
+
+   pthread_mutex_lock(&disks_lock);
+   for (disk = 0; disk < MAX_DISKS && disks[disk].claimed; disk++)
+      ;
+   if (disk == MAX_DISKS) {
+      pthread_mutex_unlock(&disks_lock);
+      return ERROR_BADOPEN;
+   }
+   disks[disk].claimed = 1;
+
+   memset(&disks[disk].profile, 0, sizeof(disk_profile));
+   disks[disk].busy_ns = 0;
+   memset(&disks[disk].stats, 0, sizeof(disk_stats));
+   disks[disk].fail_after = -1;
+   disks[disk].backend = backend;
+   if (backend == DISK_MEMORY) {
+      if (openMemoryDisk(disk, filename, nBytes) < 0) {
+         disks[disk].claimed = 0;
+         disk = ERROR_BADOPEN;
+      }
+      else {
+         disks[disk].open = 1;
+      }
+      pthread_mutex_unlock(&disks_lock);
+      return disk;
+   }
+   // The slot is ours, the file is opened without holding up other threads
+   pthread_mutex_unlock(&disks_lock);
 
    if(!nBytes) {
       file = open(filename, O_RDWR, S_IRUSR | S_IWUSR);
@@ -21,35 +238,71 @@ int openDisk(char *filename, int nBytes){
       file = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
    }
    if(file == -1)
-      return ERROR_BADOPEN;
+      return releaseSlot(disk);
 
-   for(index = 0; index < nBytes; index++) {
-      buffer[index] = 0;
+   // A new disk is a sparse file of zeros: dropping the old contents and
+   // setting the size writes nothing, blocks only take space once written
+   if(nBytes && (ftruncate(file, 0) == -1 || ftruncate(file, nBytes) == -1)) {
+      close(file);
+      return releaseSlot(disk);
    }
-   if(write(file, buffer, nBytes) == -1)
-      return ERROR_BADOPEN;
-   
-   return file;
+
+   // The size never changes while the disk is open, so probe it only once
+   if(fstat(file, &info) == -1) {
+      close(file);
+      return releaseSlot(disk);
+   }
+
+   disks[disk].map = NULL;
+   if(backend == DISK_MMAP && info.st_size > 0) {
+      disks[disk].map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+       MAP_SHARED, file, 0);
+      if(disks[disk].map == MAP_FAILED) {
+         close(file);
+         return releaseSlot(disk);
+      }
+   }
+
+   disks[disk].fd = file;
+   disks[disk].size = info.st_size;
+   disks[disk].open = 1;
+   return disk;
+}
+
+/* Selects the backend used by later openDisk() calls, so callers such as tfs_mount() can be switched to DISK_MMAP without changing them. */
+void setDiskBackend(int backend) {
+   default_backend = backend;
+}
+
+/* Returns a pointer to block bNum inside the memory of a DISK_MMAP or DISK_MEMORY disk, so the block can be read without copying it. Writes through the pointer reach the disk like writeBlock() does. Returns NULL for DISK_FILE, for an empty DISK_MMAP file or for a bad block number. */
+void* getBlockPtr(int disk, int bNum) {
+   disk_info *info = getDisk(disk);
+
+   if (info == NULL || info->map == NULL || bNum < 0 ||
+    (off_t)bNum * BLOCKSIZE + BLOCKSIZE > info->size)
+      return NULL;
+   return info->map + (off_t)bNum * BLOCKSIZE;
 }
  
 /* readBlock() reads an entire block of BLOCKSIZE bytes from the open disk (identified by ‘disk’) and copies the result into a local buffer (must be at least of BLOCKSIZE bytes). The bNum is a logical block number, which must be translated into a byte offset within the disk. The translation from logical to physical block is straightforward: bNum=0 is the very first byte of the file. bNum=1 is BLOCKSIZE bytes into the disk, bNum=n is n*BLOCKSIZE bytes into the disk. On success, it returns 0. -1 or smaller is returned if disk is not available (hasn’t been opened) or any other failures. You must define your own error code system. */
 int readBlock(int disk, int bNum, void *block){
-   int disk_size = -1;
+   disk_info *info = getDisk(disk);
+   off_t offset = (off_t)bNum * BLOCKSIZE;
 
-   if (disk < 0 || bNum < 0 || block == NULL)
+   if (info == NULL || bNum < 0 || block == NULL)
       return ERROR_BADREAD;
 
-   disk_size = lseek(disk, 0, SEEK_END);
-   if(disk_size == -1)
+   if((offset + BLOCKSIZE) > info->size)
       return ERROR_BADREAD;
+   accountIO(info, IO_READ, 1);
 
-   if((bNum * BLOCKSIZE + BLOCKSIZE) > disk_size)
-      return ERROR_BADREAD;
-   
-   if(lseek(disk, bNum * BLOCKSIZE, SEEK_SET) != (bNum * BLOCKSIZE))
-      return ERROR_BADREAD;
-   
-   if(read(disk, block, BLOCKSIZE) == -1)
+   if(info->map != NULL) {
+      memcpy(block, info->map + offset, BLOCKSIZE);
+      return 0;
+   }
+
+   // Positional read, no shared file offset to race on
+   if(pread(info->fd, block, BLOCKSIZE, offset) != BLOCKSIZE)
       return ERROR_BADREAD;
    
    return 0;
@@ -57,38 +310,786 @@ int readBlock(int disk, int bNum, void *block){
  
 /* writeBlock() takes disk number ‘disk’ and logical block number ‘bNum’ and writes the content of the buffer ‘block’ to that location. ‘block’ must be integral with BLOCKSIZE. The disk must be open. Just as in readBlock(), writeBlock() must translate the logical block bNum to the correct byte position in the file. On success, it returns 0. -1 or smaller is returned if disk is not available (i.e. hasn’t been opened) or any other failures. You must define your own error code system. */
 int writeBlock(int disk, int bNum, void *block) {
-   int disk_size = -1;
-   
-   if (disk < 0 || bNum < 0 || block == NULL)
-      return ERROR_BADWRITE;
+   disk_info *info = getDisk(disk);
+   off_t offset = (off_t)bNum * BLOCKSIZE;
    
-   disk_size = lseek(disk, 0, SEEK_END);
-   if(disk_size == -1)
+   if (info == NULL || bNum < 0 || block == NULL)
       return ERROR_BADWRITE;
    
-   if((bNum * BLOCKSIZE + BLOCKSIZE) > disk_size)
+   if((offset + BLOCKSIZE) > info->size || allowWrites(info, 1) == 0)
       return ERROR_BADWRITE;
+   accountIO(info, IO_WRITE, 1);
 
-   if(lseek(disk, bNum * BLOCKSIZE, SEEK_SET) != (bNum * BLOCKSIZE))
-      return ERROR_BADWRITE;
+   if(info->map != NULL) {
+      memcpy(info->map + offset, block, BLOCKSIZE);
+      return 0;
+   }
 
-   if(write(disk, block, BLOCKSIZE) == -1)
+   if(pwrite(info->fd, block, BLOCKSIZE, offset) != BLOCKSIZE)
       return ERROR_BADWRITE;   
 
    return 0;
 }
  
-/* closeDisk() takes a disk number ‘disk’ and makes the disk closed to further I/O; i.e. any subsequent reads or writes to a closed disk should return an error. Closing a disk should also close the underlying file, committing any buffered writes. */
+// Check that blocks bNum..bNum+count-1 lie on the disk
+static int validRange(disk_info *info, int bNum, int count) {
+   return bNum >= 0 && count > 0 &&
+    (off_t)(bNum + count) * BLOCKSIZE <= info->size;
+}
+
+/* readBlocks() reads the count consecutive blocks starting at bNum into 'blocks', which must hold count * BLOCKSIZE bytes. The whole range is read with a single pread unless the kernel returns it in pieces. Returns 0 on success or ERROR_BADREAD. */
+int readBlocks(int disk, int bNum, int count, void *blocks) {
+   disk_info *info = getDisk(disk);
+   size_t done = 0, total = (size_t)count * BLOCKSIZE;
+   ssize_t got;
+
+   if (info == NULL || blocks == NULL || !validRange(info, bNum, count))
+      return ERROR_BADREAD;
+   accountIO(info, IO_READ, count);
+
+   if (info->map != NULL) {
+      memcpy(blocks, info->map + (off_t)bNum * BLOCKSIZE, total);
+      return 0;
+   }
+
+   while (done < total) {
+      got = pread(info->fd, (char *)blocks + done, total - done,
+       (off_t)bNum * BLOCKSIZE + done);
+      if (got <= 0)
+         return ERROR_BADREAD;
+      done += got;
+   }
+   return 0;
+}
+
+/* writeBlocks() writes count consecutive blocks from 'blocks' starting at block bNum with a single pwrite. Returns 0 on success or ERROR_BADWRITE. An injected failure lets only the blocks before it through, like a crash in the middle of the write. */
+int writeBlocks(int disk, int bNum, int count, void *blocks) {
+   disk_info *info = getDisk(disk);
+   size_t done = 0, total;
+   ssize_t put;
+   int allowed;
+
+   if (info == NULL || blocks == NULL || !validRange(info, bNum, count))
+      return ERROR_BADWRITE;
+   allowed = allowWrites(info, count);
+   if (allowed < count) {
+      if (allowed > 0)
+         writeBlocks(disk, bNum, allowed, blocks);
+      return ERROR_BADWRITE;
+   }
+   total = (size_t)count * BLOCKSIZE;
+   accountIO(info, IO_WRITE, count);
+
+   if (info->map != NULL) {
+      memcpy(info->map + (off_t)bNum * BLOCKSIZE, blocks, total);
+      return 0;
+   }
+
+   while (done < total) {
+      put = pwrite(info->fd, (char *)blocks + done, total - done,
+       (off_t)bNum * BLOCKSIZE + done);
+      if (put <= 0)
+         return ERROR_BADWRITE;
+      done += put;
+   }
+   return 0;
+}
+
+// Shared body of readBlockv/writeBlockv, IOV_MAX blocks per syscall
+static int transferv(disk_info *info, int bNum, int count, void **blocks,
+ int writing) {
+   struct iovec iov[IOV_MAX];
+   int idx, batch, first = 0;
+   ssize_t moved;
+
+   if (info->map != NULL) {
+      for (idx = 0; idx < count; idx++) {
+         if (writing)
+            memcpy(info->map + (off_t)(bNum + idx) * BLOCKSIZE, blocks[idx],
+             BLOCKSIZE);
+         else
+            memcpy(blocks[idx], info->map + (off_t)(bNum + idx) * BLOCKSIZE,
+             BLOCKSIZE);
+      }
+      return 0;
+   }
+
+   while (first < count) {
+      batch = count - first < IOV_MAX ? count - first : IOV_MAX;
+      for (idx = 0; idx < batch; idx++) {
+         iov[idx].iov_base = blocks[first + idx];
+         iov[idx].iov_len = BLOCKSIZE;
+      }
+      if (writing)
+         moved = pwritev(info->fd, iov, batch,
+          (off_t)(bNum + first) * BLOCKSIZE);
+      else
+         moved = preadv(info->fd, iov, batch,
+          (off_t)(bNum + first) * BLOCKSIZE);
+      if (moved != (ssize_t)batch * BLOCKSIZE)
+         return -1;
+      first += batch;
+   }
+   return 0;
+}
+
+/* readBlockv() reads the count consecutive blocks starting at bNum into the separate buffers blocks[0..count-1] with preadv. Returns 0 on success or ERROR_BADREAD. */
+int readBlockv(int disk, int bNum, int count, void **blocks) {
+   disk_info *info = getDisk(disk);
+
+   if (info == NULL || blocks == NULL || !validRange(info, bNum, count))
+      return ERROR_BADREAD;
+   accountIO(info, IO_READ, count);
+   if (transferv(info, bNum, count, blocks, 0) < 0)
+      return ERROR_BADREAD;
+   return 0;
+}
+
+/* writeBlockv() writes the separate buffers blocks[0..count-1] to the count consecutive blocks starting at bNum with pwritev. Returns 0 on success or ERROR_BADWRITE. Injected failures cut the write short like in writeBlocks(). */
+int writeBlockv(int disk, int bNum, int count, void **blocks) {
+   disk_info *info = getDisk(disk);
+   int allowed;
+
+   if (info == NULL || blocks == NULL || !validRange(info, bNum, count))
+      return ERROR_BADWRITE;
+   allowed = allowWrites(info, count);
+   if (allowed > 0)
+      accountIO(info, IO_WRITE, allowed);
+   if (allowed > 0 && transferv(info, bNum, allowed, blocks, 1) < 0)
+      return ERROR_BADWRITE;
+   if (allowed < count)
+      return ERROR_BADWRITE;
+   return 0;
+}
+
+/* syncDisk() makes every write to the disk so far durable, with fsync for DISK_FILE and msync for DISK_MMAP. DISK_MEMORY has nothing to sync and only charges the simulated sync time. Writes are not synced otherwise, callers that need ordering (such as the journal) call this at their barriers. Returns 0 on success or ERROR_BADWRITE, also once an injected failure has been hit. */
+int syncDisk(int disk) {
+   disk_info *info = getDisk(disk);
+
+   if (info == NULL || info->fail_after == 0)
+      return ERROR_BADWRITE;
+   accountIO(info, IO_SYNC, 0);
+   if (info->backend == DISK_MEMORY)
+      return 0;
+   if (info->map != NULL && msync(info->map, info->size, MS_SYNC) == -1)
+      return ERROR_BADWRITE;
+   if (fsync(info->fd) == -1)
+      return ERROR_BADWRITE;
+   return 0;
+}
+
+/* diskFailAfter() injects a failure: after 'writes' more blocks have been written every block write fails, as if the machine had stopped at that point. A negative count turns injection off. Meant for crash testing the journal. Returns 0 or ERROR_BADWRITE if the disk is not open. */
+int diskFailAfter(int disk, int writes) {
+   disk_info *info = getDisk(disk);
+
+   if (info == NULL)
+      return ERROR_BADWRITE;
+   info->fail_after = writes < 0 ? -1 : writes;
+   return 0;
+}
+
+/* setDiskProfile() makes the disk behave like the device described by 'profile': every call is charged its latency plus its transfer time at the profile bandwidth, so batching shows up in the simulated time the same way it would on the device. The time is only added up (see diskBusyTime()) unless profile->realtime is set. NULL turns the simulation off. Returns 0 or ERROR_BADOPEN if the disk is not open. */
+int setDiskProfile(int disk, const disk_profile *profile) {
+   disk_info *info = getDisk(disk);
+
+   if (info == NULL)
+      return ERROR_BADOPEN;
+   if (profile == NULL)
+      memset(&info->profile, 0, sizeof(disk_profile));
+   else
+      memcpy(&info->profile, profile, sizeof(disk_profile));
+   return 0;
+}
+
+/* diskBusyTime() returns the simulated device time in ns the disk has been charged since it was opened, or ERROR_BADOPEN if it is not open. */
+long long diskBusyTime(int disk) {
+   disk_info *info = getDisk(disk);
+
+   if (info == NULL)
+      return ERROR_BADOPEN;
+   return info->busy_ns;
+}
+
+/* diskStats() copies the I/O counters of the disk, counted since it was opened, into stats. Returns 0 or ERROR_BADOPEN if the disk is not open. */
+int diskStats(int disk, disk_stats *stats) {
+   disk_info *info = getDisk(disk);
+
+   if (info == NULL)
+      return ERROR_BADOPEN;
+   memcpy(stats, &info->stats, sizeof(disk_stats));
+   return 0;
+}
+
+/* diskThreadStats() returns the I/O the calling thread has done on any disk since it started. The counters are thread local, so a caller can tell the I/O of one of its calls from the difference of two snapshots without locking. */
+const disk_stats* diskThreadStats(void) {
+   return &thread_stats;
+}
+
+/* removeMemoryDisk() frees the DISK_MEMORY disk called filename, the counterpart of unlink(). Returns 0, or ERROR_BADOPEN if there is no such disk or it is still open. */
+int removeMemoryDisk(char *filename) {
+   memory_disk *mem;
+
+   pthread_mutex_lock(&disks_lock);
+   mem = findMemoryDisk(filename);
+   if (mem == NULL || memoryInUse(mem)) {
+      pthread_mutex_unlock(&disks_lock);
+      return ERROR_BADOPEN;
+   }
+   free(mem->name);
+   free(mem->data);
+   mem->name = NULL;
+   mem->data = NULL;
+   mem->size = 0;
+   pthread_mutex_unlock(&disks_lock);
+   return 0;
+}
+
+/* renameDisk() gives the disk called from the name to, replacing a disk already called to, the counterpart of rename(). A DISK_MEMORY disk is renamed in memory and neither it nor the one it replaces may be open, any other name is a file. Returns 0 or ERROR_BADOPEN. */
+int renameDisk(char *from, char *to) {
+   memory_disk *mem, *old;
+   char *name;
+
+   pthread_mutex_lock(&disks_lock);
+   mem = findMemoryDisk(from);
+   if (mem == NULL) {
+      pthread_mutex_unlock(&disks_lock);
+      return rename(from, to) == 0 ? 0 : ERROR_BADOPEN;
+   }
+   old = findMemoryDisk(to);
+   name = strdup(to);
+   if (name == NULL || memoryInUse(mem) || (old != NULL && memoryInUse(old))) {
+      pthread_mutex_unlock(&disks_lock);
+      free(name);
+      return ERROR_BADOPEN;
+   }
+   if (old != NULL && old != mem) {
+      free(old->name);
+      free(old->data);
+      old->name = NULL;
+      old->data = NULL;
+      old->size = 0;
+   }
+   free(mem->name);
+   mem->name = name;
+   pthread_mutex_unlock(&disks_lock);
+   return 0;
+}
+
+/* closeDisk() takes a disk number ‘disk’ and makes the disk closed to further I/O; i.e. any subsequent reads or writes to a closed disk should return an error. Buffered writes are handed to the kernel but not forced to stable storage, use syncDisk() first for that. */
 void closeDisk(int disk) {
-   if(lseek(disk, 0, SEEK_SET) < 0 || disk < 0) {
+   disk_info *info = getDisk(disk);
+
+   if(info == NULL) {
       exit(ERROR_BADCLOSE);
    }
 
-   fsync(disk);
-   if (close(disk) == -1) {
+   // Memory disks keep their contents for the next openDisk()
+   if(info->backend == DISK_MEMORY) {
+      pthread_mutex_lock(&disks_lock);
+      info->map = NULL;
+      info->open = 0;
+      info->claimed = 0;
+      pthread_mutex_unlock(&disks_lock);
+      return;
+   }
+
+   if(info->map != NULL) {
+      munmap(info->map, info->size);
+      info->map = NULL;
+   }
+   info->open = 0;
+   if (close(info->fd) == -1) {
       printf("Closing error\n");
       exit(ERROR_BADCLOSE);
    }
+   releaseSlot(disk);
    return;
 
 }
+
+#define ASYNC_MAX_WORKERS 4 //threads of a queue on the ASYNC_THREADS engine
+
+//one request handed to a disk_queue
+typedef struct disk_request {
+   struct disk_request *next; //in the todo or done list of the queue
+   int disk;
+   int bNum;
+   int count;
+   int writing;
+   void *token;
+   int result;
+   size_t length; //bytes the request moves
+   int iovcnt;
+   struct iovec iov[]; //buffers of the blocks, one per block if vectored
+} disk_request;
+
+#ifdef HAVE_URING
+//submission and completion rings shared with the kernel
+typedef struct uring {
+   int fd;
+   unsigned *sq_tail;
+   unsigned *sq_mask;
+   unsigned *sq_array;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned *cq_mask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   void *sq_ring; //NULL until mapped
+   void *cq_ring; //same as sq_ring if the kernel maps both at once
+   void *sqe_map;
+   size_t sq_size;
+   size_t cq_size;
+   size_t sqe_size;
+   unsigned queued; //entries filled in but not handed to the kernel yet
+} uring;
+#endif
+
+//requests of one caller on their way to and back from the disks. Only one
+//thread may use a queue at a time, the lock is for the workers
+struct disk_queue {
+   int engine; //ASYNC_URING or ASYNC_THREADS
+   int depth; //most requests submitted and not finished at once
+   int busy; //requests submitted and not finished
+   pthread_mutex_t lock; //busy and both lists
+   pthread_cond_t work; //todo has a request or stopping is set
+   pthread_cond_t finished; //a request went on the done list
+   disk_request *todo_head; //waiting for a worker
+   disk_request *todo_tail;
+   disk_request *done_head; //finished, not reaped by diskQueueWait() yet
+   disk_request *done_tail;
+   pthread_t *workers;
+   int num_workers;
+   int stopping;
+#ifdef HAVE_URING
+   uring ring;
+#endif
+};
+
+// Put a finished request on the done list. Called with the lock held
+static void finishRequest(disk_queue *queue, disk_request *req) {
+   req->next = NULL;
+   if (queue->done_tail != NULL)
+      queue->done_tail->next = req;
+   else
+      queue->done_head = req;
+   queue->done_tail = req;
+   queue->busy--;
+   pthread_cond_signal(&queue->finished);
+}
+
+/* Moves the bytes of a request that are left after the first 'skip' with preadv/pwritev, IOV_MAX buffers per call. Finishes short io_uring transfers and does the work of the ASYNC_THREADS workers. The request was already counted when it was submitted. Returns 0 or -1. */
+static int transferRest(disk_request *req, size_t skip) {
+   disk_info *info = getDisk(req->disk);
+   struct iovec *iov = req->iov;
+   off_t offset = (off_t)req->bNum * BLOCKSIZE;
+   int left = req->iovcnt;
+   ssize_t moved;
+
+   if (info == NULL)
+      return -1;
+   while (left > 0) {
+      if (skip >= iov->iov_len) {
+         skip -= iov->iov_len;
+         offset += iov->iov_len;
+         iov++;
+         left--;
+         continue;
+      }
+      iov->iov_base = (char *)iov->iov_base + skip;
+      iov->iov_len -= skip;
+      offset += skip;
+      if (req->writing)
+         moved = pwritev(info->fd, iov, left < IOV_MAX ? left : IOV_MAX, offset);
+      else
+         moved = preadv(info->fd, iov, left < IOV_MAX ? left : IOV_MAX, offset);
+      if (moved <= 0)
+         return -1;
+      skip = moved;
+   }
+   return 0;
+}
+
+// Run a request with the synchronous calls, which count it themselves
+static int runRequest(disk_request *req, void *blocks, void **vector) {
+   if (req->writing)
+      return blocks != NULL ?
+       writeBlocks(req->disk, req->bNum, req->count, blocks) :
+       writeBlockv(req->disk, req->bNum, req->count, vector);
+   return blocks != NULL ?
+    readBlocks(req->disk, req->bNum, req->count, blocks) :
+    readBlockv(req->disk, req->bNum, req->count, vector);
+}
+
+// Body of an ASYNC_THREADS worker, runs requests until the queue stops
+static void* asyncWorker(void *arg) {
+   disk_queue *queue = (disk_queue *)arg;
+   disk_request *req;
+
+   pthread_mutex_lock(&queue->lock);
+   for (;;) {
+      while (queue->todo_head == NULL && !queue->stopping)
+         pthread_cond_wait(&queue->work, &queue->lock);
+      // Whatever was submitted still runs before the worker stops
+      if (queue->todo_head == NULL)
+         break;
+      req = queue->todo_head;
+      queue->todo_head = req->next;
+      if (queue->todo_head == NULL)
+         queue->todo_tail = NULL;
+      pthread_mutex_unlock(&queue->lock);
+
+      if (transferRest(req, 0) < 0)
+         req->result = req->writing ? ERROR_BADWRITE : ERROR_BADREAD;
+      pthread_mutex_lock(&queue->lock);
+      finishRequest(queue, req);
+   }
+   pthread_mutex_unlock(&queue->lock);
+   return NULL;
+}
+
+#ifdef HAVE_URING
+// Unmap and close whatever uringSetup() got to
+static void uringFree(uring *ring) {
+   if (ring->sqe_map != NULL)
+      munmap(ring->sqe_map, ring->sqe_size);
+   if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+      munmap(ring->cq_ring, ring->cq_size);
+   if (ring->sq_ring != NULL)
+      munmap(ring->sq_ring, ring->sq_size);
+   close(ring->fd);
+}
+
+// Map a part of the rings, NULL if it fails
+static void* uringMap(uring *ring, size_t size, off_t part) {
+   void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, part);
+
+   return map == MAP_FAILED ? NULL : map;
+}
+
+/* Sets up an io_uring with room for 'entries' requests and maps its rings. Returns 0, or -1 if the kernel has no io_uring or does not let us use it. */
+static int uringSetup(uring *ring, unsigned entries) {
+   struct io_uring_params params;
+   char *sq, *cq;
+
+   memset(ring, 0, sizeof(uring));
+   memset(&params, 0, sizeof(params));
+   ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+   if (ring->fd < 0)
+      return -1;
+
+   ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   ring->cq_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      if (ring->cq_size > ring->sq_size)
+         ring->sq_size = ring->cq_size;
+      ring->cq_size = ring->sq_size;
+   }
+   ring->sqe_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+   ring->sq_ring = uringMap(ring, ring->sq_size, IORING_OFF_SQ_RING);
+   if (ring->sq_ring != NULL && (params.features & IORING_FEAT_SINGLE_MMAP))
+      ring->cq_ring = ring->sq_ring;
+   else if (ring->sq_ring != NULL)
+      ring->cq_ring = uringMap(ring, ring->cq_size, IORING_OFF_CQ_RING);
+   if (ring->cq_ring != NULL)
+      ring->sqe_map = uringMap(ring, ring->sqe_size, IORING_OFF_SQES);
+   if (ring->sqe_map == NULL) {
+      uringFree(ring);
+      return -1;
+   }
+
+   sq = (char *)ring->sq_ring;
+   cq = (char *)ring->cq_ring;
+   ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+   ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+   ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+   ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+   ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+   ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+   ring->sqes = (struct io_uring_sqe *)ring->sqe_map;
+   return 0;
+}
+
+/* Fills in a submission entry for req. It reaches the kernel with the next uringEnter(), so a burst of submissions costs one system call. A request of more than IOV_MAX blocks only sends the first IOV_MAX, the rest is moved when it comes back short. */
+static void uringQueue(uring *ring, disk_request *req, int fd) {
+   unsigned tail = *ring->sq_tail;
+   unsigned slot = tail & *ring->sq_mask;
+   struct io_uring_sqe *sqe = ring->sqes + slot;
+
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+   sqe->opcode = req->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+   sqe->fd = fd;
+   sqe->off = (off_t)req->bNum * BLOCKSIZE;
+   sqe->addr = (uintptr_t)req->iov;
+   sqe->len = req->iovcnt < IOV_MAX ? req->iovcnt : IOV_MAX;
+   sqe->user_data = (uintptr_t)req;
+   ring->sq_array[slot] = slot;
+   __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+   ring->queued++;
+}
+
+/* Hands the queued entries to the kernel, waits until at least 'wait' requests are complete and moves every completion to the done list. Returns 0 or -1 if the kernel refuses. */
+static int uringEnter(disk_queue *queue, int wait) {
+   uring *ring = &queue->ring;
+   struct io_uring_cqe *cqe;
+   disk_request *req;
+   unsigned head, tail;
+   int entered;
+
+   while (ring->queued > 0 || wait > 0) {
+      entered = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+       wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (entered < 0 && errno != EINTR && errno != EAGAIN)
+         return -1;
+      if (entered >= 0) {
+         ring->queued -= entered;
+         if (ring->queued == 0)
+            break;
+      }
+   }
+
+   head = *ring->cq_head;
+   tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+   for (; head != tail; head++) {
+      cqe = ring->cqes + (head & *ring->cq_mask);
+      req = (disk_request *)(uintptr_t)cqe->user_data;
+      if (cqe->res < 0 ||
+       ((size_t)cqe->res < req->length && transferRest(req, cqe->res) < 0))
+         req->result = req->writing ? ERROR_BADWRITE : ERROR_BADREAD;
+      pthread_mutex_lock(&queue->lock);
+      finishRequest(queue, req);
+      pthread_mutex_unlock(&queue->lock);
+   }
+   __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+   return 0;
+}
+#endif
+
+// Let at least one request finish. Called with the lock held, returns -1 if
+// nothing can
+static int waitForOne(disk_queue *queue) {
+   int code = 0;
+
+#ifdef HAVE_URING
+   if (queue->engine == ASYNC_URING) {
+      pthread_mutex_unlock(&queue->lock);
+      code = uringEnter(queue, 1);
+      pthread_mutex_lock(&queue->lock);
+      return code;
+   }
+#endif
+   pthread_cond_wait(&queue->finished, &queue->lock);
+   return code;
+}
+
+/* Selects the engine of the disk queues made from now on. ASYNC_AUTO, the default, uses io_uring where the kernel offers it and falls back to ASYNC_THREADS. */
+void setAsyncEngine(int engine) {
+   default_engine = engine;
+}
+
+/* Makes a queue that keeps up to 'depth' block requests in flight at once, see submitRead(). The engine comes from setAsyncEngine(). Returns NULL if depth is not positive, the queue cannot be set up, or ASYNC_URING was asked for and the kernel has no io_uring. */
+disk_queue* diskQueueCreate(int depth) {
+   disk_queue *queue;
+   int idx;
+
+   if (depth <= 0)
+      return NULL;
+   queue = (disk_queue *)calloc(1, sizeof(disk_queue));
+   if (queue == NULL)
+      return NULL;
+   queue->depth = depth;
+   pthread_mutex_init(&queue->lock, NULL);
+   pthread_cond_init(&queue->work, NULL);
+   pthread_cond_init(&queue->finished, NULL);
+
+#ifdef HAVE_URING
+   if (default_engine != ASYNC_THREADS && uringSetup(&queue->ring, depth) == 0)
+      queue->engine = ASYNC_URING;
+#endif
+   if (queue->engine == ASYNC_URING)
+      return queue;
+
+   queue->engine = ASYNC_THREADS;
+   if (default_engine != ASYNC_URING) {
+      queue->workers = (pthread_t *)malloc(sizeof(pthread_t) * ASYNC_MAX_WORKERS);
+      for (idx = 0; queue->workers != NULL && idx < depth &&
+       idx < ASYNC_MAX_WORKERS; idx++) {
+         if (pthread_create(queue->workers + idx, NULL, asyncWorker, queue) != 0)
+            break;
+         queue->num_workers++;
+      }
+   }
+   if (queue->num_workers == 0) {
+      diskQueueDestroy(queue);
+      return NULL;
+   }
+   return queue;
+}
+
+/* Returns the engine a queue ended up with, ASYNC_URING or ASYNC_THREADS. */
+int diskQueueEngine(disk_queue *queue) {
+   return queue == NULL ? ERROR_BADOPEN : queue->engine;
+}
+
+/* Shared body of the submit calls, exactly one of blocks and vector is set. Requests are counted against the disk by the submitting thread, like the synchronous calls. Disks that are mapped, have an injected failure pending or a realtime profile are served at once with the synchronous calls, so their requests complete in submission order and a crash test stops at the same block. */
+static int submitRequest(disk_queue *queue, int disk, int bNum, int count,
+ void *blocks, void **vector, int writing, void *token) {
+   disk_info *info = getDisk(disk);
+   disk_request *req;
+   int error = writing ? ERROR_BADWRITE : ERROR_BADREAD;
+   int idx, slots = blocks != NULL ? 1 : count;
+
+   if (queue == NULL || info == NULL || (blocks == NULL && vector == NULL) ||
+    !validRange(info, bNum, count))
+      return error;
+
+   req = (disk_request *)calloc(1, sizeof(disk_request) +
+    sizeof(struct iovec) * slots);
+   if (req == NULL)
+      return error;
+   req->disk = disk;
+   req->bNum = bNum;
+   req->count = count;
+   req->writing = writing;
+   req->token = token;
+   req->length = (size_t)count * BLOCKSIZE;
+   req->iovcnt = slots;
+   if (blocks != NULL) {
+      req->iov[0].iov_base = blocks;
+      req->iov[0].iov_len = req->length;
+   }
+   for (idx = 0; blocks == NULL && idx < count; idx++) {
+      req->iov[idx].iov_base = vector[idx];
+      req->iov[idx].iov_len = BLOCKSIZE;
+   }
+
+   pthread_mutex_lock(&queue->lock);
+   while (queue->busy >= queue->depth) {
+      if (waitForOne(queue) < 0) {
+         pthread_mutex_unlock(&queue->lock);
+         free(req);
+         return error;
+      }
+   }
+   queue->busy++;
+
+   if (info->map != NULL || info->fail_after >= 0 || info->profile.realtime) {
+      pthread_mutex_unlock(&queue->lock);
+      req->result = runRequest(req, blocks, vector);
+      pthread_mutex_lock(&queue->lock);
+      finishRequest(queue, req);
+      pthread_mutex_unlock(&queue->lock);
+      return 0;
+   }
+
+   accountIO(info, writing ? IO_WRITE : IO_READ, count);
+#ifdef HAVE_URING
+   if (queue->engine == ASYNC_URING) {
+      pthread_mutex_unlock(&queue->lock);
+      uringQueue(&queue->ring, req, info->fd);
+      return 0;
+   }
+#endif
+   req->next = NULL;
+   if (queue->todo_tail != NULL)
+      queue->todo_tail->next = req;
+   else
+      queue->todo_head = req;
+   queue->todo_tail = req;
+   pthread_cond_signal(&queue->work);
+   pthread_mutex_unlock(&queue->lock);
+   return 0;
+}
+
+/* submitRead() starts reading the count consecutive blocks starting at bNum into 'blocks', which must hold count * BLOCKSIZE bytes and stay untouched until the request completes. Its completion carries 'token', see diskQueueWait(). With 'depth' requests already in flight it first waits for one of them to finish. Returns 0 once the request is on its way, or ERROR_BADREAD if it cannot be. */
+int submitRead(disk_queue *queue, int disk, int bNum, int count, void *blocks,
+ void *token) {
+   return submitRequest(queue, disk, bNum, count, blocks, NULL, 0, token);
+}
+
+/* submitWrite() starts writing count consecutive blocks from 'blocks' to block bNum onwards, like submitRead(). Returns 0 or ERROR_BADWRITE. */
+int submitWrite(disk_queue *queue, int disk, int bNum, int count, void *blocks,
+ void *token) {
+   return submitRequest(queue, disk, bNum, count, blocks, NULL, 1, token);
+}
+
+/* submitReadv() starts reading count consecutive blocks into the separate buffers blocks[0..count-1]. The pointer array itself may be reused as soon as the call returns. Returns 0 or ERROR_BADREAD. */
+int submitReadv(disk_queue *queue, int disk, int bNum, int count,
+ void **blocks, void *token) {
+   return submitRequest(queue, disk, bNum, count, NULL, blocks, 0, token);
+}
+
+/* submitWritev() starts writing the separate buffers blocks[0..count-1] to count consecutive blocks, like submitReadv(). Returns 0 or ERROR_BADWRITE. */
+int submitWritev(disk_queue *queue, int disk, int bNum, int count,
+ void **blocks, void *token) {
+   return submitRequest(queue, disk, bNum, count, NULL, blocks, 1, token);
+}
+
+/* diskQueueWait() hands submitted requests to the kernel and waits until at least 'min' of them have completed, or every request in flight has if there are fewer. Up to 'max' completions are stored in 'done' in the order they finished, which need not be the order they were submitted in. Returns the number stored, 0 once nothing is in flight, or ERROR_BADREAD if the queue is broken. */
+int diskQueueWait(disk_queue *queue, int min, disk_completion *done, int max) {
+   disk_request *req;
+   int got = 0;
+
+   if (queue == NULL || done == NULL || max < 0)
+      return ERROR_BADREAD;
+   if (min > max)
+      min = max;
+#ifdef HAVE_URING
+   if (queue->engine == ASYNC_URING && uringEnter(queue, 0) < 0)
+      return ERROR_BADREAD;
+#endif
+
+   pthread_mutex_lock(&queue->lock);
+   while (got < max) {
+      if (queue->done_head == NULL) {
+         if (got >= min || queue->busy == 0)
+            break;
+         if (waitForOne(queue) < 0) {
+            got = got > 0 ? got : ERROR_BADREAD;
+            break;
+         }
+         continue;
+      }
+      req = queue->done_head;
+      queue->done_head = req->next;
+      if (queue->done_head == NULL)
+         queue->done_tail = NULL;
+      done[got].token = req->token;
+      done[got].result = req->result;
+      free(req);
+      got++;
+   }
+   pthread_mutex_unlock(&queue->lock);
+   return got;
+}
+
+/* diskQueueDestroy() waits for every request still in flight, since their buffers may still be in use, then stops the queue and frees it. Completions that were not reaped are dropped. */
+void diskQueueDestroy(disk_queue *queue) {
+   disk_completion done[16];
+   int idx;
+
+   if (queue == NULL)
+      return;
+   while (diskQueueWait(queue, 16, done, 16) > 0)
+      ;
+
+   pthread_mutex_lock(&queue->lock);
+   queue->stopping = 1;
+   pthread_cond_broadcast(&queue->work);
+   pthread_mutex_unlock(&queue->lock);
+   for (idx = 0; idx < queue->num_workers; idx++)
+      pthread_join(queue->workers[idx], NULL);
+   free(queue->workers);
+#ifdef HAVE_URING
+   if (queue->engine == ASYNC_URING)
+      uringFree(&queue->ring);
+#endif
+   pthread_cond_destroy(&queue->work);
+   pthread_cond_destroy(&queue->finished);
+   pthread_mutex_destroy(&queue->lock);
+   free(queue);
+}
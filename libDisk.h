@@ -1,9 +1,90 @@
 #ifndef LIBDISK_H
 #define LIBDISK_H
 
-int openDisk(char *filename, int nBytes);
+#include <sys/types.h>
+
+#define MAX_DISKS 128 //disks that may be open at the same time
+#define DISK_FILE 0 //pread/pwrite on the backing file
+#define DISK_MMAP 1 //backing file mapped into memory
+#define DISK_MEMORY 2 //kept in process memory under the file name, see removeMemoryDisk()
+
+//engines of a disk_queue, see setAsyncEngine()
+#define ASYNC_AUTO 0 //io_uring if the kernel has it, ASYNC_THREADS otherwise
+#define ASYNC_URING 1 //requests go to the kernel through an io_uring
+#define ASYNC_THREADS 2 //a pool of threads runs them with pread/pwrite
+
+//simulated device timing, see setDiskProfile()
+typedef struct disk_profile {
+   long read_latency; //ns charged once per read call, however many blocks it moves
+   long write_latency; //ns charged once per write call
+   long sync_latency; //ns charged per syncDisk()
+   long bandwidth; //bytes per second, 0 if transfers take no time
+   int realtime; //sleep for the simulated time instead of only adding it up
+} disk_profile;
+
+extern const disk_profile disk_profile_hdd; //7200 rpm disk
+extern const disk_profile disk_profile_ssd; //SATA flash
+extern const disk_profile disk_profile_nvme;
+
+//I/O counters of an open disk, see diskStats()
+typedef struct disk_stats {
+   unsigned long reads; //blocks read
+   unsigned long writes; //blocks written
+   unsigned long read_calls; //readBlock/readBlocks/readBlockv calls that read
+   unsigned long write_calls;
+   unsigned long syncs;
+} disk_stats;
+
+//bookkeeping for one open disk
+typedef struct disk_info {
+   int fd; //backing UNIX file, -1 for DISK_MEMORY
+   off_t size; //size of the backing file in bytes, probed at openDisk
+   char *map; //whole disk with DISK_MMAP and DISK_MEMORY, NULL otherwise
+   int backend;
+   int open;
+   int claimed; //slot taken by an open disk or by an openDisk() under way
+   int fail_after; //block writes left before every write fails, -1 if off
+   disk_profile profile;
+   long long busy_ns; //simulated device time spent so far
+   disk_stats stats;
+} disk_info;
+
+//a finished asynchronous request, see diskQueueWait()
+typedef struct disk_completion {
+   void *token; //what the request was submitted with
+   int result; //0, ERROR_BADREAD or ERROR_BADWRITE
+} disk_completion;
+
+//requests in flight and their completions, see diskQueueCreate()
+typedef struct disk_queue disk_queue;
+
+int openDisk(char *filename, off_t nBytes);
+int openDiskBackend(char *filename, off_t nBytes, int backend);
+void setDiskBackend(int backend);
+void* getBlockPtr(int disk, int bNum);
 int readBlock(int disk, int bNum, void *block);
 int writeBlock(int disk, int bNum, void *block);
+int readBlocks(int disk, int bNum, int count, void *blocks);
+int writeBlocks(int disk, int bNum, int count, void *blocks);
+int readBlockv(int disk, int bNum, int count, void **blocks);
+int writeBlockv(int disk, int bNum, int count, void **blocks);
+int syncDisk(int disk);
+int diskFailAfter(int disk, int writes);
+int setDiskProfile(int disk, const disk_profile *profile);
+long long diskBusyTime(int disk);
+int diskStats(int disk, disk_stats *stats);
+const disk_stats* diskThreadStats(void);
+int removeMemoryDisk(char *filename);
+int renameDisk(char *from, char *to);
+void setAsyncEngine(int engine);
+disk_queue* diskQueueCreate(int depth);
+int diskQueueEngine(disk_queue *queue);
+int submitRead(disk_queue *queue, int disk, int bNum, int count, void *blocks, void *token);
+int submitWrite(disk_queue *queue, int disk, int bNum, int count, void *blocks, void *token);
+int submitReadv(disk_queue *queue, int disk, int bNum, int count, void **blocks, void *token);
+int submitWritev(disk_queue *queue, int disk, int bNum, int count, void **blocks, void *token);
+int diskQueueWait(disk_queue *queue, int min, disk_completion *done, int max);
+void diskQueueDestroy(disk_queue *queue);
 void closeDisk(int disk);
 
 #endif
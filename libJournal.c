@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libDisk.h"
+#include "libJournal.h"
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+
+// Little endian words, the same layout libTinyFS uses
+static unsigned int readWord(const char *block, int offset) {
+   const unsigned char *bytes = (const unsigned char *)block + offset;
+
+   return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned int)bytes[3] << 24;
+}
+
+static void writeWord(char *block, int offset, unsigned int value) {
+   block[offset] = value & 0xFF;
+   block[offset + 1] = (value >> 8) & 0xFF;
+   block[offset + 2] = (value >> 16) & 0xFF;
+   block[offset + 3] = (value >> 24) & 0xFF;
+}
+
+// FNV-1a, continued from hash
+static unsigned int checksum(unsigned int hash, const char *data, int length) {
+   int idx;
+
+   for (idx = 0; idx < length; idx++) {
+      hash ^= (unsigned char)data[idx];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+// Checksum of a transaction, covering everything but the checksum field
+static unsigned int transactionSum(const char *descriptor, int count,
+ char **blocks) {
+   unsigned int hash = 2166136261u;
+   int idx;
+
+   hash = checksum(hash, descriptor, JOURNAL_CHECKSUM);
+   hash = checksum(hash, descriptor + JOURNAL_TARGETS, count * 4);
+   for (idx = 0; idx < count; idx++)
+      hash = checksum(hash, blocks[idx], BLOCKSIZE);
+   return hash;
+}
+
+/* Returns how many journal blocks a volume of num_blocks blocks gets: an eighth of the volume, between JOURNAL_MIN_BLOCKS and JOURNAL_MAX_BLOCKS and always even. Volumes too small for JOURNAL_MIN_BLOCKS to be a fair share get no journal. */
+int journalBlocks(int num_blocks) {
+   int blocks = num_blocks / 8;
+
+   if (num_blocks < JOURNAL_MIN_BLOCKS * 4)
+      return 0;
+   if (blocks < JOURNAL_MIN_BLOCKS)
+      blocks = JOURNAL_MIN_BLOCKS;
+   if (blocks > JOURNAL_MAX_BLOCKS)
+      blocks = JOURNAL_MAX_BLOCKS;
+   return blocks & ~1;
+}
+
+/* Creates the journal for the 'blocks' blocks starting at 'start' on an open disk. Nothing is read, call journalRecover() before trusting the rest of the disk. Returns NULL if the area is too small. */
+journal* journalOpen(int disk, int start, int blocks) {
+   journal *log;
+
+   if (blocks < JOURNAL_MIN_BLOCKS)
+      return NULL;
+
+   log = (journal *)calloc(1, sizeof(journal));
+   if (log == NULL)
+      return NULL;
+   log->disk = disk;
+   log->start = start;
+   log->slot_blocks = blocks / 2;
+   return log;
+}
+
+/* Returns the most blocks one transaction can log. */
+int journalCapacity(journal *log) {
+   return log->slot_blocks - 1 < JOURNAL_MAX_TARGETS ?
+    log->slot_blocks - 1 : JOURNAL_MAX_TARGETS;
+}
+
+// Read and verify the transaction in a slot, returns its image count or -1
+static int readSlot(journal *log, int slot, char *descriptor, char *images) {
+   char *blocks[JOURNAL_MAX_TARGETS];
+   int first = log->start + slot * log->slot_blocks, count, idx;
+
+   if (readBlock(log->disk, first, descriptor) < 0 ||
+    descriptor[0] != JOURNAL || descriptor[1] != MAGIC)
+      return -1;
+   count = readWord(descriptor, JOURNAL_COUNT);
+   if (count <= 0 || count > journalCapacity(log) ||
+    readWord(descriptor, JOURNAL_SEQUENCE) % 2 != (unsigned int)slot)
+      return -1;
+   if (readBlocks(log->disk, first + 1, count, images) < 0)
+      return -1;
+
+   for (idx = 0; idx < count; idx++)
+      blocks[idx] = images + idx * BLOCKSIZE;
+   if (transactionSum(descriptor, count, blocks) !=
+    readWord(descriptor, JOURNAL_CHECKSUM))
+      return -1;
+   return count;
+}
+
+/* Brings the disk to the state of the newest complete transaction. Only that one is copied home: the commit of a transaction is the barrier that made the home writes of the one before it durable, so older transactions must not be replayed over blocks that were reused since. A slot whose checksum does not match was torn by a crash and is ignored. Returns 0 or a libDisk error code. */
+int journalRecover(journal *log) {
+   char descriptor[2][BLOCKSIZE];
+   char *images[2];
+   int count[2], slot, newest = -1, idx, code = 0;
+
+   for (slot = 0; slot < 2; slot++) {
+      images[slot] = (char *)malloc((size_t)journalCapacity(log) * BLOCKSIZE);
+      count[slot] = readSlot(log, slot, descriptor[slot], images[slot]);
+      if (count[slot] > 0 && (newest < 0 ||
+       readWord(descriptor[slot], JOURNAL_SEQUENCE) >
+       readWord(descriptor[newest], JOURNAL_SEQUENCE)))
+         newest = slot;
+   }
+
+   log->sequence = 0;
+   if (newest >= 0) {
+      log->sequence = readWord(descriptor[newest], JOURNAL_SEQUENCE);
+      for (idx = 0; idx < count[newest] && code == 0; idx++) {
+         code = writeBlock(log->disk,
+          readWord(descriptor[newest], JOURNAL_TARGETS + idx * 4),
+          images[newest] + idx * BLOCKSIZE);
+         log->stats.replayed++;
+      }
+      if (code == 0)
+         code = syncDisk(log->disk);
+   }
+
+   free(images[0]);
+   free(images[1]);
+   return code;
+}
+
+/* Writes the images blocks[0..count-1] of blocks bNums[0..count-1] as the next transaction and syncs the disk. Once this returns 0 the transaction survives a crash, and the blocks may be written to their home locations. The sync is also the barrier for the home writes of the previous transaction, whose slot the next commit reuses. count must not exceed journalCapacity(). Returns 0 or a libDisk error code. */
+int journalCommit(journal *log, int count, int *bNums, void **blocks) {
+   char descriptor[BLOCKSIZE];
+   void *data[JOURNAL_MAX_TARGETS + 1];
+   unsigned int sequence = log->sequence + 1;
+   int idx, code;
+
+   if (count <= 0 || count > journalCapacity(log))
+      return ERROR_BADWRITE;
+
+   memset(descriptor, 0, BLOCKSIZE);
+   descriptor[0] = JOURNAL;
+   descriptor[1] = MAGIC;
+   writeWord(descriptor, JOURNAL_SEQUENCE, sequence);
+   writeWord(descriptor, JOURNAL_COUNT, count);
+   for (idx = 0; idx < count; idx++)
+      writeWord(descriptor, JOURNAL_TARGETS + idx * 4, bNums[idx]);
+   writeWord(descriptor, JOURNAL_CHECKSUM,
+    transactionSum(descriptor, count, (char **)blocks));
+
+   // Descriptor and images go out together in one vectored write
+   data[0] = descriptor;
+   for (idx = 0; idx < count; idx++)
+      data[idx + 1] = blocks[idx];
+   code = writeBlockv(log->disk, log->start + (sequence % 2) * log->slot_blocks,
+    count + 1, data);
+   if (code == 0)
+      code = syncDisk(log->disk);
+   if (code < 0)
+      return code;
+
+   log->sequence = sequence;
+   log->stats.commits++;
+   log->stats.logged += count;
+   return 0;
+}
+
+/* Frees the journal. The disk itself is left open. */
+void journalClose(journal *log) {
+   free(log);
+}
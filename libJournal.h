@@ -0,0 +1,41 @@
+#ifndef LIBJOURNAL_H
+#define LIBJOURNAL_H
+
+#include "tinyFS.h"
+
+//the journal area is split into two slots used in turn, a transaction
+//goes into slot sequence % 2 as a descriptor block followed by the images
+//descriptor 0-type, 1-magic, 4-sequence, 8-count, 12-checksum, 16-block numbers
+//numbers are 32-bit little endian words, the checksum covers the descriptor
+//words and every image so a torn transaction is never replayed
+#define JOURNAL_SEQUENCE 4
+#define JOURNAL_COUNT 8
+#define JOURNAL_CHECKSUM 12
+#define JOURNAL_TARGETS 16
+#define JOURNAL_MAX_TARGETS ((BLOCKSIZE - JOURNAL_TARGETS) / 4)
+#define JOURNAL_MIN_BLOCKS 8 //smallest useful journal, 3 blocks per transaction
+#define JOURNAL_MAX_BLOCKS 128
+
+typedef struct journal_stats {
+   unsigned long commits; //transactions written
+   unsigned long logged; //block images written to the journal
+   unsigned long replayed; //block images copied home by journalRecover()
+} journal_stats;
+
+//write-ahead log of metadata block images on an open disk
+typedef struct journal {
+   int disk;
+   int start; //first block of the journal area
+   int slot_blocks; //blocks per slot
+   unsigned int sequence; //of the newest committed transaction
+   journal_stats stats;
+} journal;
+
+int journalBlocks(int num_blocks);
+journal* journalOpen(int disk, int start, int blocks);
+int journalCapacity(journal *log);
+int journalRecover(journal *log);
+int journalCommit(journal *log, int count, int *bNums, void **blocks);
+void journalClose(journal *log);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "libStats.h"
+
+//counters of one thread. Only the owner writes them, with relaxed atomic
+//loads and stores that compile to plain moves, and readers load them the
+//same way, so counting needs neither a lock nor a locked instruction
+typedef struct thread_counters {
+   api_stats api[STAT_APIS];
+   struct thread_counters *next;
+} thread_counters;
+
+static __thread thread_counters *own; //NULL until the thread first counts
+static thread_counters *all_threads; //every thread that ever counted
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+//totals at the last statReset(), subtracted from every snapshot so a reset
+//never has to write another thread's counters
+static api_stats baseline[STAT_APIS];
+
+static const char *api_names[STAT_APIS] = {"mkfs", "mount", "unmount",
+ "openFile", "closeFile", "writeFile", "deleteFile", "readByte", "read",
+ "writeByte", "seek", "rename", "sync", "write", "append", "readdir",
+ "mkdir", "rmdir", "lookup"};
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define BUMP(field, value) \
+   __atomic_store_n(&(field), LOAD(field) + (value), __ATOMIC_RELAXED)
+
+static unsigned long long nowNs() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counters of the calling thread, registered on first use. The block is
+// never freed, the counts of a thread outlive it
+static thread_counters* ownCounters() {
+   if (own == NULL) {
+      own = (thread_counters *)calloc(1, sizeof(thread_counters));
+      if (own == NULL)
+         return NULL;
+      pthread_mutex_lock(&threads_lock);
+      own->next = all_threads;
+      all_threads = own;
+      pthread_mutex_unlock(&threads_lock);
+   }
+   return own;
+}
+
+/* Starts timing a call and notes how many blocks the calling thread has moved so far. */
+void statBegin(stat_probe *probe) {
+   const disk_stats *io = diskThreadStats();
+
+   probe->reads = io->reads;
+   probe->writes = io->writes;
+   probe->start = nowNs();
+}
+
+/* Charges the call started by statBegin() to entry point 'api': its time, the blocks the thread moved since then, and 'bytes' of file data. A negative code counts as an error. */
+void statEnd(stat_probe *probe, int api, int code, long bytes) {
+   unsigned long long elapsed = nowNs() - probe->start;
+   const disk_stats *io = diskThreadStats();
+   thread_counters *counters = ownCounters();
+   api_stats *counter;
+
+   if (counters == NULL)
+      return;
+   counter = counters->api + api;
+   BUMP(counter->calls, 1);
+   BUMP(counter->ns, elapsed);
+   if (code < 0)
+      BUMP(counter->errors, 1);
+   if (io->reads != probe->reads)
+      BUMP(counter->reads, io->reads - probe->reads);
+   if (io->writes != probe->writes)
+      BUMP(counter->writes, io->writes - probe->writes);
+   if (bytes > 0)
+      BUMP(counter->bytes, (unsigned long long)bytes);
+}
+
+// Add up the counters of every thread
+static void sumThreads(api_stats *total) {
+   thread_counters *thread;
+   int api;
+
+   memset(total, 0, sizeof(api_stats) * STAT_APIS);
+   pthread_mutex_lock(&threads_lock);
+   for (thread = all_threads; thread != NULL; thread = thread->next) {
+      for (api = 0; api < STAT_APIS; api++) {
+         total[api].calls += LOAD(thread->api[api].calls);
+         total[api].errors += LOAD(thread->api[api].errors);
+         total[api].ns += LOAD(thread->api[api].ns);
+         total[api].reads += LOAD(thread->api[api].reads);
+         total[api].writes += LOAD(thread->api[api].writes);
+         total[api].bytes += LOAD(thread->api[api].bytes);
+      }
+   }
+   pthread_mutex_unlock(&threads_lock);
+}
+
+/* Copies the counters of every entry point since the last statReset(), summed over all threads, into stats->api. Counters are read one at a time, so a copy taken while other threads run may be a few calls apart between fields. */
+void statCopy(fs_stats *stats) {
+   api_stats total[STAT_APIS];
+   int api;
+
+   sumThreads(total);
+   pthread_mutex_lock(&threads_lock);
+   for (api = 0; api < STAT_APIS; api++) {
+      stats->api[api].calls = total[api].calls - baseline[api].calls;
+      stats->api[api].errors = total[api].errors - baseline[api].errors;
+      stats->api[api].ns = total[api].ns - baseline[api].ns;
+      stats->api[api].reads = total[api].reads - baseline[api].reads;
+      stats->api[api].writes = total[api].writes - baseline[api].writes;
+      stats->api[api].bytes = total[api].bytes - baseline[api].bytes;
+   }
+   pthread_mutex_unlock(&threads_lock);
+}
+
+/* Starts every counter over from zero. */
+void statReset(void) {
+   api_stats total[STAT_APIS];
+
+   sumThreads(total);
+   pthread_mutex_lock(&threads_lock);
+   memcpy(baseline, total, sizeof(baseline));
+   pthread_mutex_unlock(&threads_lock);
+}
+
+/* Prints stats to out, as a table or as one JSON object. Entry points that were never called are left out of the table. */
+void statDump(FILE *out, fs_stats *stats, int json) {
+   api_stats *api;
+   int idx;
+
+   if (json) {
+      fprintf(out, "{\"mounted\": %d, \"free_blocks\": %d, \"cache\": "
+       "{\"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, "
+       "\"writebacks\": %lu, \"mapped\": %lu, \"prefetched\": %lu}, "
+       "\"api\": {", stats->mounted, stats->free_blocks, stats->cache.hits,
+       stats->cache.misses, stats->cache.evictions, stats->cache.writebacks,
+       stats->cache.mapped, stats->cache.prefetched);
+      for (idx = 0; idx < STAT_APIS; idx++) {
+         api = stats->api + idx;
+         fprintf(out, "%s\"%s\": {\"calls\": %lu, \"errors\": %lu, \"ns\": %llu, "
+          "\"reads\": %lu, \"writes\": %lu, \"bytes\": %llu}", idx ? ", " : "",
+          api_names[idx], api->calls, api->errors, api->ns, api->reads,
+          api->writes, api->bytes);
+      }
+      fprintf(out, "}}\n");
+      return;
+   }
+
+   fprintf(out, "%-10s %10s %8s %12s %10s %10s %10s %12s\n", "call", "calls",
+    "errors", "total us", "avg ns", "reads", "writes", "bytes");
+   for (idx = 0; idx < STAT_APIS; idx++) {
+      api = stats->api + idx;
+      if (api->calls == 0)
+         continue;
+      fprintf(out, "%-10s %10lu %8lu %12.1f %10llu %10lu %10lu %12llu\n",
+       api_names[idx], api->calls, api->errors, api->ns / 1e3,
+       api->ns / api->calls, api->reads, api->writes, api->bytes);
+   }
+   fprintf(out, "cache: %lu hits, %lu misses, %lu evictions, %lu writebacks, "
+    "%lu prefetched\n", stats->cache.hits, stats->cache.misses,
+    stats->cache.evictions, stats->cache.writebacks, stats->cache.prefetched);
+   if (stats->mounted)
+      fprintf(out, "free blocks: %d\n", stats->free_blocks);
+}
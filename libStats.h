@@ -0,0 +1,61 @@
+#ifndef LIBSTATS_H
+#define LIBSTATS_H
+
+#include <stdio.h>
+#include "libCache.h"
+#include "libDisk.h"
+
+//entry points counted by tfs_stats(), index into fs_stats.api
+#define STAT_MKFS 0
+#define STAT_MOUNT 1
+#define STAT_UNMOUNT 2
+#define STAT_OPEN 3
+#define STAT_CLOSE 4
+#define STAT_WRITE_FILE 5
+#define STAT_DELETE 6
+#define STAT_READ_BYTE 7
+#define STAT_READ 8
+#define STAT_WRITE_BYTE 9
+#define STAT_SEEK 10
+#define STAT_RENAME 11
+#define STAT_SYNC 12
+#define STAT_WRITE 13
+#define STAT_APPEND 14
+#define STAT_READDIR 15
+#define STAT_MKDIR 16
+#define STAT_RMDIR 17
+#define STAT_LOOKUP 18
+#define STAT_APIS 19
+
+//counters of one entry point, added up over every call since the last reset
+typedef struct api_stats {
+   unsigned long calls;
+   unsigned long errors; //calls that returned a negative code
+   unsigned long long ns; //wall clock time spent in the calls
+   unsigned long reads; //blocks the calls read from the disk
+   unsigned long writes; //blocks the calls wrote, write-back included
+   unsigned long long bytes; //file bytes read or written
+} api_stats;
+
+//snapshot returned by tfs_stats()
+typedef struct fs_stats {
+   api_stats api[STAT_APIS];
+   cache_stats cache; //of the mounted file system, zero if none is mounted
+   int free_blocks; //of the mounted file system
+   int mounted;
+} fs_stats;
+
+//state of one call between statBegin() and statEnd()
+typedef struct stat_probe {
+   unsigned long long start; //ns
+   unsigned long reads; //blocks the calling thread had read at statBegin()
+   unsigned long writes;
+} stat_probe;
+
+void statBegin(stat_probe *probe);
+void statEnd(stat_probe *probe, int api, int code, long bytes);
+void statCopy(fs_stats *stats);
+void statReset(void);
+void statDump(FILE *out, fs_stats *stats, int json);
+
+#endif
@@ -3,703 +3,3184 @@
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
 #include "libDisk.h"
 #include "libTinyFS.h"
 #include "tinyFS.h"
 #include "tinyFS_errno.h"
 
-//TODO
-//CURRENTLY MOUNTED, WRITE IF NOT ENOUGH FREE BLOCKS TO WRITE, OPENFILE IF NOT ENOUGH FREEBLOCKS,
-//all functions if disk is not mounted
-/* Makes a blank TinyFS file system of size nBytes on the file specified by ‘filename’. This function should use the emulated disk library to open the specified file, and upon success, format the file to be mountable. This includes initializing all data to 0x00, setting magic numbers, initializing and writing the superblock and inodes, etc. Must return a specified success/error code. */
-int tfs_mkfs(char *filename, int nBytes){
-   // Get the disk number where filename is reside in
-   disk_num = openDisk(filename, nBytes);
-
-   if(mounted)
-      return ERROR_ALREADY_MOUNTED;
+int cache_size = DEFAULT_CACHE_SIZE;
+int mount_options;
+
+//mounted volumes by id, NULL for a free slot. Slots change under
+//volumes_lock, FD lookups read them without it
+static tfs_volume *volumes[MAX_VOLUMES];
+static pthread_mutex_t volumes_lock = PTHREAD_MUTEX_INITIALIZER;
+//calls running on the volume in each slot, see pinVolume(). Kept out of the
+//volume so a call can count itself in before it knows the volume is there
+static int volume_users[MAX_VOLUMES];
+//the volume of tfs_mount(), the one the calls without a volume work on.
+//tfs_mkfs, tfs_mount and tfs_unmount change it under legacy_lock
+static tfs_volume *legacy_volume;
+static pthread_mutex_t legacy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define FD_LOCAL ((1 << VOLUME_SHIFT) - 1) //bits of an FD local to its volume
+
+//locks lockFD() takes for a call on an FD
+#define LOCK_SHARED 0 //table_lock and the file lock shared
+#define LOCK_FILE 1 //table_lock shared, the file lock exclusive
+#define LOCK_TABLE 2 //table_lock exclusive, which keeps every file still
+#define LOCK_META 4 //meta_lock as well
+
+#define INIT_BATCH 64 //blocks formatted per writeBlocks() call in initFS
+#define READ_BATCH 64 //blocks fetched per cacheSubmitRun() call in tfs_read
+#define READ_DEPTH 8 //runs of READ_BATCH blocks tfs_read keeps in flight
+#define READAHEAD_MIN 4 //blocks read ahead once a file is read sequentially
+#define READAHEAD_MAX 64 //the readahead window doubles up to this
+#define PREALLOC_MAX 256 //blocks a growing file may take past its end in a new extent
+#define READDIR_GAP 4 //unused blocks between two inodes one prefetch reads through
+
+/* Reads the 32-bit little endian word at offset in block. All block numbers, counts and sizes on disk are stored this way. */
+unsigned int getWord(const char *block, int offset) {
+   const unsigned char *bytes = (const unsigned char *)block + offset;
+
+   return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned int)bytes[3] << 24;
+}
 
-   //check to see if opendisk was a success, error code for failure
-   if (disk_num < 0) {
-      return ERROR_OPENDISK;
-   }
+/* Stores value as a 32-bit little endian word at offset in block. */
+void putWord(char *block, int offset, unsigned int value) {
+   block[offset] = value & 0xFF;
+   block[offset + 1] = (value >> 8) & 0xFF;
+   block[offset + 2] = (value >> 16) & 0xFF;
+   block[offset + 3] = (value >> 24) & 0xFF;
+}
 
-   // Initialize superBlock
-   char *superblock = initSuperBlock(nBytes);
-   // Write SB to the file
-   writeBlock(disk_num, 0, superblock);
-   free(superblock);
-   
-   // Initialize File System
-   initFS(nBytes);
-   disk_num = -1;
+// Pack a name of up to 8 characters into one word, so names compare in one step
+static uint64_t nameKey(const char *name) {
+   uint64_t key = 0;
+   int idx;
 
-   return MAKEFS_SUCCESS;
+   for (idx = 0; idx < 8 && name[idx] != '\0'; idx++)
+      key |= (uint64_t)(unsigned char)name[idx] << (idx * 8);
+   return key;
 }
 
+// Home slot of a name in a directory, Fibonacci hashing on the top bits
+static int nameHome(tfs_volume *vol, uint64_t key, int parent) {
+   key ^= (uint64_t)parent * 0xFF51AFD7ED558CCDULL;
+   return (int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (vol->name_capacity - 1);
+}
 
-/*Initializes all blocks in FS except for Superblock*/
-void initFS(int nBytes) {
-   int num_blocks, idx;
-   char* newblock = (char *)calloc(1, BLOCKSIZE);
+// Place file_table[idx] in its probe run, there must be a free slot
+static void namePlace(tfs_volume *vol, int idx) {
+   uint64_t key = nameKey(vol->file_table[idx].name);
+   int slot;
 
-   // Find number of blocks needed
-   num_blocks = nBytes/BLOCKSIZE;
+   for (slot = nameHome(vol, key, vol->file_table[idx].parent); vol->name_slots[slot] != -1;
+    slot = (slot + 1) & (vol->name_capacity - 1))
+      ;
+   vol->name_keys[slot] = key;
+   vol->name_slots[slot] = idx;
+}
 
-   // Initialize the block as a free block linked list and update if needed
-   for (idx = 1; idx < num_blocks; idx++) {
-      *newblock = FREEBLOCK;
-      *(newblock + 1) = 0x45;
+// Hash the first count entries of file_table into a table at most half full
+static void nameRebuild(tfs_volume *vol, int count) {
+   int slot, idx;
+
+   free(vol->name_keys);
+   free(vol->name_slots);
+   for (vol->name_capacity = 16; count * 2 > vol->name_capacity; vol->name_capacity *= 2)
+      ;
+   vol->name_keys = (uint64_t *)malloc(sizeof(uint64_t) * vol->name_capacity);
+   vol->name_slots = (int *)malloc(sizeof(int) * vol->name_capacity);
+   for (slot = 0; slot < vol->name_capacity; slot++)
+      vol->name_slots[slot] = -1;
+   for (idx = 0; idx < count; idx++)
+      namePlace(vol, idx);
+}
 
-      if ((idx + 1) < num_blocks) {
-         *(newblock + 2) = idx + 1; //make this the pointer to the next block
-      }
-      else {
-         *(newblock + 2) = 0; //last block points to 0x00
-      }
+// Add file_table[idx], the newest entry, to the name hash
+static void nameInsert(tfs_volume *vol, int idx) {
+   if ((idx + 1) * 2 > vol->name_capacity)
+      nameRebuild(vol, idx + 1);
+   else
+      namePlace(vol, idx);
+}
 
-      // byte 3 remains empty
-      // Write the newBlock onto disk
-      writeBlock(disk_num, idx, newblock);
+// Slot holding name in directory parent, -1 if there is no such entry
+static int nameSlot(tfs_volume *vol, int parent, const char *name) {
+   uint64_t key;
+   int slot;
+
+   if (vol->name_capacity == 0 || strlen(name) > 8)
+      return -1;
+   key = nameKey(name);
+   for (slot = nameHome(vol, key, parent); vol->name_slots[slot] != -1;
+    slot = (slot + 1) & (vol->name_capacity - 1)) {
+      if (vol->name_keys[slot] == key &&
+       vol->file_table[vol->name_slots[slot]].parent == parent)
+         return slot;
    }
-
-   free(newblock);
+   return -1;
 }
 
+// file_table index of the entry called name in directory parent, -1 if
+// there is none. The directory must be loaded, see loadDirectory()
+static int findName(tfs_volume *vol, int parent, const char *name) {
+   int slot = nameSlot(vol, parent, name);
 
-/*Initializes the Superblock for the file system*/
-char* initSuperBlock(int nBytes) {
-   char* superblock = (char *)calloc(1, BLOCKSIZE); 
-   int num_blocks = nBytes/BLOCKSIZE;
-
-   *superblock = SUPERBLOCK; //Byte 0 is block type, using superblock macro
-   *(superblock + 1) = 0x45; //Byte 1 is magic byte for status check
-   *(superblock + 2) = 1; //Byte 2: next free block, can change
-   //NOTE: Byte 3 is an empty bytes as per spec
-   *(superblock + 4) = num_blocks; //Byte 4: total number of blocks
-   *(superblock + 5) = num_blocks - 1; //Byte 5: total number of free blocks
-   *(superblock + 6) = 0; //Byte 6: total number of files
+   return slot < 0 ? -1 : vol->name_slots[slot];
+}
 
-   return superblock;
+/* Takes name in directory parent out of the hash. Later entries of the probe run are shifted back into the hole so lookups never need tombstones. */
+static void nameRemove(tfs_volume *vol, int parent, const char *name) {
+   int hole = nameSlot(vol, parent, name), slot, home;
+
+   if (hole < 0)
+      return;
+   vol->name_slots[hole] = -1;
+   for (slot = (hole + 1) & (vol->name_capacity - 1); vol->name_slots[slot] != -1;
+    slot = (slot + 1) & (vol->name_capacity - 1)) {
+      home = nameHome(vol, vol->name_keys[slot],
+       vol->file_table[vol->name_slots[slot]].parent);
+      // Move the entry if its home is not between the hole and its slot
+      if (((slot - home) & (vol->name_capacity - 1)) >=
+       ((slot - hole) & (vol->name_capacity - 1))) {
+         vol->name_keys[hole] = vol->name_keys[slot];
+         vol->name_slots[hole] = vol->name_slots[slot];
+         vol->name_slots[slot] = -1;
+         hole = slot;
+      }
+   }
 }
 
+/* The volume in slot id, counted as in use until unpinVolume(). NULL with nothing counted if the slot is empty or its volume is being unmounted. The count goes up before the volume is looked at, and unmountFS() marks the volume closing before it reads the count, so either the call backs off or the unmount waits for it. Takes no lock. */
+static tfs_volume* pinSlot(int id) {
+   tfs_volume *vol;
 
-/* tfs_mount(char *filename) “mounts” a TinyFS file system located within ‘filename’. tfs_unmount(void) “unmounts” the currently mounted file system. As part of the mount operation, tfs_mount should verify the file system is the correct type. Only one file system may be mounted at a time. Use tfs_unmount to cleanly unmount the currently mounted file system. Must return a specified success/error code. */
-int tfs_mount(char *filename){
-   char sb_buffer[BLOCKSIZE];
-   char inode_buffer[BLOCKSIZE];
-   char free_buffer[BLOCKSIZE];
-   int idx = 0;
-   nextFD = 0;
+   __atomic_add_fetch(volume_users + id, 1, __ATOMIC_SEQ_CST);
+   vol = __atomic_load_n(volumes + id, __ATOMIC_SEQ_CST);
+   if (vol == NULL || __atomic_load_n(&vol->closing, __ATOMIC_SEQ_CST)) {
+      __atomic_sub_fetch(volume_users + id, 1, __ATOMIC_SEQ_CST);
+      return NULL;
+   }
+   return vol;
+}
 
+// The volume an FD came from, its id is in the high bits, pinned by
+// pinSlot()
+static tfs_volume* pinVolume(fileDescriptor FD) {
+   if (FD < 0 || FD >> VOLUME_SHIFT >= MAX_VOLUMES)
+      return NULL;
+   return pinSlot(FD >> VOLUME_SHIFT);
+}
 
-   if(mounted)
-      return ERROR_ALREADY_MOUNTED;
+static void unpinVolume(tfs_volume *vol) {
+   __atomic_sub_fetch(volume_users + vol->id, 1, __ATOMIC_SEQ_CST);
+}
 
-   //open the disk, return BAD_MOUNT if error occurs
-   disk_num = openDisk(filename, 0); 
-   if (disk_num < 0) {
-      return BAD_MOUNT;
-   }
+// The volume of tfs_mount(), pinned by pinSlot() under legacy_lock so a
+// tfs_unmount() either waits for the call or has already taken it away.
+// NULL if nothing is mounted
+static tfs_volume* pinLegacy(void) {
+   tfs_volume *vol;
 
-   //read in the superblock to sb_buffer
-   readBlock(disk_num, 0, sb_buffer);
-   total_files =  sb_buffer[6];
-   free_blocks = sb_buffer[5];
-
-   file_table = (file_entry *)calloc(sizeof(file_entry), total_files);
-   //start reading in inodes at byte offset 8
-   //each byte holds block number for inode
-   for (idx = 0; idx < total_files; idx++) {
-      readBlock(disk_num, sb_buffer[idx + 8], inode_buffer);
-      file_table[idx].fd = 0;
-      file_table[idx].open = 0;
-      file_table[idx].inode_block = sb_buffer[idx + 8];
-      // Store the first file block number in byte2
-      file_table[idx].file_block = inode_buffer[2];
-      memcpy(file_table[idx].name, inode_buffer + 5, 9); 
-      file_table[idx].file_offset = 0;
-   }
-
-   //create the freeblock linked list
-   free_block* current;
-   free_block* last;
-   if (free_blocks > 0) {
-      current = (free_block*)calloc(sizeof(free_block), 1);
-      current->block_number = sb_buffer[2];
-      current->next = NULL;
-      freeblock_head = current;
-      last = current;
-   }
-
-   // update the last freeblock to indicate it is the end.
-   for (idx = 1; idx < free_blocks; idx++) {
-      readBlock(disk_num, last->block_number, free_buffer);
-      current = (free_block*)calloc(sizeof(free_block), 1);
-      current->block_number = free_buffer[2];
-      current->next = NULL;
-      last->next = current;
-      last = current;
-   }
-
-   mounted = 1;
+   pthread_mutex_lock(&legacy_lock);
+   vol = legacy_volume != NULL ? pinSlot(legacy_volume->id) : NULL;
+   pthread_mutex_unlock(&legacy_lock);
+   return vol;
+}
 
-   return MOUNT_SUCCESS;
+static void unpinLegacy(tfs_volume *vol) {
+   if (vol != NULL)
+      unpinVolume(vol);
 }
 
-// Cleanly unmount the current mounted file system 
-int tfs_unmount() {
-   char sb_buffer[BLOCKSIZE];
+// Wait for every call counted in on slot id to finish
+static void drainVolume(int id) {
+   while (__atomic_load_n(volume_users + id, __ATOMIC_SEQ_CST) != 0)
+      sched_yield();
+}
 
-   if(disk_num < 0)
-      return ERROR_UNMOUNT_FAIL;
-   if(mounted == 0)
-      return ERROR_NOTHING_MOUNTED;
+// file_table index behind a descriptor of vol, -1 if it was never handed out
+// or has been retired. Called with table_lock held
+static int findFD(tfs_volume *vol, fileDescriptor FD) {
+   int local = FD & FD_LOCAL;
 
-   // Free the file_table
-   free(file_table);
-
-   // Read in the disk block to sb_buffer
-   readBlock(disk_num, 0, sb_buffer);
-   // Update all the fields to original starting point
-   sb_buffer[5] = free_blocks;
-   sb_buffer[6] = total_files;
-   sb_buffer[2] = freeblock_head->block_number;
-   // Write back the buffer to disk (reinitialize)
-   writeBlock(disk_num, 0, sb_buffer);
-
-   // Create an empty linked list
-   free_block* temp;
-   free_block* curr;
-   curr = freeblock_head;
-   while (curr != NULL) {
-      temp = curr;
-      curr = curr->next;
-      free(temp);
-   }
-   free_blocks = 0;
-   total_files = 0;
+   if (local >= vol->fd_capacity)
+      return -1;
+   return vol->fd_slots[local];
+}
 
-   closeDisk(disk_num);
-   disk_num = -1;
-   mounted = 0;
+/* Finds the file behind FD and takes the locks 'mode' asks for, see LOCK_SHARED. The volume is pinned without a lock, see pinVolume(), and the descriptor is resolved under table_lock, so looking up an FD never waits for anything but a create, delete or rename on the same volume. Returns NULL with nothing locked or pinned if FD does not name a file. */
+static file_entry* lockFD(fileDescriptor FD, int mode) {
+   tfs_volume *vol = pinVolume(FD);
+   file_entry *file;
+   int idx;
+
+   if (vol == NULL)
+      return NULL;
+   if (mode & LOCK_TABLE)
+      pthread_rwlock_wrlock(&vol->table_lock);
+   else
+      pthread_rwlock_rdlock(&vol->table_lock);
+   idx = findFD(vol, FD);
+   if (idx < 0) {
+      pthread_rwlock_unlock(&vol->table_lock);
+      unpinVolume(vol);
+      return NULL;
+   }
+   file = vol->file_table + idx;
+   if (mode & LOCK_FILE)
+      pthread_rwlock_wrlock(file->lock);
+   else if (!(mode & LOCK_TABLE))
+      pthread_rwlock_rdlock(file->lock);
+   if (mode & LOCK_META)
+      pthread_mutex_lock(&vol->meta_lock);
+   return file;
+}
 
-   return UNMOUNT_SUCCESS;
+// Drop what lockFD() took. With LOCK_TABLE the file is not looked at, it
+// may have been deleted
+static void unlockFD(tfs_volume *vol, file_entry *file, int mode) {
+   if (mode & LOCK_META)
+      pthread_mutex_unlock(&vol->meta_lock);
+   if (!(mode & LOCK_TABLE))
+      pthread_rwlock_unlock(file->lock);
+   pthread_rwlock_unlock(&vol->table_lock);
+   unpinVolume(vol);
 }
- 
-/* Opens a file for reading and writing on the currently mounted file system. Creates a dynamic resource table entry for the file, and returns a file descriptor (integer) that can be used to reference this file while the filesystem is mounted. */
-fileDescriptor tfs_openFile(char *name){
-   char* buffer;
-   int existing = 0;
-   timestamp* filetime;
 
-   for (int idx = 0; idx < total_files; idx++) {
-      if (strcmp(file_table[idx].name, name) == 0) {
-         existing = 1;
-         if (file_table[idx].open == 0) {
-            file_table[idx].open = 1;
-            file_table[idx].fd = nextFD++;
-         }
-         return file_table[idx].fd;
-      }
-   }
+// Give a file table entry a lock of its own
+static void newFileLock(file_entry *file) {
+   file->lock = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
+   pthread_rwlock_init(file->lock, NULL);
+}
 
-   if (existing == 0) {
-      ++total_files;
-      
-      free_block* inode = freeblock_head;
-      free_block* file_extent = freeblock_head->next;
-      freeblock_head = freeblock_head->next->next;
-      free_blocks -= 2;
-
-      file_table = realloc(file_table, sizeof(file_entry) * total_files);
-      file_table[total_files - 1].open = 1;
-      file_table[total_files - 1].fd = nextFD++;
-      file_table[total_files - 1].inode_block = inode->block_number;
-      file_table[total_files - 1].file_block = file_extent->block_number;
-      memcpy(file_table[total_files - 1].name, name, strlen(name) + 1);
-      
-      buffer = (char *)calloc(BLOCKSIZE, 1);
-      filetime = (timestamp *)calloc(1, sizeof(timestamp));
-      buffer[0] = INODE;
-      buffer[1] = 0x45;
-      buffer[2] = file_extent->block_number;
-      buffer[3] = 0x00;
-      memcpy(buffer + 5, name, strlen(name) + 1);
-      
-      buffer[14] = 0x03;
+static void freeFileLock(file_entry *file) {
+   if (file->lock == NULL)
+      return;
+   pthread_rwlock_destroy(file->lock);
+   free(file->lock);
+   file->lock = NULL;
+}
 
+// Hand file_table[idx] a new descriptor, retiring the one it had before
+static fileDescriptor bindFD(tfs_volume *vol, int idx) {
+   int fd;
 
-      filetime->creation = time(NULL);
-      filetime->modification = filetime->creation;
-      filetime->access = filetime->creation;
-      memcpy(buffer + 15, filetime, sizeof(timestamp));
-      writeBlock(disk_num, inode->block_number, buffer);
-      
-      readBlock(disk_num, 0, buffer);
-      buffer[total_files + 7] = inode->block_number;
-      buffer[5] = free_blocks; 
-      writeBlock(disk_num, 0, buffer);
-      
-      free(buffer);
-      free(filetime);
-      return file_table[total_files - 1].fd;
+   if (vol->next_fd >= vol->fd_capacity) {
+      vol->fd_capacity = vol->fd_capacity ? vol->fd_capacity * 2 : 16;
+      vol->fd_slots = (int *)realloc(vol->fd_slots, sizeof(int) * vol->fd_capacity);
+      for (fd = vol->next_fd; fd < vol->fd_capacity; fd++)
+         vol->fd_slots[fd] = -1;
    }
-
-   //check to see if file is existing
-   //if not existing, use freeblock to create inode, filextent for file
-   //add inode block # to superblock
-   //add file as a dynamic resource table entry that holds inode? and fd
-   return ERROR_BADFILEOPEN;
+   if (vol->file_table[idx].fd >= 0)
+      vol->fd_slots[vol->file_table[idx].fd & FD_LOCAL] = -1;
+   vol->file_table[idx].fd = vol->id << VOLUME_SHIFT | vol->next_fd;
+   vol->fd_slots[vol->next_fd++] = idx;
+   return vol->file_table[idx].fd;
 }
- 
-/* Closes the file, de-allocates all system/disk resources, and removes table entry */
-int tfs_closeFile(fileDescriptor FD) {
-   //remove dynamic resource table entry
-   for (int idx = 0; idx < total_files; idx++) {
-      if (file_table[idx].fd == FD) {
-         if (file_table[idx].open == 1) {
-            file_table[idx].open = 0;
-            accessFile(file_table[idx].inode_block);
-            return 0;
-         }
-         else {
-            return ERROR_BADFILECLOSE;
-         }
-      }
+
+// Drop the indexes and the directories, the next mount starts over
+static void freeIndexes(tfs_volume *vol) {
+   int d;
+
+   for (d = 0; d < vol->num_dirs; d++) {
+      free(vol->dirs[d].blocks);
+      free(vol->dirs[d].first);
    }
-   return ERROR_BADFILECLOSE;
+   free(vol->dirs);
+   free(vol->name_keys);
+   free(vol->name_slots);
+   free(vol->fd_slots);
+   vol->dirs = NULL;
+   vol->name_keys = NULL;
+   vol->name_slots = NULL;
+   vol->fd_slots = NULL;
+   vol->num_dirs = 0;
+   vol->name_capacity = 0;
+   vol->fd_capacity = 0;
 }
- 
 
-/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire file’s content, to the file system. Sets the file pointer to 0 (the start of file) when done. Returns success/error codes. */
-int tfs_writeFile(fileDescriptor FD, char *buffer, int size){
-   // Error checking: RW access, disk open, have enough freeBlock
-   char *freeBuffer = (char *) calloc(1, BLOCKSIZE);
-   int current_block_num, tempSize, numBlock, file_ext_num, inode, idx = 0;
-   int i, next_block_num;
-   free_block *newFile;
+static void flushTimes(file_entry *file);
+static void touchFile(file_entry *file, int modified);
 
-   numBlock = ceil((double) size / 252.0) - 1;
+// Free the file table and the extent lists it owns
+static void freeFileTable(tfs_volume *vol) {
+   int idx;
 
-   // Find the corresponding fd that exist in file_table
-   // return ERROR_BADFILE if FD is not found
-   while(file_table[idx].fd != FD) {
-      idx++;
-      if (idx > total_files) {
-         return ERROR_BADFILE;        
-      }
+   for (idx = 0; idx < vol->num_entries; idx++) {
+      free(vol->file_table[idx].extents);
+      free(vol->file_table[idx].cursor_data);
+      freeFileLock(vol->file_table + idx);
    }
-   
-   if(!file_table[idx].open) {
-      return FILE_NOT_OPEN;
-   }
-   // Find the inode block corresponding to the inode number
-   readBlock(disk_num, file_table[idx].inode_block, freeBuffer);
+   free(vol->file_table);
+   vol->file_table = NULL;
+   vol->num_entries = 0;
+   vol->table_capacity = 0;
+   freeIndexes(vol);
+}
 
-   if (freeBuffer[RW] != 0x03) {
-      free(freeBuffer);
-      return NO_WRITE_ACCESS;
+// Copy the extent list of an inode into the file table entry
+static int loadExtents(file_entry *file, const char *inode) {
+   int idx;
+
+   file->num_extents = getWord(inode, INODE_NUM_EXTENTS);
+   if (file->num_extents < 0 || file->num_extents > INODE_MAX_EXTENTS)
+      return ERROR_BADREAD;
+   file->extents = (file_extent *)malloc(sizeof(file_extent) * INODE_MAX_EXTENTS);
+   for (idx = 0; idx < file->num_extents; idx++) {
+      file->extents[idx].start = getWord(inode, INODE_EXTENTS + idx * 8);
+      file->extents[idx].length = getWord(inode, INODE_EXTENTS + idx * 8 + 4);
    }
+   return 0;
+}
 
-   current_block_num = freeBuffer[2];
-   //modification time
-   modifyFile(file_table[idx].inode_block);
-   
-   freeBuffer[3] = numBlock + 1;
-   writeBlock(disk_num, file_table[idx].inode_block, freeBuffer);
-   // Find the file extent corresponding to the one in inode_block
-   readBlock(disk_num, freeBuffer[2], freeBuffer);
-
-   //Empty File extent, write into the block
-   i = numBlock;
-   while (freeBuffer[2] != 0) {
-      readBlock(disk_num, i++, freeBuffer);
-   }
-
-   freeBuffer[0] = FILE_EXTENT;
-   freeBuffer[1] = 0x45;
-   if (size <= 252) {
-      memcpy(freeBuffer + 4, buffer, size);
-      freeBuffer[2] = 0;
-      writeBlock(disk_num, current_block_num, freeBuffer);
-   } else {
-      // grab the second free block
-      for (idx = 0; idx < numBlock; idx++) {
-         memcpy(freeBuffer + 4, buffer, size);
-         tempSize = size - 252;
-         free_block *temp = freeblock_head;
-         freeblock_head = freeblock_head->next;
-         freeBuffer[2] = temp->block_number;
-         writeBlock(disk_num, current_block_num, freeBuffer);
-      }
-      memcpy(freeBuffer + 4, buffer, tempSize);
-      freeBuffer[2] = 0;
-      writeBlock(disk_num, current_block_num, freeBuffer);
-   }
-   file_table[idx].file_offset = 0;
-   
-   return WRITE_SUCCESS;
-} 
+// Store the extent list of a file table entry in its inode buffer
+static void storeExtents(file_entry *file, char *inode) {
+   int idx;
 
-/* deletes a file and marks its blocks as free on disk. */
-int tfs_deleteFile(fileDescriptor FD){
-   int idx, last_head, current_block;
-   char readBuffer[BLOCKSIZE];
-   char *freeBuffer = (char *)calloc(1, BLOCKSIZE);
-   free_block* freeEntry;
-
-   freeBuffer[0] = FREEBLOCK;
-   freeBuffer[1] = 0x45;
-   idx = 0; 
-   while (idx < total_files && file_table[idx].fd != FD) {
-      ++idx;
-      if (idx >= total_files) {
-         return ERROR_BADFILE;
-      }
+   memset(inode + INODE_EXTENTS, 0, BLOCKSIZE - INODE_EXTENTS);
+   putWord(inode, INODE_NUM_EXTENTS, file->num_extents);
+   for (idx = 0; idx < file->num_extents; idx++) {
+      putWord(inode, INODE_EXTENTS + idx * 8, file->extents[idx].start);
+      putWord(inode, INODE_EXTENTS + idx * 8 + 4, file->extents[idx].length);
    }
+}
 
-   // Check if the file open for operation
-   if(!file_table[idx].open) {
-      return FILE_NOT_OPEN;
+static void resetCursor(file_entry *file);
+
+/* Reads the inode of file_table[idx] into the entry. The directory only gives an entry its name and inode block, so the cost of reading an inode is paid by the first open of the file and not by every mount or lookup. Returns 0, or ERROR_BADREAD with the entry left unloaded. */
+static int loadEntry(tfs_volume *vol, int idx) {
+   file_entry *file = vol->file_table + idx;
+   const char *inode_buffer;
+
+   if (file->loaded)
+      return 0;
+   inode_buffer = cachePeek(vol->cache, file->inode_block);
+   if (inode_buffer == NULL || inode_buffer[0] != INODE)
+      return ERROR_BADREAD;
+   // Keep the extent list so block lookups never touch the disk
+   if (loadExtents(file, inode_buffer) < 0) {
+      free(file->extents);
+      file->extents = NULL;
+      return ERROR_BADREAD;
    }
-   
-   readBlock(disk_num, file_table[idx].inode_block, readBuffer);
-   // Check the RW access for the file, return if READ_ONLY
-   if (readBuffer[RW] != 0x03) {
-      return NO_WRITE_ACCESS;
-   }
-   
-   while (readBuffer[2] != 0) {
-      current_block = readBuffer[2];
-      freeEntry = (free_block *)calloc(1, sizeof(file_entry));
-      freeEntry->next = freeblock_head;
-      last_head = freeblock_head->block_number;
-      freeEntry->block_number = current_block;
-      freeblock_head = freeEntry;
-      freeBuffer[2] = last_head;
-      readBlock(disk_num, current_block, readBuffer);
-      writeBlock(disk_num, current_block, freeBuffer);
-      ++free_blocks;
-   }
-   
-   current_block = file_table[idx].inode_block;
-   freeEntry = (free_block *)calloc(1, sizeof(file_entry));
-   freeEntry->next = freeblock_head;
-   last_head = freeblock_head->block_number;
-   freeEntry->block_number = current_block;
-   freeblock_head = freeEntry;
-   freeBuffer[2] = last_head;
-   writeBlock(disk_num, current_block, freeBuffer);
-   ++free_blocks;
-
-   readBlock(disk_num, 0, readBuffer);
-   for (int sbIdx = 8; sbIdx < total_files + 8; sbIdx++) {
-      if (readBuffer[sbIdx] == current_block) {
-         readBuffer[sbIdx] = readBuffer[total_files + 7];
-         readBuffer[total_files + 7] = 0x00;
-      }
-   }
-
-   --total_files;
-   readBuffer[6] = total_files;
-   readBuffer[5] = free_blocks;
-   readBuffer[2] = current_block;
-   writeBlock(disk_num, 0, readBuffer);
-   free(freeBuffer);
-  
-   memcpy(file_table + idx, file_table + total_files, sizeof(file_entry));
-   file_table = realloc(file_table, sizeof(file_entry) * total_files);
+   file->file_size = getWord(inode_buffer, INODE_SIZE);
+   memcpy(&file->times, inode_buffer + INODE_TIMES, sizeof(timestamp));
+   file->times_dirty = 0;
+   file->file_offset = 0;
+   resetCursor(file);
+   newFileLock(file);
+   file->loaded = 1;
+   return 0;
+}
 
-   //remove file from table
-   return DELETE_SUCCESS;
+// Forget the cursor and the readahead of a file, the next access places
+// the cursor again and counts as sequential from the start
+static void resetCursor(file_entry *file) {
+   file->cursor_index = -1;
+   file->cursor_extent = 0;
+   file->cursor_base = 0;
+   file->cursor_block = -1;
+   file->ra_next = 0;
+   file->ra_window = 0;
+   file->ra_end = 0;
 }
- 
-/* reads one byte from the file and copies it to buffer, using the current file pointer location and incrementing it by one upon success. If the file pointer is already at the end of the file then tfs_readByte() should return an error and not increment the file pointer. */
-int tfs_readByte(fileDescriptor FD, char *buffer) {
-   int idx, filesize, success, blockNum;
-   char readBuffer[BLOCKSIZE];
-   idx = 0;
-   while (file_table[idx].fd != FD) {
-      ++idx;
-      if (idx >= total_files)
-         return ERROR_BADFILE;
-   }
-   if (file_table[idx].open == 0) {
-      return FILE_NOT_OPEN;
-   }
 
-   readBlock(disk_num, file_table[idx].inode_block, readBuffer);
-   filesize = readBuffer[3] * 252;
-   if (file_table[idx].file_offset <= filesize) {
-      blockNum = floor((double) file_table[idx].file_offset / 252.0);
-      while(blockNum-- >= 0) {
-         readBlock(disk_num, readBuffer[2], readBuffer);
+// Prefetch data blocks start..stop-1 of a file, one cachePrefetch() per
+// extent they cross
+static void prefetchBlocks(file_entry *file, int start, int stop) {
+   int ext, base = 0, from, to;
+
+   for (ext = 0; ext < file->num_extents && start < stop; ext++) {
+      if (start < base + file->extents[ext].length) {
+         from = start - base;
+         to = stop - base < file->extents[ext].length ?
+          stop - base : file->extents[ext].length;
+         cachePrefetch(file->volume->cache, file->extents[ext].start + from,
+          to - from);
+         start = base + to;
       }
-      *buffer = readBuffer[4 + file_table[idx].file_offset++];
-      accessFile(file_table[idx].inode_block);
-      success = 0;
-   }
-   else {
-      success =  END_OF_FILE;
+      base += file->extents[ext].length;
    }
-   return success;
 }
 
-int tfs_writeByte(fileDescriptor FD, unsigned char data) {
-   int idx, filesize, success, blockNum, current_block;
-   char readBuffer[BLOCKSIZE];
-   idx = 0;
-   while (file_table[idx].fd != FD) {
-      idx++;
-      if(idx >= total_files)
-         return ERROR_BADFILE;
-   }
-   if(!file_table[idx].open) {
-      return FILE_NOT_OPEN;
-   }   
-   readBlock(disk_num, file_table[idx].inode_block, readBuffer);
-   if (readBuffer[RW] != 0x03) {
-      return NO_WRITE_ACCESS;
-   }
-   filesize = readBuffer[3] * 252;
-   if (file_table[idx].file_offset <= filesize) {
-      blockNum = floor((double) file_table[idx].file_offset / 252.0);
-      while(blockNum-- >= 0) {
-         current_block = readBuffer[2];
-         readBlock(disk_num, readBuffer[2], readBuffer);
-      }
-      readBuffer[4 + file_table[idx].file_offset++] = data;
-      modifyFile(file_table[idx].inode_block);
-      writeBlock(disk_num, current_block, readBuffer);
-      success = 0;
+/* Readahead for a read of data blocks first..last of a file. A read that starts on the block the last one ended on, or on the next one, is sequential and keeps at least half a window of blocks past it in the cache: once fewer are left the window doubles, from READAHEAD_MIN up to READAHEAD_MAX, and the blocks up to a window past 'last' are prefetched in one batch per extent. Any other read is random and closes the window, so seeking around reads nothing extra. Reads longer than READAHEAD_MAX bypass the cache and only move the window along. The state is a hint, readers that share the file lock may update it at the same time. */
+static void readAhead(file_entry *file, int first, int last) {
+   int next = __atomic_load_n(&file->ra_next, __ATOMIC_RELAXED);
+   int window = __atomic_load_n(&file->ra_window, __ATOMIC_RELAXED);
+   int end = __atomic_load_n(&file->ra_end, __ATOMIC_RELAXED);
+   int blocks, stop;
+
+   __atomic_store_n(&file->ra_next, last + 1, __ATOMIC_RELAXED);
+   if (first != next && first != next - 1) {
+      __atomic_store_n(&file->ra_window, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&file->ra_end, 0, __ATOMIC_RELAXED);
+      return;
    }
-   else {
-      success =  END_OF_FILE;
+   if (last - first >= READAHEAD_MAX) {
+      __atomic_store_n(&file->ra_end, last + 1, __ATOMIC_RELAXED);
+      return;
    }
-   return success;
+   if (window > 0 && end - (last + 1) >= window / 2)
+      return;
+
+   window = window > 0 ? window * 2 : READAHEAD_MIN;
+   window = window < READAHEAD_MAX ? window : READAHEAD_MAX;
+   blocks = (file->file_size + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+   stop = last + 1 + window < blocks ? last + 1 + window : blocks;
+   __atomic_store_n(&file->ra_window, window, __ATOMIC_RELAXED);
+   __atomic_store_n(&file->ra_end, stop, __ATOMIC_RELAXED);
+   prefetchBlocks(file, end > first ? end : first, stop);
 }
 
-// Rename the old file name to newName
-int tfs_rename(char *newName, char *oldName) {
-   int idx = 0;
-   char buffer[BLOCKSIZE];
-
-   // Check if newName is greater than 8 (support size)
-   if (strlen(newName) > 8)
-      return ERROR_RENAME_FAILURE;
-
-   // Check if the oldName is root directory or not. If so, cannot change
-   if (strcmp("/", oldName) == 0)
-      return ERROR_RENAME_FAILURE;
+// A seek to data block 'index' that does not continue where the last read
+// ended closes the readahead window, and the read after it does not count
+// as sequential either. Called with the file lock held exclusively
+static void seekAhead(file_entry *file, int index) {
+   if (index == file->ra_next || index == file->ra_next - 1)
+      return;
+   file->ra_next = -2;
+   file->ra_window = 0;
+   file->ra_end = 0;
+}
 
-   if (disk_num < 0)
-      return ERROR_BADREAD; 
+/* Moves the cursor of the file to data block 'index' and makes cursor_data a copy of that block. Staying on the same block costs nothing, moving forward steps through the extents from the current one and reads the one new block, only moving backwards starts over from the first extent. Returns 0 or ERROR_BADREAD if the file has no such block. */
+static int seekCursor(file_entry *file, int index) {
+   int ext = file->cursor_extent, base = file->cursor_base, bNum;
 
-   // Since we change the filename, modification and access time will be
-   // updated 
-   modifyFile(file_table[idx].inode_block);
-   // Find the file in the system with oldName
-   while (strcmp(file_table[idx].name, oldName) != 0) {
-      idx++;
-      if(idx >= total_files)
-         return ERROR_BADFILE;
+   if (file->cursor_index == index)
+      return 0;
+   if (file->cursor_index < 0 || index < file->cursor_index) {
+      ext = 0;
+      base = 0;
    }
-   // Return FILE_NOT_OPEN if file is not open for write
-   if(!file_table[idx].open) {
-      return FILE_NOT_OPEN;
-   }   
-
-   // Change the oldname in file_table to newName
-   strcpy(file_table[idx].name, newName);
-   // Read the inodeBlock to buffer
-   readBlock(disk_num, file_table[idx].inode_block, buffer);
-   // If READ Only, returns NO_WRITE_ACCESS
-   // FileName will not modify
-   if (buffer[RW] != 0x03) {
-      free(buffer);
-      return NO_WRITE_ACCESS;
+   while (ext < file->num_extents && index >= base + file->extents[ext].length) {
+      base += file->extents[ext].length;
+      ext++;
    }
- 
-   // Push the changes in buffer back to inode block.  
-   memcpy(buffer + 5, newName, strlen(newName) + 1);
-   writeBlock(disk_num, file_table[idx].inode_block, buffer);
-     
-   return RENAME_SUCCESS;
+   if (ext >= file->num_extents)
+      return ERROR_BADREAD;
+
+   if (file->cursor_data == NULL)
+      file->cursor_data = (char *)malloc(BLOCKSIZE);
+   bNum = file->extents[ext].start + index - base;
+   if (cacheRead(file->volume->cache, bNum, file->cursor_data) < 0) {
+      resetCursor(file);
+      return ERROR_BADREAD;
+   }
+   file->cursor_index = index;
+   file->cursor_extent = ext;
+   file->cursor_base = base;
+   file->cursor_block = bNum;
+   return 0;
 }
 
-// Print out a list of directories and files of the file system
-int tfs_readdir() {
-   int idx = 0;
+// The mounted volume whose image is filename, NULL if there is none.
+// Called with volumes_lock held
+static tfs_volume* volumeNamed(char *filename) {
+   int id;
 
-   printf("********** List of Files and Directories **********\n");
-   // Loop through the file_table and print all the files/ directories' names
-   while (idx < total_files) {
-      printf("%s\n", file_table[idx++].name);
+   for (id = 0; id < MAX_VOLUMES; id++) {
+      if (volumes[id] != NULL && strcmp(volumes[id]->filename, filename) == 0)
+         return volumes[id];
    }
-   
-   printf("**********            Done               **********\n");
-   // Return success when finished
-   return READDIR_SUCCESS;
+   return NULL;
 }
- 
-/* change the file pointer location to offset (absolute). Returns success/error codes.*/
-int tfs_seek(fileDescriptor FD, int offset) {
-   int file_size, code, currentBlock, idx = 0; 
-   char *freeBuffer = (char *)calloc(1, BLOCKSIZE);
-
-   //inode byte 3 will be file pointer
-   while(file_table[idx].fd != FD) {
-      idx++;
-      if (idx >= total_files) {
-         return ERROR_BADFILE;        
-      }
-   }
-   
-   readBlock(disk_num, file_table[idx].inode_block, freeBuffer);
-   // Check if offset is greater than the size * 252 byte
-   // If so, return BADFILE, since offset cannot be greater than the file size
-   // else set file_offset to the offset that was passed in
-   if (offset < freeBuffer[3] * 252) {
-      code = 0;
-      file_table[idx].file_offset = offset;
-   } 
-   else {
-      offset = 0;
-      code = ERROR_BADFILE;
-   }
-   free(freeBuffer);
 
-   // return 0 if success, BADFILE if error occurs.
-   return code;
-}
+//TODO
+//CURRENTLY MOUNTED, WRITE IF NOT ENOUGH FREE BLOCKS TO WRITE, OPENFILE IF NOT ENOUGH FREEBLOCKS,
+//all functions if disk is not mounted
+/* Makes a blank TinyFS file system of size nBytes on the file specified by ‘filename’. This function should use the emulated disk library to open the specified file, and upon success, format the file to be mountable. This includes initializing all data to 0x00, setting magic numbers, initializing and writing the superblock and inodes, etc. Must return a specified success/error code. An image that is mounted as a volume cannot be made over. */
+static int makeFS(char *filename, off_t nBytes) {
+   tfs_volume *vol;
+   char *superblock;
+   int disk, code;
+
+   pthread_mutex_lock(&volumes_lock);
+   vol = volumeNamed(filename);
+   pthread_mutex_unlock(&volumes_lock);
+   if (vol != NULL)
+      return ERROR_ALREADY_MOUNTED;
 
-// Change the file READRITE ACCESS to Read Only
-int tfs_makeRO(char *name) {
-   int idx, existing = 0;
-   char* buffer = (char *) calloc(1, BLOCKSIZE);
-
-   // Loop through the file system to find the file with corresponding name
-   for (idx = 0; idx < total_files; idx++) {
-      if(idx < total_files) {
-         if (strcmp(file_table[idx].name, name) == 0) {
-            existing = 1;
-            // Read inode block into buffer
-            readBlock(disk_num, file_table[idx].inode_block, buffer);
-            // Change the READWRITE Byte to READ only
-            buffer[14] = 0x01;
-            //Write buffer back to the inode block
-            writeBlock(disk_num, file_table[idx].inode_block, buffer);
-         }
-      } else {
-         return ERROR_BADFILE;
-      }
-   }
-   // Return BADFILE if file never exist
-   if (existing == 0) {
-      return ERROR_BADFILE;
-   }
-   return 0;
-}
+   // Block numbers are 32-bit words on disk, the superblock and the bitmap
+   // need at least one block each, small volumes go without a journal
+   if (nBytes / BLOCKSIZE < 2 || nBytes / BLOCKSIZE > MAX_BLOCKS)
+      return ERROR_OPENDISK;
 
-// Change the file READWRITE Access to Read and Write
-int tfs_makeRW(char *name) {
-   int existing = 0;
-   char* buffer = (char *) calloc(1, BLOCKSIZE);
+   // Get the disk number where filename is reside in
+   disk = openDisk(filename, nBytes);
 
-   // Loop through all the file in the system to find matching file name
-   // return BADFILE if file never found
-   for (int idx = 0; idx < total_files; idx++) {
-      if(idx < total_files) {
-         if (strcmp(file_table[idx].name, name) == 0) {
-            existing = 1;
-            
-            // Read the inode block to buffer
-            readBlock(disk_num, file_table[idx].inode_block, buffer);
-            // Change the Readwrite byte to RW
-            buffer[14] = 0x03;
-            // Write the buffer back to inode Block
-            writeBlock(disk_num, file_table[idx].inode_block, buffer);
-         }
-      } else {
-         return ERROR_BADFILE;
-      }
+   //check to see if opendisk was a success, error code for failure
+   if (disk < 0) {
+      return ERROR_OPENDISK;
    }
 
-   // if file never exist, return BADFILE
-   if (existing == 0) {
-      return ERROR_BADFILE;
+   // Initialize File System, the superblock goes last so a format that
+   // fails half way never mounts
+   code = initFS(disk, nBytes);
+   if (code == 0) {
+      // Initialize superBlock
+      superblock = initSuperBlock(nBytes);
+      // Write SB to the file
+      if (superblock == NULL || writeBlock(disk, 0, superblock) < 0)
+         code = ERROR_BADWRITE;
+      free(superblock);
    }
-   return 0;
+   if (code == 0 && syncDisk(disk) < 0)
+      code = ERROR_BADWRITE;
+   closeDisk(disk);
 
+   return code < 0 ? code : MAKEFS_SUCCESS;
 }
 
-//tfs_readFileInfo returns a timestamp struct with  creation time or all info 
-timestamp* tfs_readFileInfo(fileDescriptor FD) {
-   //Initialization
-   int idx = 0; 
-   char *buffer = (char *)calloc(1, BLOCKSIZE);
-   timestamp* time = (timestamp *) calloc(1, sizeof(timestamp));
-
-   // Find the corresponding file with FD, return BADFILE if not found
-   while(file_table[idx].fd != FD) {
-      idx++;
-      if(idx >= total_files)
-         break;
-   }
 
-   // Get the inode block and put in buffer
-   readBlock(disk_num, file_table[idx].inode_block, buffer);
+/*Initializes the file system on a freshly opened disk, which reads as zeros. The bitmap blocks come right after the superblock, followed by the journal, all of them marked used, every other block is free. Only the bitmap blocks that cover those metadata blocks are written: a bitmap block of zeros leaves its blocks free, and a journal of zeros holds nothing to replay, so formatting takes time and memory in proportion to the metadata and not to the disk. Blocks are written INIT_BATCH per writeBlocks() call. Returns 0, or ERROR_BADWRITE if memory runs out or a write fails*/
+int initFS(int disk, off_t nBytes) {
+   int num_blocks, used, map_blocks, first, count, idx, code = 0;
+   char* batch = (char *)malloc((size_t)INIT_BATCH * BLOCKSIZE);
+   block_bitmap* map;
 
-   // Get the all the timestamp(create, access, modification)
-   memcpy(time, buffer + 15, sizeof(timestamp));
-   free(buffer);
+   // Find number of blocks needed
+   num_blocks = nBytes/BLOCKSIZE;
+   used = 1 + bitmapBlocks(num_blocks) + journalBlocks(num_blocks);
+   map = bitmapCreate(num_blocks);
+   if (batch == NULL || map == NULL) {
+      bitmapDestroy(map);
+      free(batch);
+      return ERROR_BADWRITE;
+   }
+   bitmapSet(map, 0, used);
+
+   // Bitmap blocks past the metadata are all zeros already
+   map_blocks = (used + BITMAP_BITS - 1) / BITMAP_BITS;
+   for (first = 0; first < map_blocks && code == 0; first += count) {
+      count = map_blocks - first < INIT_BATCH ? map_blocks - first : INIT_BATCH;
+      for (idx = first; idx < first + count; idx++)
+         bitmapStore(map, idx, batch + (idx - first) * BLOCKSIZE);
+      // Write the whole batch onto disk
+      if (writeBlocks(disk, 1 + first, count, batch) < 0)
+         code = ERROR_BADWRITE;
+   }
 
-   return time;
+   bitmapDestroy(map);
+   free(batch);
+   return code;
 }
 
-void accessFile(int inode) {
-   // Initialization
-   char* buffer = (char *)calloc(BLOCKSIZE, 1);
-   timestamp* filetime = (timestamp *)calloc(sizeof(timestamp), 1);
 
-   // Read the inode block that specify in the parameter to buffer
-   readBlock(disk_num, inode, buffer);
-
-   // copy the file times to filetime struct
-   memcpy(filetime, buffer + 15, sizeof(timestamp));
+/*Initializes the Superblock for the file system*/
+char* initSuperBlock(off_t nBytes) {
+   char* superblock = (char *)calloc(1, BLOCKSIZE); 
+   int num_blocks = nBytes/BLOCKSIZE;
+   int map_blocks = bitmapBlocks(num_blocks);
+   int journal_blocks = journalBlocks(num_blocks);
 
-   // Update file access time;
-   filetime->access = time(NULL);
-   
-   // Write back the update structure to buffer and write to inodeBlock
-   memcpy(buffer + 15, filetime, sizeof(timestamp));
-   writeBlock(disk_num, inode, buffer);
+   *superblock = SUPERBLOCK; //Byte 0 is block type, using superblock macro
+   *(superblock + 1) = MAGIC; //Byte 1 is magic byte for status check
+   *(superblock + SB_VERSION) = FS_VERSION; //Byte 2: layout version
+   putWord(superblock, SB_BITMAP_BLOCKS, map_blocks); //bitmap follows the superblock
+   putWord(superblock, SB_TOTAL_BLOCKS, num_blocks); //total number of blocks
+   putWord(superblock, SB_FREE_BLOCKS, num_blocks - 1 - map_blocks - journal_blocks); //total number of free blocks
+   putWord(superblock, SB_TOTAL_FILES, 0); //total number of files
+   putWord(superblock, SB_JOURNAL_BLOCKS, journal_blocks); //journal follows the bitmap
 
-   // clean up
-   free(buffer);
-   free(filetime);
+   return superblock;
 }
 
-void modifyFile(int inode) {
-   char* buffer = (char *)calloc(BLOCKSIZE, 1);
-   timestamp* filetime = (timestamp *)calloc(sizeof(timestamp), 1);
 
-   // find the inode block using the inode number pass in and write to buffer
-   readBlock(disk_num, inode, buffer);
+// Give the slot of a volume back and free it, its FDs stop resolving. Calls
+// that pinned the slot before it emptied only look at the closing flag,
+// they are waited for with the slot held so a new mount cannot take it
+static void releaseVolume(tfs_volume *vol) {
+   pthread_mutex_lock(&volumes_lock);
+   __atomic_store_n(volumes + vol->id, NULL, __ATOMIC_SEQ_CST);
+   drainVolume(vol->id);
+   pthread_mutex_unlock(&volumes_lock);
+   pthread_rwlock_destroy(&vol->table_lock);
+   pthread_mutex_destroy(&vol->meta_lock);
+   free(vol->filename);
+   free(vol);
+}
 
-   // Get current times from buffer to filetime struct
-   memcpy(filetime, buffer + 15, sizeof(timestamp));
+// Undo a half finished mount once the disk is open
+static int abortMount(tfs_volume *vol) {
+   bitmapDestroy(vol->free_map);
+   freeFileTable(vol);
+   cacheDestroy(vol->cache);
+   journalClose(vol->log);
+   closeDisk(vol->disk);
+   releaseVolume(vol);
+   return BAD_MOUNT;
+}
 
-   // Update modification and access time
-   filetime->modification = time(NULL);
-   filetime->access = filetime->modification;
+static int mountFS(char *filename, tfs_volume **volume);
+static int unmountFS(tfs_volume *vol);
+static fileDescriptor openFile(tfs_volume *vol, char *name);
+static int closeFile(file_entry *file);
+static int writeFile(file_entry *file, char *buffer, int size);
+
+//a file read out of a legacy volume by convertLegacy
+typedef struct legacy_file {
+   char name[9];
+   char rw;
+   timestamp times;
+   char *data;
+   int size;
+} legacy_file;
+
+/* Reads the files of a legacy image into files, num_files of them, and returns the blocks the current format needs for them, or BAD_MOUNT if the image does not hold together. The image is not trusted: every inode and extent number has to be a block of the image that no other inode or extent uses, which also ends a chain that runs in a circle. */
+static int readLegacy(char *image, int num_blocks, legacy_file *files, int num_files) {
+   char *used = (char *)calloc(num_blocks, 1);
+   char *inode;
+   int needed, extents, current, idx;
+
+   if (used == NULL)
+      return BAD_MOUNT;
+   used[0] = 1;
+   needed = 1 + bitmapBlocks(num_blocks) + journalBlocks(num_blocks);
+   for (idx = 0; idx < num_files && needed > 0; idx++) {
+      current = (unsigned char)image[8 + idx];
+      if (current >= num_blocks || used[current]) {
+         needed = BAD_MOUNT;
+         break;
+      }
+      used[current] = 1;
+      inode = image + current * BLOCKSIZE;
+
+      memcpy(files[idx].name, inode + 5, 9);
+      files[idx].name[8] = '\0';
+      files[idx].rw = inode[14];
+      memcpy(&files[idx].times, inode + 15, sizeof(timestamp));
+      files[idx].data = (char *)calloc((unsigned char)inode[3] + 1, 252);
+      if (files[idx].data == NULL) {
+         needed = BAD_MOUNT;
+         break;
+      }
+
+      extents = 0;
+      current = (unsigned char)inode[2];
+      while (current != 0 && extents < (unsigned char)inode[3]) {
+         if (current >= num_blocks || used[current]) {
+            needed = BAD_MOUNT;
+            break;
+         }
+         used[current] = 1;
+         memcpy(files[idx].data + extents * 252,
+          image + current * BLOCKSIZE + 4, 252);
+         current = (unsigned char)image[current * BLOCKSIZE + 2];
+         extents++;
+      }
+      files[idx].size = extents * 252;
+      if (needed > 0)
+         needed += 1 + (files[idx].size + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+   }
+   free(used);
+   return needed;
+}
+
+// Throw away an image convertLegacy() did not finish
+static void discardImage(char *filename) {
+   if (removeMemoryDisk(filename) < 0)
+      remove(filename);
+}
+
+/* Rewrites a volume in the legacy one-byte block address format (LEGACY_MAGIC) in the current format, mountFS() then mounts the result. Legacy layout: superblock 2-next free, 4-total blocks, 5-free blocks, 6-total files, 8-inode table of one-byte block numbers; inode 2-file extent, 3-number of extents, 5-name, 14-RW, 15-timestamp; extent 2-next block, 4-data. Legacy volumes are at most 256 blocks, so the whole image is read into memory. The new volume is built in a second image next to it, which replaces the legacy one with renameDisk() only once it is complete and unmounted, so a conversion that fails leaves the legacy image as it was. File sizes were kept in whole extents, so converted files are a multiple of 252 bytes long. */
+static int convertLegacy(char *filename) {
+   char block[BLOCKSIZE];
+   char *image, *temp;
+   legacy_file *files;
+   file_entry *file;
+   tfs_volume *vol;
+   int disk, num_blocks, num_files, needed, idx;
+   int code = MOUNT_SUCCESS;
+
+   disk = openDisk(filename, 0);
+   if (disk < 0 || readBlock(disk, 0, block) < 0) {
+      if (disk >= 0)
+         closeDisk(disk);
+      return BAD_MOUNT;
+   }
+
+   // The inode table ends with the superblock
+   num_blocks = (unsigned char)block[4] ? (unsigned char)block[4] : 256;
+   num_files = (unsigned char)block[6];
+   if (num_files > BLOCKSIZE - 8 || num_files > MAX_FILES) {
+      closeDisk(disk);
+      return BAD_MOUNT;
+   }
+   image = (char *)calloc(num_blocks, BLOCKSIZE);
+   files = (legacy_file *)calloc(num_files + 1, sizeof(legacy_file));
+   temp = (char *)malloc(strlen(filename) + sizeof(".convert"));
+   if (image == NULL || files == NULL || temp == NULL ||
+    readBlocks(disk, 0, num_blocks, image) < 0) {
+      closeDisk(disk);
+      free(image);
+      free(files);
+      free(temp);
+      return BAD_MOUNT;
+   }
+   closeDisk(disk);
+
+   // Pull every file out of the image and count the blocks it will need
+   needed = readLegacy(image, num_blocks, files, num_files);
+   free(image);
+   sprintf(temp, "%s.convert", filename);
+
+   if (needed < 0 || needed > num_blocks) {
+      code = BAD_MOUNT;
+   }
+   else if (makeFS(temp, (off_t)num_blocks * BLOCKSIZE) != MAKEFS_SUCCESS ||
+    mountFS(temp, &vol) != MOUNT_SUCCESS) {
+      discardImage(temp);
+      code = BAD_MOUNT;
+   }
+   else {
+      for (idx = 0; idx < num_files; idx++) {
+         // Nobody else has the volume yet, so nothing is locked
+         if (openFile(vol, files[idx].name) < 0) {
+            code = BAD_MOUNT;
+            break;
+         }
+         file = vol->file_table + vol->num_entries - 1;
+         if (writeFile(file, files[idx].data, files[idx].size) < 0) {
+            code = BAD_MOUNT;
+            break;
+         }
+         closeFile(file);
+         // Keep the RW byte and the original timestamps
+         if (cacheRead(vol->cache, file->inode_block, block) < 0) {
+            code = BAD_MOUNT;
+            break;
+         }
+         block[RW] = files[idx].rw;
+         cacheWrite(vol->cache, file->inode_block, block);
+         memcpy(&file->times, &files[idx].times, sizeof(timestamp));
+         file->times_dirty = 1;
+         flushTimes(file);
+      }
+      if (unmountFS(vol) != UNMOUNT_SUCCESS)
+         code = BAD_MOUNT;
+      if (code == MOUNT_SUCCESS && renameDisk(temp, filename) < 0)
+         code = BAD_MOUNT;
+      if (code != MOUNT_SUCCESS)
+         discardImage(temp);
+   }
+
+   for (idx = 0; idx < num_files; idx++)
+      free(files[idx].data);
+   free(files);
+   free(temp);
+   return code;
+}
+
+// Hand the bitmap blocks changed since the last call to the cache
+static void storeBitmap(tfs_volume *vol) {
+   char block[BLOCKSIZE];
+   int index;
+
+   if (vol->free_map == NULL)
+      return;
+   for (index = 0; index < vol->free_map->num_map_blocks; index++) {
+      if (vol->free_map->dirty[index]) {
+         bitmapStore(vol->free_map, index, block);
+         cacheWrite(vol->cache, 1 + index, block);
+      }
+   }
+   if (vol->log != NULL && vol->free_map->num_pending > 0)
+      vol->freed_at = vol->log->sequence;
+}
+
+// Bitmap blocks holding the bits of count blocks from start
+static int mapSpan(int start, int count) {
+   return (start + count - 1) / BITMAP_BITS - start / BITMAP_BITS + 1;
+}
+
+/* tfs_mount(char *filename) “mounts” a TinyFS file system located within ‘filename’. tfs_unmount(void) “unmounts” the currently mounted file system. As part of the mount operation, tfs_mount should verify the file system is the correct type. Use tfs_unmount to cleanly unmount the currently mounted file system. Must return a specified success/error code. Any number of images up to MAX_VOLUMES can be mounted at once, each as its own volume, stored in *volume, but an image only once. Volumes in the legacy one-byte block address format are converted to the current format first. */
+static int mountFS(char *filename, tfs_volume **volume) {
+   char sb_buffer[BLOCKSIZE];
+   tfs_volume *vol;
+   int num_blocks, map_blocks, journal_blocks, bNum, id, code;
+
+   // Claim a slot in the volume table, its id goes into every FD
+   vol = (tfs_volume *)calloc(1, sizeof(tfs_volume));
+   vol->filename = strdup(filename);
+   pthread_rwlock_init(&vol->table_lock, NULL);
+   pthread_mutex_init(&vol->meta_lock, NULL);
+   pthread_mutex_lock(&volumes_lock);
+   for (id = 0; id < MAX_VOLUMES && volumes[id] != NULL; id++)
+      ;
+   if (volumeNamed(filename) != NULL)
+      code = ERROR_ALREADY_MOUNTED;
+   else
+      code = id < MAX_VOLUMES ? MOUNT_SUCCESS : BAD_MOUNT;
+   if (code == MOUNT_SUCCESS) {
+      vol->id = id;
+      __atomic_store_n(volumes + id, vol, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&volumes_lock);
+   if (code != MOUNT_SUCCESS) {
+      pthread_rwlock_destroy(&vol->table_lock);
+      pthread_mutex_destroy(&vol->meta_lock);
+      free(vol->filename);
+      free(vol);
+      return code;
+   }
+
+   //open the disk, return BAD_MOUNT if error occurs
+   vol->disk = openDisk(filename, 0); 
+   if (vol->disk < 0) {
+      releaseVolume(vol);
+      return BAD_MOUNT;
+   }
+
+   //read in the superblock to sb_buffer and verify the file system type
+   if (readBlock(vol->disk, 0, sb_buffer) < 0 || sb_buffer[0] != SUPERBLOCK)
+      return abortMount(vol);
+   if (sb_buffer[1] == LEGACY_MAGIC) {
+      closeDisk(vol->disk);
+      releaseVolume(vol);
+      code = convertLegacy(filename);
+      return code == MOUNT_SUCCESS ? mountFS(filename, volume) : code;
+   }
+   if (sb_buffer[1] != MAGIC || sb_buffer[SB_VERSION] != FS_VERSION)
+      return abortMount(vol);
+
+   vol->cache = cacheCreate(vol->disk, cache_size);
+   if (vol->cache == NULL)
+      return abortMount(vol);
+
+   num_blocks = getWord(sb_buffer, SB_TOTAL_BLOCKS);
+   map_blocks = getWord(sb_buffer, SB_BITMAP_BLOCKS);
+   journal_blocks = getWord(sb_buffer, SB_JOURNAL_BLOCKS);
+   if (num_blocks <= 0 || map_blocks != bitmapBlocks(num_blocks) ||
+    journal_blocks != journalBlocks(num_blocks))
+      return abortMount(vol);
+
+   //finish whatever the last committed transaction left half written before
+   //anything else is read, the superblock may be one of its blocks
+   if (journal_blocks > 0) {
+      vol->log = journalOpen(vol->disk, 1 + map_blocks, journal_blocks);
+      if (vol->log == NULL || journalRecover(vol->log) < 0 ||
+       readBlock(vol->disk, 0, sb_buffer) < 0)
+         return abortMount(vol);
+      vol->freed_at = vol->log->sequence;
+   }
+   cacheAttachJournal(vol->cache, vol->log);
+
+   vol->total_files = getWord(sb_buffer, SB_TOTAL_FILES);
+   vol->free_blocks = getWord(sb_buffer, SB_FREE_BLOCKS);
+   if (vol->total_files > MAX_FILES || vol->free_blocks >= num_blocks)
+      return abortMount(vol);
+
+   bNum = getWord(sb_buffer, SB_DIRECTORY);
+   if (bNum < 0 || bNum >= num_blocks || (bNum == 0) != (vol->total_files == 0))
+      return abortMount(vol);
+
+   //the root is known but its entries wait for the first lookup, see
+   //loadDirectory(), and the bitmap for the first allocation, see
+   //loadAllocator()
+   vol->dirs = (dir_node *)calloc(1, sizeof(dir_node));
+   vol->num_dirs = 1;
+   vol->mount_flags = mount_options;
+
+   *volume = vol;
+   return MOUNT_SUCCESS;
+}
+
+// Cleanly unmount a volume, it is freed along with its FDs even if writing
+// it back fails. Returns UNMOUNT_SUCCESS, or ERROR_UNMOUNT_FAIL if the
+// superblock could not be read or the cache or the disk could not be synced
+static int unmountFS(tfs_volume *vol) {
+   char sb_buffer[BLOCKSIZE];
+   int code = UNMOUNT_SUCCESS;
+
+   if (vol == NULL)
+      return ERROR_UNMOUNT_FAIL;
+
+   // Turn new calls away and wait for the running ones, see pinVolume().
+   // The flag changes under volumes_lock so tfs_resetStats() never looks
+   // at a cache being torn down
+   pthread_mutex_lock(&volumes_lock);
+   __atomic_store_n(&vol->closing, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock(&volumes_lock);
+   drainVolume(vol->id);
+   pthread_rwlock_wrlock(&vol->table_lock);
+
+   // Timestamps held back by MOUNT_LAZYTIME go to the inodes first
+   for (int idx = 0; idx < vol->num_entries; idx++)
+      flushTimes(vol->file_table + idx);
+   // Free the file_table
+   freeFileTable(vol);
+
+   // Read in the disk block to sb_buffer, a superblock that cannot be read
+   // is left alone rather than overwritten with garbage
+   if (cacheRead(vol->cache, 0, sb_buffer) < 0) {
+      code = ERROR_UNMOUNT_FAIL;
+   }
+   else {
+      // Update all the fields to original starting point
+      putWord(sb_buffer, SB_FREE_BLOCKS, vol->free_blocks);
+      putWord(sb_buffer, SB_TOTAL_FILES, vol->total_files);
+      // Write back the buffer to disk (reinitialize)
+      cacheWrite(vol->cache, 0, sb_buffer);
+   }
+
+   // Write back the bitmap blocks that changed
+   storeBitmap(vol);
+   bitmapDestroy(vol->free_map);
+
+   // Write back everything still dirty before the disk goes away, the
+   // last commit made the metadata durable but not its home writes
+   if (cacheDestroy(vol->cache) < 0)
+      code = ERROR_UNMOUNT_FAIL;
+   if (syncDisk(vol->disk) < 0)
+      code = ERROR_UNMOUNT_FAIL;
+   journalClose(vol->log);
+   closeDisk(vol->disk);
+   pthread_rwlock_unlock(&vol->table_lock);
+   releaseVolume(vol);
+
+   return code;
+}
+ 
+/* Loads the free space bitmap in one pass the first time a call allocates or frees blocks, so mounting never reads it. The free count comes from the bitmap itself so a stale superblock count cannot leak blocks. Called with meta_lock held. Returns 0 or ERROR_BADREAD. */
+static int loadAllocator(tfs_volume *vol) {
+   char sb_buffer[BLOCKSIZE];
+   char *map_buffer;
+   block_bitmap *map;
+   int num_blocks;
+
+   if (vol->free_map != NULL)
+      return 0;
+   if (cacheRead(vol->cache, 0, sb_buffer) < 0)
+      return ERROR_BADREAD;
+   num_blocks = getWord(sb_buffer, SB_TOTAL_BLOCKS);
+   map = bitmapCreate(num_blocks);
+   map_buffer = map != NULL ?
+    (char *)malloc((size_t)map->num_map_blocks * BLOCKSIZE) : NULL;
+   if (map_buffer == NULL ||
+    readBlocks(vol->disk, 1, map->num_map_blocks, map_buffer) < 0 ||
+    bitmapLoad(map, map_buffer) < 0 || !bitmapTest(map, 0)) {
+      free(map_buffer);
+      bitmapDestroy(map);
+      return ERROR_BADREAD;
+   }
+   free(map_buffer);
+   vol->free_map = map;
+   vol->free_blocks = map->num_free;
+   return 0;
+}
+
+// Hand deferred blocks out again once their free has been committed
+static void checkCommitted(tfs_volume *vol) {
+   if (vol->log != NULL && vol->free_map->num_pending > 0 &&
+    vol->log->sequence != vol->freed_at)
+      bitmapCommit(vol->free_map);
+}
+
+/* Commits everything dirty so the deferred blocks can be handed out again. Only called between operations, when the metadata in the cache is consistent. Returns 1 if blocks were made available, 0 if there were none or the commit failed. */
+static int commitDeferred(tfs_volume *vol) {
+   if (vol->log == NULL || vol->free_map->num_pending == 0)
+      return 0;
+   storeBitmap(vol);
+   if (cacheSync(vol->cache) < 0)
+      return 0;
+   bitmapCommit(vol->free_map);
+   return 1;
+}
+
+// Take the lowest free block, -1 if the disk is full
+static int allocBlock(tfs_volume *vol) {
+   int bNum;
+
+   checkCommitted(vol);
+   bNum = bitmapAlloc(vol->free_map);
+   if (bNum >= 0)
+      vol->free_blocks = vol->free_map->num_free;
+   return bNum;
+}
+
+// Take count consecutive free blocks, -1 if there is no run that long
+static int allocRun(tfs_volume *vol, int count) {
+   int start;
+
+   checkCommitted(vol);
+   start = bitmapAllocRun(vol->free_map, count);
+   if (start >= 0)
+      vol->free_blocks = vol->free_map->num_free;
+   return start;
+}
+
+// Hold freed blocks back until a transaction after the current one commits,
+// see checkCommitted(). Stamped here and not only by storeBitmap(), an
+// allocation in the same operation must not find them committed already
+static void deferBlocks(tfs_volume *vol, int start, int count) {
+   bitmapDefer(vol->free_map, start, count);
+   vol->freed_at = vol->log->sequence;
+}
+
+// Mark count blocks from start free, the blocks themselves are left as they
+// are. With a journal they are deferred until the free is committed
+static void releaseBlocks(tfs_volume *vol, int start, int count) {
+   bitmapClear(vol->free_map, start, count);
+   if (vol->log != NULL)
+      deferBlocks(vol, start, count);
+   vol->free_blocks = vol->free_map->num_free;
+}
+
+// Sort key of a name: its bytes big endian, so keys compare like strcmp()
+static uint64_t dirKey(const char *name) {
+   uint64_t key = 0;
+   int idx;
+
+   for (idx = 0; idx < 8; idx++) {
+      key <<= 8;
+      if (*name != '\0')
+         key |= (unsigned char)*name++;
+   }
+   return key;
+}
+
+// Sort key of entry 'pos' of a directory block
+static uint64_t entryKey(const char *block, int pos) {
+   const unsigned char *bytes =
+    (const unsigned char *)block + DIR_ENTRIES + pos * DIR_ENTRY_SIZE;
+   uint64_t key = 0;
+   int idx;
+
+   for (idx = 0; idx < 8; idx++)
+      key = key << 8 | bytes[idx];
+   return key;
+}
+
+// First entry of a directory block whose key is not below 'key'
+static int entrySearch(const char *block, int count, uint64_t key) {
+   int low = 0, high = count, mid;
+
+   while (low < high) {
+      mid = (low + high) / 2;
+      if (entryKey(block, mid) < key)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+// Index in dir->blocks of the block a name with this key belongs in: the
+// last one starting at or below it, or the first one
+static int dirSearch(dir_node *dir, uint64_t key) {
+   int low = 0, high = dir->count, mid;
+
+   while (low < high) {
+      mid = (low + high) / 2;
+      if (dir->first[mid] <= key)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low > 0 ? low - 1 : 0;
+}
+
+// Put directory block bNum at 'index' of the in memory block list
+static void dirListInsert(dir_node *dir, int index, int bNum, uint64_t first) {
+   if (dir->count == dir->capacity) {
+      dir->capacity = dir->capacity ? dir->capacity * 2 : 16;
+      dir->blocks = (int *)realloc(dir->blocks, sizeof(int) * dir->capacity);
+      dir->first = (uint64_t *)realloc(dir->first, sizeof(uint64_t) * dir->capacity);
+   }
+   memmove(dir->blocks + index + 1, dir->blocks + index,
+    sizeof(int) * (dir->count - index));
+   memmove(dir->first + index + 1, dir->first + index,
+    sizeof(uint64_t) * (dir->count - index));
+   dir->blocks[index] = bNum;
+   dir->first[index] = first;
+   dir->count++;
+}
+
+// Append a cleared entry to file_table and return its index. The table
+// grows by doubling, so loading a large directory copies it only a few times
+static int newEntry(tfs_volume *vol) {
+   file_entry *file;
+
+   if (vol->num_entries == vol->table_capacity) {
+      vol->table_capacity = vol->table_capacity ? vol->table_capacity * 2 : 16;
+      vol->file_table = (file_entry *)realloc(vol->file_table,
+       sizeof(file_entry) * vol->table_capacity);
+   }
+   file = vol->file_table + vol->num_entries;
+   memset(file, 0, sizeof(file_entry));
+   file->fd = -1;
+   file->dir = -1;
+   file->volume = vol;
+   return vol->num_entries++;
+}
+
+// Give the directory with inode block 'inode' inside 'parent' a slot in
+// dirs. Slots of removed directories are never handed out again in a mount,
+// so a tfs_dir left on one cannot wander into another directory
+static int newDir(tfs_volume *vol, int inode, int parent) {
+   dir_node *dir;
+
+   vol->dirs = (dir_node *)realloc(vol->dirs, sizeof(dir_node) * (vol->num_dirs + 1));
+   dir = vol->dirs + vol->num_dirs;
+   memset(dir, 0, sizeof(dir_node));
+   dir->inode = inode;
+   dir->parent = parent;
+   return vol->num_dirs++;
+}
+
+/* Reads directory d into file_table and the name hash the first time a lookup passes through it, walking its chain of directory blocks through the cache. Every entry gets its name and inode block and every subdirectory a slot in dirs, the inodes are only read by loadEntry() when a file is opened. Since a directory is always loaded whole, a name the hash does not find in it does not exist, and looking it up again costs no I/O. Called with table_lock held exclusively. Returns 0, or ERROR_BADREAD with nothing loaded if the chain is broken. */
+static int loadDirectory(tfs_volume *vol, int d) {
+   char sb_buffer[BLOCKSIZE];
+   const char *block;
+   file_entry *file;
+   unsigned int word;
+   int bNum, count, pos, idx, num_blocks, walked = 0, start = vol->num_entries;
+
+   if (vol->dirs[d].loaded)
+      return 0;
+   if (cacheRead(vol->cache, 0, sb_buffer) < 0)
+      return ERROR_BADREAD;
+   num_blocks = getWord(sb_buffer, SB_TOTAL_BLOCKS);
+   if (d == 0) {
+      bNum = getWord(sb_buffer, SB_DIRECTORY);
+   }
+   else {
+      block = cachePeek(vol->cache, vol->dirs[d].inode);
+      if (block == NULL || block[0] != DIRNODE || block[1] != MAGIC)
+         return ERROR_BADREAD;
+      bNum = getWord(block, DIRNODE_FIRST);
+   }
+   // A chain longer than the disk must loop
+   while (bNum > 0 && bNum < num_blocks && walked++ < num_blocks) {
+      block = cachePeek(vol->cache, bNum);
+      if (block == NULL || block[0] != DIRECTORY || block[1] != MAGIC)
+         break;
+      count = getWord(block, DIR_COUNT);
+      if (count <= 0 || count > DIR_MAX_ENTRIES || vol->num_entries + count > MAX_FILES)
+         break;
+      dirListInsert(vol->dirs + d, vol->dirs[d].count, bNum, entryKey(block, 0));
+      for (pos = 0; pos < count; pos++) {
+         word = getWord(block, DIR_ENTRIES + pos * DIR_ENTRY_SIZE + DIR_ENTRY_INODE);
+         idx = newEntry(vol);
+         file = vol->file_table + idx;
+         memcpy(file->name, block + DIR_ENTRIES + pos * DIR_ENTRY_SIZE, 8);
+         file->name[8] = '\0';
+         file->inode_block = word & ~DIR_ENTRY_DIR;
+         file->parent = d;
+         if (word & DIR_ENTRY_DIR)
+            file->dir = newDir(vol, file->inode_block, d);
+      }
+      bNum = getWord(block, DIR_NEXT);
+   }
+   if (bNum != 0) {
+      for (idx = start; idx < vol->num_entries; idx++) {
+         if (vol->file_table[idx].dir >= 0)
+            vol->dirs[vol->file_table[idx].dir].inode = -1;
+      }
+      vol->num_entries = start;
+      vol->dirs[d].count = 0;
+      return ERROR_BADREAD;
+   }
+   for (idx = start; idx < vol->num_entries; idx++)
+      nameInsert(vol, idx);
+   vol->dirs[d].loaded = 1;
+   return 0;
+}
+
+/* Finds the directory that holds the last component of path and copies that component to leaf. Components are separated by '/' and a leading '/' is optional; every directory on the way is loaded, so walking a path reads each directory once per mount. Called with table_lock held exclusively. Returns 0, ERROR_BADFILE if a component is empty, longer than 8 characters, missing or not a directory, or ERROR_BADREAD. */
+static int resolvePath(tfs_volume *vol, const char *path, int *parent, char *leaf) {
+   const char *end;
+   char name[9];
+   int d = 0, idx, len;
+
+   if (*path == '/')
+      path++;
+   for (;;) {
+      end = strchr(path, '/');
+      len = end != NULL ? end - path : (int)strlen(path);
+      if (len == 0 || len > 8)
+         return ERROR_BADFILE;
+      memcpy(name, path, len);
+      name[len] = '\0';
+      // A trailing '/' ends the path too
+      if (end == NULL || end[1] == '\0') {
+         memcpy(leaf, name, len + 1);
+         *parent = d;
+         return 0;
+      }
+      if (loadDirectory(vol, d) < 0)
+         return ERROR_BADREAD;
+      idx = findName(vol, d, name);
+      if (idx < 0 || vol->file_table[idx].dir < 0)
+         return ERROR_BADFILE;
+      d = vol->file_table[idx].dir;
+      path = end + 1;
+   }
+}
+
+// file_table index of the entry path names, -1 if there is none. Loads
+// the directories on the way, so table_lock must be held exclusively
+static int findPath(tfs_volume *vol, const char *path) {
+   char leaf[9];
+   int d;
+
+   if (resolvePath(vol, path, &d, leaf) < 0 || loadDirectory(vol, d) < 0)
+      return -1;
+   return findName(vol, d, leaf);
+}
+
+// Point the head of directory d, or its block before 'index', at bNum. The
+// root's head is in the superblock, the others in their directory inode
+static void dirLink(tfs_volume *vol, int d, int index, int bNum) {
+   char block[BLOCKSIZE];
+   int head = vol->dirs[d].inode;
+
+   if (index == 0) {
+      cacheRead(vol->cache, head, block);
+      putWord(block, d == 0 ? SB_DIRECTORY : DIRNODE_FIRST, bNum);
+      cacheWrite(vol->cache, head, block);
+   }
+   else {
+      cacheRead(vol->cache, vol->dirs[d].blocks[index - 1], block);
+      putWord(block, DIR_NEXT, bNum);
+      cacheWrite(vol->cache, vol->dirs[d].blocks[index - 1], block);
+   }
+}
+
+/* Adds name with its inode word, the inode block plus DIR_ENTRY_DIR for a directory, to directory d. The entry goes into the one block its name sorts into, and a full block is split in two, so an insert writes at most two directory blocks and the head of the chain. The allocator must be loaded. Returns 0 or ERROR_NO_SPACE with nothing changed. */
+static int dirInsert(tfs_volume *vol, int d, const char *name, unsigned int word) {
+   char block[BLOCKSIZE];
+   char upper[BLOCKSIZE];
+   char *entry;
+   dir_node *dir = vol->dirs + d;
+   uint64_t key = dirKey(name);
+   int index, count, pos, half, bNum;
+
+   if (dir->count == 0) {
+      bNum = allocBlock(vol);
+      if (bNum < 0)
+         return ERROR_NO_SPACE;
+      memset(block, 0, BLOCKSIZE);
+      block[0] = DIRECTORY;
+      block[1] = MAGIC;
+      dirListInsert(dir, 0, bNum, key);
+      dirLink(vol, d, 0, bNum);
+      index = 0;
+      count = 0;
+   }
+   else {
+      index = dirSearch(dir, key);
+      cacheRead(vol->cache, dir->blocks[index], block);
+      count = getWord(block, DIR_COUNT);
+   }
+
+   if (count == DIR_MAX_ENTRIES) {
+      // Move the upper half into a new block right after this one
+      bNum = allocBlock(vol);
+      if (bNum < 0)
+         return ERROR_NO_SPACE;
+      half = count / 2;
+      memset(upper, 0, BLOCKSIZE);
+      upper[0] = DIRECTORY;
+      upper[1] = MAGIC;
+      putWord(upper, DIR_COUNT, count - half);
+      putWord(upper, DIR_NEXT, getWord(block, DIR_NEXT));
+      memcpy(upper + DIR_ENTRIES, block + DIR_ENTRIES + half * DIR_ENTRY_SIZE,
+       (count - half) * DIR_ENTRY_SIZE);
+      memset(block + DIR_ENTRIES + half * DIR_ENTRY_SIZE, 0,
+       (count - half) * DIR_ENTRY_SIZE);
+      putWord(block, DIR_COUNT, half);
+      putWord(block, DIR_NEXT, bNum);
+      dirListInsert(dir, index + 1, bNum, entryKey(upper, 0));
+      if (key >= dir->first[index + 1]) {
+         cacheWrite(vol->cache, dir->blocks[index], block);
+         memcpy(block, upper, BLOCKSIZE);
+         index++;
+      }
+      else {
+         cacheWrite(vol->cache, bNum, upper);
+      }
+      count = getWord(block, DIR_COUNT);
+   }
+
+   pos = entrySearch(block, count, key);
+   entry = block + DIR_ENTRIES + pos * DIR_ENTRY_SIZE;
+   memmove(entry + DIR_ENTRY_SIZE, entry, (count - pos) * DIR_ENTRY_SIZE);
+   memset(entry, 0, DIR_ENTRY_SIZE);
+   memcpy(entry, name, strlen(name));
+   putWord(entry, DIR_ENTRY_INODE, word);
+   putWord(block, DIR_COUNT, count + 1);
+   if (pos == 0)
+      dir->first[index] = key;
+   cacheWrite(vol->cache, dir->blocks[index], block);
+   return 0;
+}
+
+/* Takes name out of directory d. A block left empty is unlinked and freed, otherwise only the block holding the name is written. The allocator must be loaded. */
+static void dirRemove(tfs_volume *vol, int d, const char *name) {
+   char block[BLOCKSIZE];
+   char *entry;
+   dir_node *dir = vol->dirs + d;
+   uint64_t key = dirKey(name);
+   int index, count, pos;
+
+   if (dir->count == 0)
+      return;
+   index = dirSearch(dir, key);
+   cacheRead(vol->cache, dir->blocks[index], block);
+   count = getWord(block, DIR_COUNT);
+   pos = entrySearch(block, count, key);
+   if (pos == count || entryKey(block, pos) != key)
+      return;
+
+   if (count == 1) {
+      dirLink(vol, d, index, getWord(block, DIR_NEXT));
+      releaseBlocks(vol, dir->blocks[index], 1);
+      memmove(dir->blocks + index, dir->blocks + index + 1,
+       sizeof(int) * (dir->count - index - 1));
+      memmove(dir->first + index, dir->first + index + 1,
+       sizeof(uint64_t) * (dir->count - index - 1));
+      dir->count--;
+      return;
+   }
+   entry = block + DIR_ENTRIES + pos * DIR_ENTRY_SIZE;
+   memmove(entry, entry + DIR_ENTRY_SIZE, (count - pos - 1) * DIR_ENTRY_SIZE);
+   memset(block + DIR_ENTRIES + (count - 1) * DIR_ENTRY_SIZE, 0, DIR_ENTRY_SIZE);
+   putWord(block, DIR_COUNT, count - 1);
+   if (pos == 0 && index > 0)
+      dir->first[index] = entryKey(block, 0);
+   cacheWrite(vol->cache, dir->blocks[index], block);
+}
+
+// Retire file_table[idx] from the name hash and its descriptor, then move
+// the last entry into the hole
+static void dropEntry(tfs_volume *vol, int idx) {
+   file_entry *file = vol->file_table + idx;
+
+   nameRemove(vol, file->parent, file->name);
+   if (file->fd >= 0)
+      vol->fd_slots[file->fd & FD_LOCAL] = -1;
+   vol->num_entries--;
+   if (idx == vol->num_entries)
+      return;
+   memcpy(file, vol->file_table + vol->num_entries, sizeof(file_entry));
+   vol->name_slots[nameSlot(vol, file->parent, file->name)] = idx;
+   if (file->fd >= 0)
+      vol->fd_slots[file->fd & FD_LOCAL] = idx;
+}
+
+/* Opens a file for reading and writing on the currently mounted file system. Creates a dynamic resource table entry for the file, and returns a file descriptor (integer) that can be used to reference this file while the filesystem is mounted. The name may be a path, a new file goes into the directory the path names, which must exist. */
+static fileDescriptor openFile(tfs_volume *vol, char *name) {
+   char* buffer;
+   char leaf[9];
+   int existing = 0;
+   int inode, idx, d;
+   timestamp* filetime;
+
+   // Local FDs are never handed out twice in a mount
+   if (vol->next_fd > FD_LOCAL)
+      return ERROR_BADFILEOPEN;
+
+   if (resolvePath(vol, name, &d, leaf) < 0 || loadDirectory(vol, d) < 0)
+      return ERROR_BADFILEOPEN;
+   idx = findName(vol, d, leaf);
+   if (idx >= 0) {
+      existing = 1;
+      if (vol->file_table[idx].dir >= 0)
+         return ERROR_BADFILEOPEN;
+      if (vol->file_table[idx].open == 0) {
+         if (loadEntry(vol, idx) < 0)
+            return ERROR_BADFILEOPEN;
+         vol->file_table[idx].open = 1;
+         bindFD(vol, idx);
+      }
+      return vol->file_table[idx].fd;
+   }
+
+   if (existing == 0) {
+      // A new file needs an inode and a slot in the inode table, data
+      // blocks come with the first write
+      if (loadAllocator(vol) < 0)
+         return ERROR_BADREAD;
+      if (vol->total_files >= MAX_FILES || vol->free_blocks < 1)
+         return ERROR_NO_SPACE;
+      // Inode, two directory blocks, the head of the chain, their bitmap
+      // blocks and the superblock go in one transaction
+      cacheReserve(vol->cache, 7);
+      inode = allocBlock(vol);
+      if (inode < 0 && commitDeferred(vol))
+         inode = allocBlock(vol);
+      if (inode < 0)
+         return ERROR_NO_SPACE;
+      if (dirInsert(vol, d, leaf, inode) < 0) {
+         bitmapClear(vol->free_map, inode, 1);
+         vol->free_blocks = vol->free_map->num_free;
+         return ERROR_NO_SPACE;
+      }
+      ++vol->total_files;
+
+      idx = newEntry(vol);
+      vol->file_table[idx].open = 1;
+      vol->file_table[idx].inode_block = inode;
+      vol->file_table[idx].num_extents = 0;
+      vol->file_table[idx].extents =
+       (file_extent *)malloc(sizeof(file_extent) * INODE_MAX_EXTENTS);
+      vol->file_table[idx].file_offset = 0;
+      vol->file_table[idx].file_size = 0;
+      vol->file_table[idx].cursor_data = NULL;
+      vol->file_table[idx].parent = d;
+      vol->file_table[idx].loaded = 1;
+      newFileLock(vol->file_table + idx);
+      resetCursor(vol->file_table + idx);
+      memcpy(vol->file_table[idx].name, leaf, strlen(leaf) + 1);
+      nameInsert(vol, idx);
+      bindFD(vol, idx);
+      
+      buffer = (char *)calloc(BLOCKSIZE, 1);
+      filetime = (timestamp *)calloc(1, sizeof(timestamp));
+      buffer[0] = INODE;
+      buffer[1] = MAGIC;
+      putWord(buffer, INODE_NUM_EXTENTS, 0);
+      putWord(buffer, INODE_SIZE, 0);
+      memcpy(buffer + INODE_NAME, leaf, strlen(leaf) + 1);
+      
+      buffer[RW] = 0x03;
+
+
+      filetime->creation = time(NULL);
+      filetime->modification = filetime->creation;
+      filetime->access = filetime->creation;
+      memcpy(buffer + INODE_TIMES, filetime, sizeof(timestamp));
+      memcpy(&vol->file_table[idx].times, filetime, sizeof(timestamp));
+      vol->file_table[idx].times_dirty = 0;
+      cacheWrite(vol->cache, inode, buffer);
+      
+      cacheRead(vol->cache, 0, buffer);
+      putWord(buffer, SB_FREE_BLOCKS, vol->free_blocks);
+      putWord(buffer, SB_TOTAL_FILES, vol->total_files);
+      cacheWrite(vol->cache, 0, buffer);
+      storeBitmap(vol);
+      
+      free(buffer);
+      free(filetime);
+      return vol->file_table[idx].fd;
+   }
+
+   //check to see if file is existing
+   //if not existing, use freeblock to create inode, filextent for file
+   //add inode block # to superblock
+   //add file as a dynamic resource table entry that holds inode? and fd
+   return ERROR_BADFILEOPEN;
+}
+ 
+/* Closes the file, de-allocates all system/disk resources, and removes table entry */
+static int closeFile(file_entry *file) {
+   if (file->open == 1) {
+      file->open = 0;
+      accessFile(file);
+      flushTimes(file);
+      return 0;
+   }
+   return ERROR_BADFILECLOSE;
+}
+ 
+
+/* Gives the file numBlocks data blocks in as few extents as possible. A single run is tried first, and every failed request is halved, so a fragmented disk costs one extent per hole used. On failure nothing stays allocated and ERROR_NO_SPACE is returned. */
+static int allocExtents(tfs_volume *vol, file_entry *file, int numBlocks) {
+   int start, want = numBlocks;
+
+   file->num_extents = 0;
+   while (numBlocks > 0) {
+      if (file->num_extents == INODE_MAX_EXTENTS || want == 0)
+         break;
+      start = allocRun(vol, want);
+      if (start < 0) {
+         want /= 2;
+         continue;
+      }
+      file->extents[file->num_extents].start = start;
+      file->extents[file->num_extents++].length = want;
+      numBlocks -= want;
+      want = numBlocks;
+   }
+   if (numBlocks == 0)
+      return 0;
+
+   while (file->num_extents > 0) {
+      --file->num_extents;
+      bitmapClear(vol->free_map, file->extents[file->num_extents].start,
+       file->extents[file->num_extents].length);
+   }
+   vol->free_blocks = vol->free_map->num_free;
+   return ERROR_NO_SPACE;
+}
+
+/* Gives the file 'blocks' more data blocks. The last extent is first stretched over the free blocks right behind it, so a file that keeps growing stays in one extent as long as nothing else was allocated behind it, and only the rest goes into new extents, laid out like allocExtents() does, that take up to PREALLOC_MAX blocks past what was asked for. Only the extent list and the bitmap change, the caller stores the inode. Returns 0, or ERROR_NO_SPACE with nothing allocated. */
+static int growExtents(tfs_volume *vol, file_entry *file, int blocks) {
+   file_extent *tail = NULL;
+   int extents = file->num_extents, length = 0, grown = 0, have = 0, start, want;
+
+   checkCommitted(vol);
+   if (extents > 0) {
+      tail = file->extents + extents - 1;
+      length = tail->length;
+      grown = bitmapExtend(vol->free_map, tail->start + tail->length, blocks);
+      tail->length += grown;
+   }
+   // A new extent is as long as the file already is, up to PREALLOC_MAX, so
+   // files appended to in turn do not use up their extents one block at a time
+   for (start = 0; start < extents; start++)
+      have += file->extents[start].length;
+   want = have < PREALLOC_MAX ? have : PREALLOC_MAX;
+   for (want = want > blocks - grown ? want : blocks - grown; grown < blocks; ) {
+      if (file->num_extents == INODE_MAX_EXTENTS || want == 0)
+         break;
+      start = allocRun(vol, want);
+      if (start < 0) {
+         want /= 2;
+         continue;
+      }
+      file->extents[file->num_extents].start = start;
+      file->extents[file->num_extents++].length = want;
+      grown += want;
+      want = blocks - grown;
+   }
+
+   if (grown < blocks) {
+      while (file->num_extents > extents) {
+         --file->num_extents;
+         bitmapClear(vol->free_map, file->extents[file->num_extents].start,
+          file->extents[file->num_extents].length);
+      }
+      if (tail != NULL) {
+         bitmapClear(vol->free_map, tail->start + length, tail->length - length);
+         tail->length = length;
+      }
+   }
+   vol->free_blocks = vol->free_map->num_free;
+   return grown < blocks ? ERROR_NO_SPACE : 0;
+}
+
+/* Writes n bytes from buf at the file pointer, or at the end of the file if 'append' is set, and leaves the pointer right after them. Writing past the end grows the file with growExtents(), which only allocates the blocks the new bytes need, and only blocks that are partly overwritten are read first, so the cost of a write depends on n and not on the size of the file. Data goes to the cache like writeByte() writes it, and if the file grew its inode and bitmap blocks go into one transaction. Returns the number of bytes written, or an error code with nothing written. */
+static int writeAt(file_entry *file, char *buf, int n, int append) {
+   tfs_volume *vol = file->volume;
+   char inode[BLOCKSIZE];
+   char block[BLOCKSIZE];
+   int offset, have = 0, need, index, skip, ext, base, bNum, chunk, done = 0;
+
+   if (n < 0 || buf == NULL)
+      return ERROR_BADWRITE;
+   if (!file->open)
+      return FILE_NOT_OPEN;
+   if (cacheRead(vol->cache, file->inode_block, inode) < 0)
+      return ERROR_BADREAD;
+   if (inode[RW] != 0x03)
+      return NO_WRITE_ACCESS;
+
+   offset = append ? file->file_size : file->file_offset;
+   if (n > MAX_BLOCKS - offset)
+      return ERROR_BADWRITE;
+   for (ext = 0; ext < file->num_extents; ext++)
+      have += file->extents[ext].length;
+   need = (offset + n + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+   if (need > have) {
+      if (loadAllocator(vol) < 0)
+         return ERROR_BADREAD;
+      // The inode and the bitmap blocks of the new blocks
+      cacheReserve(vol->cache, 2 + (need - have) / BITMAP_BITS);
+      if (growExtents(vol, file, need - have) < 0 &&
+       (!commitDeferred(vol) || growExtents(vol, file, need - have) < 0))
+         return ERROR_NO_SPACE;
+   }
+
+   // Find the extent holding the first byte, then walk forward
+   index = offset / EXTENT_PAYLOAD;
+   skip = offset % EXTENT_PAYLOAD;
+   for (ext = 0, base = 0; ext < file->num_extents &&
+    index >= base + file->extents[ext].length; ext++)
+      base += file->extents[ext].length;
+   while (done < n && ext < file->num_extents) {
+      bNum = file->extents[ext].start + index - base;
+      chunk = EXTENT_PAYLOAD - skip < n - done ? EXTENT_PAYLOAD - skip : n - done;
+      // Bytes of the block that stay have to be read, a new block is blank
+      if (chunk < EXTENT_PAYLOAD && index * EXTENT_PAYLOAD < file->file_size) {
+         if (cacheRead(vol->cache, bNum, block) < 0)
+            break;
+      }
+      else {
+         memset(block, 0, BLOCKSIZE);
+         block[0] = FILE_EXTENT;
+         block[1] = MAGIC;
+      }
+      memcpy(block + EXTENT_DATA + skip, buf + done, chunk);
+      cacheWriteData(vol->cache, bNum, block);
+      // Keep the pinned cursor copy in step
+      if (bNum == file->cursor_block)
+         memcpy(file->cursor_data, block, BLOCKSIZE);
+      done += chunk;
+      skip = 0;
+      if (++index - base == file->extents[ext].length) {
+         base += file->extents[ext].length;
+         ext++;
+      }
+   }
+
+   if (offset + done > file->file_size || need > have) {
+      file->file_size = offset + done > file->file_size ?
+       offset + done : file->file_size;
+      storeExtents(file, inode);
+      putWord(inode, INODE_SIZE, file->file_size);
+      cacheWrite(vol->cache, file->inode_block, inode);
+      storeBitmap(vol);
+   }
+   file->file_offset = offset + done;
+   if (done == 0 && n > 0)
+      return ERROR_BADWRITE;
+   modifyFile(file);
+   return done;
+}
+
+/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire file’s content, to the file system. Sets the file pointer to 0 (the start of file) when done. Returns success/error codes. The old extents are released first and the file is laid out again by allocExtents(), so a rewrite can land on the same blocks or move to a longer run. Consecutive blocks leave the cache with a single writeBlockv(). With a journal the old blocks are deferred like any other free, so a crash leaves either the old or the new contents. If the new layout does not fit, the deferred blocks are committed and the allocation is tried again, and as a last resort the file may take its own old blocks back, which a crash can leave holding a mix of old and new data. */
+static int writeFile(file_entry *file, char *buffer, int size) {
+   tfs_volume *vol = file->volume;
+   char inode[BLOCKSIZE];
+   char block[BLOCKSIZE];
+   file_extent *old;
+   int numBlocks, oldExtents, chunk, i, ext, written = 0, span, reuse;
+
+   if (size < 0)
+      return ERROR_BADWRITE;
+
+   if(!file->open) {
+      return FILE_NOT_OPEN;
+   }
+   reuse = vol->log == NULL;
+   // Find the inode block corresponding to the inode number
+   cacheRead(vol->cache, file->inode_block, inode);
+
+   if (inode[RW] != 0x03) {
+      return NO_WRITE_ACCESS;
+   }
+   if (loadAllocator(vol) < 0)
+      return ERROR_BADREAD;
+
+   numBlocks = (size + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+
+   // Keep a copy of the old layout to put back if the new one does not
+   // fit, taken before anything in the bitmap changes
+   oldExtents = file->num_extents;
+   old = (file_extent *)malloc(sizeof(file_extent) * (oldExtents + 1));
+   if (old == NULL)
+      return ERROR_BADWRITE;
+   memcpy(old, file->extents, sizeof(file_extent) * oldExtents);
+
+   // The inode and every bitmap block the old and new layout touch go in
+   // one transaction, a new layout rarely spans more than one extra block
+   span = 2 + numBlocks / BITMAP_BITS;
+   for (ext = 0; ext < oldExtents; ext++)
+      span += mapSpan(file->extents[ext].start, file->extents[ext].length);
+   cacheReserve(vol->cache, span);
+
+   // Release the old layout
+   for (;;) {
+      for (ext = 0; ext < oldExtents; ext++) {
+         bitmapClear(vol->free_map, old[ext].start, old[ext].length);
+         if (!reuse)
+            deferBlocks(vol, old[ext].start, old[ext].length);
+      }
+      vol->free_blocks = vol->free_map->num_free;
+
+      if (numBlocks <= vol->free_blocks && allocExtents(vol, file, numBlocks) == 0)
+         break;
+      for (ext = 0; ext < oldExtents; ext++)
+         bitmapSet(vol->free_map, old[ext].start, old[ext].length);
+      vol->free_blocks = vol->free_map->num_free;
+      memcpy(file->extents, old, sizeof(file_extent) * oldExtents);
+      file->num_extents = oldExtents;
+      if (commitDeferred(vol))
+         continue;
+      if (reuse || oldExtents == 0) {
+         free(old);
+         return ERROR_NO_SPACE;
+      }
+      reuse = 1;
+   }
+   // Old blocks the new layout took back stay in use, the rest wait for
+   // the commit
+   for (ext = 0; ext < oldExtents && vol->log != NULL; ext++)
+      deferBlocks(vol, old[ext].start, old[ext].length);
+   free(old);
+
+   // Lay the buffer out EXTENT_PAYLOAD bytes per data block
+   for (ext = 0; ext < file->num_extents; ext++) {
+      for (i = 0; i < file->extents[ext].length; i++) {
+         memset(block, 0, BLOCKSIZE);
+         block[0] = FILE_EXTENT;
+         block[1] = MAGIC;
+         chunk = size - written < EXTENT_PAYLOAD ? size - written : EXTENT_PAYLOAD;
+         memcpy(block + EXTENT_DATA, buffer + written, chunk);
+         written += chunk;
+         cacheWriteData(vol->cache, file->extents[ext].start + i, block);
+      }
+   }
+
+   storeExtents(file, inode);
+   putWord(inode, INODE_SIZE, size);
+   cacheWrite(vol->cache, file->inode_block, inode);
+   storeBitmap(vol);
+   //modification time
+   modifyFile(file);
+   file->file_offset = 0;
+   file->file_size = size;
+   // The blocks may have moved
+   resetCursor(file);
+   
+   return WRITE_SUCCESS;
+} 
+
+/* deletes a file and marks its blocks as free on disk. */
+static int deleteFile(file_entry *file) {
+   tfs_volume *vol = file->volume;
+   int idx = file - vol->file_table, ext, current_block, span;
+   char readBuffer[BLOCKSIZE];
+
+   // Check if the file open for operation
+   if(!vol->file_table[idx].open) {
+      return FILE_NOT_OPEN;
+   }
+   
+   cacheRead(vol->cache, vol->file_table[idx].inode_block, readBuffer);
+   // Check the RW access for the file, return if READ_ONLY
+   if (readBuffer[RW] != 0x03) {
+      return NO_WRITE_ACCESS;
+   }
+   if (loadAllocator(vol) < 0)
+      return ERROR_BADREAD;
+   
+   // Superblock, directory and bitmap changes go in one transaction, an
+   // emptied directory block also writes the one before it or the head of
+   // the chain and its bitmap
+   current_block = vol->file_table[idx].inode_block;
+   span = 5 + mapSpan(current_block, 1);
+   for (ext = 0; ext < vol->file_table[idx].num_extents; ext++) {
+      span += mapSpan(vol->file_table[idx].extents[ext].start,
+       vol->file_table[idx].extents[ext].length);
+   }
+   cacheReserve(vol->cache, span);
+
+   // Give every extent back to the bitmap
+   for (ext = 0; ext < vol->file_table[idx].num_extents; ext++) {
+      releaseBlocks(vol, vol->file_table[idx].extents[ext].start,
+       vol->file_table[idx].extents[ext].length);
+   }
+   free(vol->file_table[idx].extents);
+   free(vol->file_table[idx].cursor_data);
+   freeFileLock(vol->file_table + idx);
+   
+   releaseBlocks(vol, current_block, 1);
+
+   // The directory may write the superblock, so it goes first
+   dirRemove(vol, vol->file_table[idx].parent, vol->file_table[idx].name);
+   cacheRead(vol->cache, 0, readBuffer);
+   --vol->total_files;
+   putWord(readBuffer, SB_TOTAL_FILES, vol->total_files);
+   putWord(readBuffer, SB_FREE_BLOCKS, vol->free_blocks);
+   cacheWrite(vol->cache, 0, readBuffer);
+   storeBitmap(vol);
+  
+   //remove file from table
+   dropEntry(vol, idx);
+   return DELETE_SUCCESS;
+}
+ 
+/* reads one byte from the file and copies it to buffer, using the current file pointer location and incrementing it by one upon success. If the file pointer is already at the end of the file then tfs_readByte() should return an error and not increment the file pointer. The byte comes from the pinned cursor block, so only crossing into the next block reads anything, and reading front to back has readAhead() fetch the blocks ahead in batches. */
+static int readByte(file_entry *file, char *buffer) {
+   int success;
+   if (file->open == 0) {
+      return FILE_NOT_OPEN;
+   }
+
+   if (file->file_offset < file->file_size) {
+      readAhead(file, file->file_offset / EXTENT_PAYLOAD,
+       file->file_offset / EXTENT_PAYLOAD);
+      if (seekCursor(file, file->file_offset / EXTENT_PAYLOAD) < 0)
+         return ERROR_BADREAD;
+      *buffer = file->cursor_data[EXTENT_DATA +
+       file->file_offset++ % EXTENT_PAYLOAD];
+      touchFile(file, 0);
+      success = 0;
+   }
+   else {
+      success =  END_OF_FILE;
+   }
+   return success;
+}
+
+//a run of up to READ_BATCH blocks tfs_read has in flight
+typedef struct read_slot {
+   char *data;
+   int count; //blocks in the run
+   int pending; //requests of the run that have not completed
+   int failed;
+} read_slot;
+
+static pthread_key_t read_queue_key;
+static pthread_once_t read_queue_once = PTHREAD_ONCE_INIT;
+
+static void freeReadQueue(void *queue) {
+   diskQueueDestroy((disk_queue *)queue);
+}
+
+static void makeReadQueueKey(void) {
+   pthread_key_create(&read_queue_key, freeReadQueue);
+}
+
+// The disk queue of the calling thread, made by its first tfs_read() and
+// freed when the thread exits. Reads are synchronous if it cannot be made
+static disk_queue* readQueue(void) {
+   disk_queue *queue;
+
+   pthread_once(&read_queue_once, makeReadQueueKey);
+   queue = (disk_queue *)pthread_getspecific(read_queue_key);
+   if (queue == NULL) {
+      queue = diskQueueCreate(READ_DEPTH);
+      pthread_setspecific(read_queue_key, queue);
+   }
+   return queue;
+}
+
+// Wait until every request of slot has completed. Returns -1 if the queue
+// cannot say
+static int awaitSlot(disk_queue *queue, read_slot *slot) {
+   disk_completion done[READ_DEPTH];
+   read_slot *owner;
+   int got, idx;
+
+   while (slot->pending > 0) {
+      got = diskQueueWait(queue, 1, done, READ_DEPTH);
+      if (got <= 0)
+         return -1;
+      for (idx = 0; idx < got; idx++) {
+         owner = (read_slot *)done[idx].token;
+         owner->pending--;
+         if (done[idx].result < 0)
+            owner->failed = 1;
+      }
+   }
+   return 0;
+}
+
+/* Reads up to n bytes from the current file pointer into buf and moves the pointer past them. The extent list is walked once and cut into runs of up to READ_BATCH blocks, and up to READ_DEPTH runs are submitted with cacheSubmitRun() ahead of the one whose payloads are being copied out, so the disk keeps many requests in flight. The access time is updated once per call. Readers only share the file lock, so the range is claimed by moving the file pointer with a compare and swap before anything is read, and reads on the same FD never get the same bytes. Returns the number of bytes read, or END_OF_FILE if the file pointer is already at the end of the file. */
+static int readFile(file_entry *file, char *buf, int n) {
+   read_slot slots[READ_DEPTH];
+   disk_queue *queue;
+   read_slot *slot;
+   char *batches;
+   int filesize, index, skip, ext, count, blk, chunk, code = 0;
+   int done = 0, offset, claimed, total, fetched = 0, depth, head = 0, used = 0;
+
+   if (n < 0 || buf == NULL)
+      return ERROR_BADREAD;
+   if (!file->open)
+      return FILE_NOT_OPEN;
+
+   // The buffers are sized by the request, which bounds the blocks it can
+   // touch, and taken before the file pointer is, so running out of
+   // memory leaves the pointer where it was
+   depth = (n / EXTENT_PAYLOAD + 2 + READ_BATCH - 1) / READ_BATCH;
+   depth = depth < READ_DEPTH ? depth : READ_DEPTH;
+   batches = (char *)malloc((size_t)depth * READ_BATCH * BLOCKSIZE);
+   if (batches == NULL)
+      return ERROR_BADREAD;
+
+   filesize = file->file_size;
+   offset = __atomic_load_n(&file->file_offset, __ATOMIC_RELAXED);
+   do {
+      if (offset >= filesize) {
+         free(batches);
+         return n == 0 ? 0 : END_OF_FILE;
+      }
+      claimed = n < filesize - offset ? n : filesize - offset;
+   } while (!__atomic_compare_exchange_n(&file->file_offset, &offset,
+    offset + claimed, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   n = claimed;
+
+   // Find the extent and block holding the file pointer
+   index = offset / EXTENT_PAYLOAD;
+   skip = offset % EXTENT_PAYLOAD;
+   for (ext = 0; ext < file->num_extents && index >= file->extents[ext].length; ext++)
+      index -= file->extents[ext].length;
+
+   // Only fetch the blocks the request touches
+   total = (skip + n + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+   readAhead(file, offset / EXTENT_PAYLOAD, offset / EXTENT_PAYLOAD + total - 1);
+   if ((total + READ_BATCH - 1) / READ_BATCH < depth)
+      depth = (total + READ_BATCH - 1) / READ_BATCH;
+   queue = readQueue();
+   for (blk = 0; blk < depth; blk++)
+      slots[blk].data = batches + (size_t)blk * READ_BATCH * BLOCKSIZE;
+
+   while (done < n) {
+      // Keep the slots behind the one being copied out in flight
+      while (used < depth && fetched < total && ext < file->num_extents &&
+       code == 0) {
+         slot = slots + (head + used) % depth;
+         count = file->extents[ext].length - index;
+         count = count < total - fetched ? count : total - fetched;
+         slot->count = count < READ_BATCH ? count : READ_BATCH;
+         slot->failed = 0;
+         slot->pending = cacheSubmitRun(file->volume->cache, queue,
+          file->extents[ext].start + index, slot->count, slot->data, slot);
+         if (slot->pending < 0) {
+            code = slot->pending;
+            slot->pending = 0;
+            slot->failed = 1;
+         }
+         used++;
+         fetched += slot->count;
+         index += slot->count;
+         if (index == file->extents[ext].length) {
+            ext++;
+            index = 0;
+         }
+      }
+      if (used == 0)
+         break;
+
+      slot = slots + head;
+      if (awaitSlot(queue, slot) < 0 || slot->failed) {
+         code = ERROR_BADREAD;
+         break;
+      }
+      for (blk = 0; blk < slot->count; blk++) {
+         chunk = EXTENT_PAYLOAD - skip < n - done ? EXTENT_PAYLOAD - skip : n - done;
+         memcpy(buf + done, slot->data + blk * BLOCKSIZE + EXTENT_DATA + skip, chunk);
+         done += chunk;
+         skip = 0;
+      }
+      head = (head + 1) % depth;
+      used--;
+   }
+   // After a failure later runs may still be in flight, into batches
+   for (; used > 0; used--) {
+      awaitSlot(queue, slots + head);
+      head = (head + 1) % depth;
+   }
+   free(batches);
+
+   // Hand back what could not be read, unless another read moved on since
+   claimed = offset + n;
+   if (done < n)
+      __atomic_compare_exchange_n(&file->file_offset, &claimed, offset + done,
+       0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+   if (done == 0 && code < 0)
+      return ERROR_BADREAD;
+   touchFile(file, 0);
+   return done;
+}
+
+/* Overwrites the byte at the file pointer and moves it forward by one. The pinned cursor block is changed in place and handed to the cache as a whole, so no block is read while the pointer stays inside it. */
+static int writeByte(file_entry *file, unsigned char data) {
+   int success;
+   char inode[BLOCKSIZE];
+   if(!file->open) {
+      return FILE_NOT_OPEN;
+   }   
+   if (cacheRead(file->volume->cache, file->inode_block, inode) < 0)
+      return ERROR_BADREAD;
+   if (inode[RW] != 0x03) {
+      return NO_WRITE_ACCESS;
+   }
+   if (file->file_offset < file->file_size) {
+      if (seekCursor(file, file->file_offset / EXTENT_PAYLOAD) < 0)
+         return ERROR_BADREAD;
+      file->cursor_data[EXTENT_DATA +
+       file->file_offset++ % EXTENT_PAYLOAD] = data;
+      cacheWriteData(file->volume->cache, file->cursor_block, file->cursor_data);
+      touchFile(file, 1);
+      success = 0;
+   }
+   else {
+      success =  END_OF_FILE;
+   }
+   return success;
+}
+
+// Rename the file or directory oldName to newName. Both may be paths, so
+// an entry can move to another directory, but not a directory into itself
+static int renameFile(tfs_volume *vol, char *newName, char *oldName) {
+   int idx, d, up;
+   char leaf[9];
+   char buffer[BLOCKSIZE];
+   file_entry *file;
+
+   // Check if the oldName is root directory or not. If so, cannot change
+   if (strcmp("/", oldName) == 0)
+      return ERROR_RENAME_FAILURE;
+
+   if (vol == NULL)
+      return ERROR_BADREAD; 
+
+   // Find the file in the system with oldName
+   idx = findPath(vol, oldName);
+   if(idx < 0)
+      return ERROR_BADFILE;
+   // The new name goes in a directory that exists, and names have to stay
+   // unique in it for the name hash
+   if (resolvePath(vol, newName, &d, leaf) < 0 || loadDirectory(vol, d) < 0)
+      return ERROR_RENAME_FAILURE;
+   file = vol->file_table + idx;
+   if (findName(vol, d, leaf) >= 0 && findName(vol, d, leaf) != idx)
+      return ERROR_RENAME_FAILURE;
+   if (file->dir >= 0) {
+      for (up = d; up != 0 && up != file->dir; up = vol->dirs[up].parent)
+         ;
+      if (up == file->dir)
+         return ERROR_RENAME_FAILURE;
+   }
+   // Return FILE_NOT_OPEN if file is not open for write
+   else if(!file->open) {
+      return FILE_NOT_OPEN;
+   }   
+
+   // Read the inodeBlock to buffer
+   cacheRead(vol->cache, file->inode_block, buffer);
+   // If READ Only, returns NO_WRITE_ACCESS
+   // FileName will not modify
+   if (file->dir < 0 && buffer[RW] != 0x03) {
+      return NO_WRITE_ACCESS;
+   }
+   // The new entry goes in before the old one comes out, so running out of
+   // space for a directory block changes nothing. Each side may write two
+   // directory blocks, the head of its chain and bitmap blocks
+   if (loadAllocator(vol) < 0)
+      return ERROR_BADREAD;
+   cacheReserve(vol->cache, 10);
+   if (d != file->parent || strcmp(leaf, file->name) != 0) {
+      if (dirInsert(vol, d, leaf, file->inode_block |
+       (file->dir >= 0 ? DIR_ENTRY_DIR : 0)) < 0)
+         return ERROR_NO_SPACE;
+      dirRemove(vol, file->parent, file->name);
+      storeBitmap(vol);
+   }
+   // Change the oldname in file_table to newName
+   nameRemove(vol, file->parent, file->name);
+   strcpy(file->name, leaf);
+   file->parent = d;
+   namePlace(vol, idx);
+   if (file->dir >= 0)
+      vol->dirs[file->dir].parent = d;
+ 
+   // Push the changes in buffer back to inode block.  
+   memset(buffer + INODE_NAME, 0, 9);
+   memcpy(buffer + INODE_NAME, leaf, strlen(leaf) + 1);
+   cacheWrite(vol->cache, file->inode_block, buffer);
+   // Since we change the filename, modification and access time will be
+   // updated
+   if (file->dir < 0)
+      modifyFile(file);
+     
+   return RENAME_SUCCESS;
+}
+
+/* Creates the directory path names inside a directory that exists. The new directory gets an inode of its own, which holds the head of its chain of directory blocks once the first entry goes in. Returns MKDIR_SUCCESS, ERROR_EXISTS if the name is taken, ERROR_BADFILE if the path does not lead to a directory, ERROR_NO_SPACE or ERROR_BADREAD. */
+static int makeDir(tfs_volume *vol, char *path) {
+   char buffer[BLOCKSIZE];
+   char leaf[9];
+   timestamp times;
+   int inode, idx, d;
+
+   if (resolvePath(vol, path, &d, leaf) < 0 || loadDirectory(vol, d) < 0)
+      return ERROR_BADFILE;
+   if (findName(vol, d, leaf) >= 0)
+      return ERROR_EXISTS;
+   if (loadAllocator(vol) < 0)
+      return ERROR_BADREAD;
+   if (vol->total_files >= MAX_FILES || vol->free_blocks < 1)
+      return ERROR_NO_SPACE;
+   // The same transaction as creating a file, see openFile()
+   cacheReserve(vol->cache, 7);
+   inode = allocBlock(vol);
+   if (inode < 0 && commitDeferred(vol))
+      inode = allocBlock(vol);
+   if (inode < 0)
+      return ERROR_NO_SPACE;
+   if (dirInsert(vol, d, leaf, inode | DIR_ENTRY_DIR) < 0) {
+      bitmapClear(vol->free_map, inode, 1);
+      vol->free_blocks = vol->free_map->num_free;
+      return ERROR_NO_SPACE;
+   }
+   ++vol->total_files;
+
+   memset(buffer, 0, BLOCKSIZE);
+   buffer[0] = DIRNODE;
+   buffer[1] = MAGIC;
+   memcpy(buffer + INODE_NAME, leaf, strlen(leaf) + 1);
+   times.creation = time(NULL);
+   times.modification = times.creation;
+   times.access = times.creation;
+   memcpy(buffer + INODE_TIMES, &times, sizeof(timestamp));
+   cacheWrite(vol->cache, inode, buffer);
+
+   cacheRead(vol->cache, 0, buffer);
+   putWord(buffer, SB_FREE_BLOCKS, vol->free_blocks);
+   putWord(buffer, SB_TOTAL_FILES, vol->total_files);
+   cacheWrite(vol->cache, 0, buffer);
+   storeBitmap(vol);
+
+   // An empty directory is loaded as it is
+   idx = newEntry(vol);
+   vol->file_table[idx].inode_block = inode;
+   vol->file_table[idx].parent = d;
+   vol->file_table[idx].times = times;
+   memcpy(vol->file_table[idx].name, leaf, strlen(leaf) + 1);
+   vol->file_table[idx].dir = newDir(vol, inode, d);
+   vol->dirs[vol->file_table[idx].dir].loaded = 1;
+   nameInsert(vol, idx);
+   return MKDIR_SUCCESS;
+}
+
+/* Removes the directory path names, which must be empty. Returns RMDIR_SUCCESS, ERROR_NOT_EMPTY, ERROR_BADFILE if path does not name a directory, or ERROR_BADREAD. */
+static int removeDir(tfs_volume *vol, char *path) {
+   char buffer[BLOCKSIZE];
+   dir_node *dir;
+   int idx, d, inode;
+
+   idx = findPath(vol, path);
+   if (idx < 0 || vol->file_table[idx].dir < 0)
+      return ERROR_BADFILE;
+   d = vol->file_table[idx].dir;
+   if (loadDirectory(vol, d) < 0 || loadAllocator(vol) < 0)
+      return ERROR_BADREAD;
+   if (vol->dirs[d].count > 0)
+      return ERROR_NOT_EMPTY;
+
+   // The same transaction as deleting an empty file, see deleteFile()
+   inode = vol->file_table[idx].inode_block;
+   cacheReserve(vol->cache, 5 + mapSpan(inode, 1));
+   releaseBlocks(vol, inode, 1);
+   // The directory may write the superblock, so it goes first
+   dirRemove(vol, vol->file_table[idx].parent, vol->file_table[idx].name);
+   cacheRead(vol->cache, 0, buffer);
+   --vol->total_files;
+   putWord(buffer, SB_TOTAL_FILES, vol->total_files);
+   putWord(buffer, SB_FREE_BLOCKS, vol->free_blocks);
+   cacheWrite(vol->cache, 0, buffer);
+   storeBitmap(vol);
+
+   // Its slot in dirs stays retired, see newDir()
+   dir = vol->dirs + d;
+   free(dir->blocks);
+   free(dir->first);
+   dir->blocks = NULL;
+   dir->first = NULL;
+   dir->capacity = 0;
+   dir->inode = -1;
+   dropEntry(vol, idx);
+   return RMDIR_SUCCESS;
+}
+
+// Print the entries of directory d in name order straight from its
+// directory blocks, each under its full path, a directory followed by
+// what it holds
+static int listDirectory(tfs_volume *vol, int d, const char *prefix) {
+   char block[BLOCKSIZE];
+   char *path;
+   int index, pos, idx, code = 0;
+
+   if (loadDirectory(vol, d) < 0)
+      return ERROR_BADREAD;
+   path = (char *)malloc(strlen(prefix) + 10);
+   // The block is copied, listing a subdirectory reads other blocks
+   for (index = 0; code == 0 && index < vol->dirs[d].count; index++) {
+      if (cacheRead(vol->cache, vol->dirs[d].blocks[index], block) < 0)
+         code = ERROR_BADREAD;
+      for (pos = 0; code == 0 && pos < (int)getWord(block, DIR_COUNT); pos++) {
+         sprintf(path, "%s%.8s", prefix, block + DIR_ENTRIES + pos * DIR_ENTRY_SIZE);
+         if (!(getWord(block, DIR_ENTRIES + pos * DIR_ENTRY_SIZE + DIR_ENTRY_INODE) &
+          DIR_ENTRY_DIR)) {
+            printf("%s\n", path);
+            continue;
+         }
+         printf("%s/\n", path);
+         idx = findName(vol, d, path + strlen(prefix));
+         strcat(path, "/");
+         if (idx >= 0)
+            code = listDirectory(vol, vol->file_table[idx].dir, path);
+      }
+   }
+   free(path);
+   return code;
+}
+
+// Print out a list of directories and files of the file system, in name
+// order straight from the directory blocks
+static int listFiles(tfs_volume *vol) {
+   int code = 0;
+
+   printf("********** List of Files and Directories **********\n");
+   if (vol != NULL)
+      code = listDirectory(vol, 0, "");
+   
+   printf("**********            Done               **********\n");
+   // Return success when finished
+   return code < 0 ? code : READDIR_SUCCESS;
+}
+ 
+static int compareBlocks(const void *a, const void *b) {
+   return *(const int *)a - *(const int *)b;
+}
+
+// Load the inodes of a batch of directory entries into the cache with as
+// few reads as possible: sorted and cut into runs, each read through gaps
+// of up to READDIR_GAP blocks
+static void prefetchInodes(tfs_volume *vol, int *blocks, int count) {
+   int first, last;
+
+   qsort(blocks, count, sizeof(int), compareBlocks);
+   for (first = 0; first < count; first = last) {
+      for (last = first + 1; last < count &&
+       blocks[last] - blocks[last - 1] <= READDIR_GAP + 1; last++)
+         ;
+      cachePrefetch(vol->cache, blocks[first], blocks[last - 1] - blocks[first] + 1);
+   }
+}
+
+/* Fills up to max entries of a listing from where dir left off, in name order. Entries come one directory block at a time: the inodes of all the entries taken from a block are prefetched together before any is looked at, and files already in memory use their own size and timestamps, which may be newer than their inode. Called with table_lock held exclusively and meta_lock. Returns the number of entries filled, 0 once the listing is done, ERROR_BADFILE once the directory listed is removed, or ERROR_BADREAD. */
+static int readEntries(tfs_dir *dir, tfs_dirent *entries, int max) {
+   tfs_volume *vol = dir->volume;
+   char block[BLOCKSIZE];
+   int inodes[DIR_MAX_ENTRIES];
+   const char *inode;
+   tfs_dirent *entry;
+   file_entry *file;
+   dir_node *node;
+   uint64_t key;
+   unsigned int word;
+   int index, count, pos, take, idx, found, filled = 0;
+
+   if (dir->node < 0 || dir->node >= vol->num_dirs ||
+    vol->dirs[dir->node].inode != dir->node_inode)
+      return ERROR_BADFILE;
+   if (loadDirectory(vol, dir->node) < 0)
+      return ERROR_BADREAD;
+   node = vol->dirs + dir->node;
+   while (filled < max && !dir->done) {
+      if (node->count == 0) {
+         dir->done = 1;
+         break;
+      }
+      // The block is copied, prefetching the inodes may push it out
+      index = dirSearch(node, dir->next);
+      if (cacheRead(vol->cache, node->blocks[index], block) < 0)
+         return ERROR_BADREAD;
+      count = getWord(block, DIR_COUNT);
+      pos = entrySearch(block, count, dir->next);
+      if (pos == count) {
+         if (index + 1 < node->count)
+            dir->next = node->first[index + 1];
+         else
+            dir->done = 1;
+         continue;
+      }
+
+      take = count - pos < max - filled ? count - pos : max - filled;
+      for (idx = 0; idx < take; idx++)
+         inodes[idx] = getWord(block, DIR_ENTRIES + (pos + idx) * DIR_ENTRY_SIZE +
+          DIR_ENTRY_INODE) & ~DIR_ENTRY_DIR;
+      prefetchInodes(vol, inodes, take);
+
+      for (idx = pos; idx < pos + take; idx++) {
+         entry = entries + filled++;
+         memcpy(entry->name, block + DIR_ENTRIES + idx * DIR_ENTRY_SIZE, 8);
+         entry->name[8] = '\0';
+         word = getWord(block, DIR_ENTRIES + idx * DIR_ENTRY_SIZE + DIR_ENTRY_INODE);
+         entry->inode = word & ~DIR_ENTRY_DIR;
+         entry->is_dir = (word & DIR_ENTRY_DIR) != 0;
+         inode = cachePeek(vol->cache, entry->inode);
+         if (inode == NULL || inode[0] != (entry->is_dir ? DIRNODE : INODE))
+            return ERROR_BADREAD;
+         entry->size = entry->is_dir ? 0 : (int)getWord(inode, INODE_SIZE);
+         entry->read_only = !entry->is_dir && inode[RW] != 0x03;
+         memcpy(&entry->times, inode + INODE_TIMES, sizeof(timestamp));
+         found = findName(vol, dir->node, entry->name);
+         file = found >= 0 ? vol->file_table + found : NULL;
+         if (file != NULL && file->loaded) {
+            entry->size = file->file_size;
+            entry->times = file->times;
+         }
+      }
+      key = entryKey(block, pos + take - 1);
+      if (key == UINT64_MAX)
+         dir->done = 1;
+      dir->next = key + 1;
+   }
+   return filled;
+}
+
+/* Fills entry, unless it is NULL, with what a listing shows for the file or directory path names. Every directory on the way is loaded whole, so asking about a name that is not there again costs no I/O. Called with table_lock held exclusively and meta_lock. Returns 0, ERROR_BADFILE if there is no such entry, or ERROR_BADREAD. */
+static int lookupPath(tfs_volume *vol, char *path, tfs_dirent *entry) {
+   const char *inode;
+   file_entry *file;
+   int idx = findPath(vol, path);
+
+   if (idx < 0)
+      return ERROR_BADFILE;
+   if (entry == NULL)
+      return 0;
+   file = vol->file_table + idx;
+   inode = cachePeek(vol->cache, file->inode_block);
+   if (inode == NULL)
+      return ERROR_BADREAD;
+   memcpy(entry->name, file->name, sizeof(entry->name));
+   entry->inode = file->inode_block;
+   entry->is_dir = file->dir >= 0;
+   entry->size = entry->is_dir ? 0 : (int)getWord(inode, INODE_SIZE);
+   entry->read_only = !entry->is_dir && inode[RW] != 0x03;
+   memcpy(&entry->times, inode + INODE_TIMES, sizeof(timestamp));
+   if (file->loaded) {
+      entry->size = file->file_size;
+      entry->times = file->times;
+   }
+   return 0;
+}
+
+// Point dir at the directory path names, the root for NULL, "" or "/".
+// Returns 0 or ERROR_BADFILE if path does not name a directory
+static int openDirectory(tfs_volume *vol, tfs_dir *dir, char *path) {
+   int idx, node = 0;
+
+   if (path != NULL && strcmp(path, "") != 0 && strcmp(path, "/") != 0) {
+      idx = findPath(vol, path);
+      if (idx < 0 || vol->file_table[idx].dir < 0)
+         return ERROR_BADFILE;
+      node = vol->file_table[idx].dir;
+   }
+   dir->node = node;
+   dir->node_inode = vol->dirs[node].inode;
+   return 0;
+}
+
+/* change the file pointer location to offset (absolute). Returns success/error codes. The cursor follows the file pointer, stepping forward from where it is.*/
+static int seekFile(file_entry *file, int offset) {
+   int code;
+
+   // Check if offset is greater than the file size
+   // If so, return BADFILE, since offset cannot be greater than the file size
+   // else set file_offset to the offset that was passed in
+   if (offset >= 0 && offset <= file->file_size) {
+      code = 0;
+      file->file_offset = offset;
+      seekAhead(file, offset / EXTENT_PAYLOAD);
+      // Past the last byte there is no block to move to yet
+      if (offset < file->file_size)
+         code = seekCursor(file, offset / EXTENT_PAYLOAD);
+   } 
+   else {
+      offset = 0;
+      code = ERROR_BADFILE;
+   }
+
+   // return 0 if success, BADFILE if error occurs.
+   return code;
+}
+
+// Change the file READRITE ACCESS to Read Only
+static int makeRO(tfs_volume *vol, char *name) {
+   int idx;
+   char buffer[BLOCKSIZE];
+
+   // Find the file with corresponding name
+   // Return BADFILE if file never exist
+   idx = vol != NULL ? findPath(vol, name) : -1;
+   if (idx < 0 || vol->file_table[idx].dir >= 0) {
+      return ERROR_BADFILE;
+   }
+   // Read inode block into buffer
+   cacheRead(vol->cache, vol->file_table[idx].inode_block, buffer);
+   // Change the READWRITE Byte to READ only
+   buffer[RW] = 0x01;
+   //Write buffer back to the inode block
+   cacheWrite(vol->cache, vol->file_table[idx].inode_block, buffer);
+   return 0;
+}
+
+// Change the file READWRITE Access to Read and Write
+static int makeRW(tfs_volume *vol, char *name) {
+   int idx;
+   char buffer[BLOCKSIZE];
+
+   // Find the file with matching file name
+   // return BADFILE if file never found
+   idx = vol != NULL ? findPath(vol, name) : -1;
+   if (idx < 0 || vol->file_table[idx].dir >= 0) {
+      return ERROR_BADFILE;
+   }
 
-   // Copy back to buffer and write back to inode block
-   memcpy(buffer + 15, filetime, sizeof(timestamp));
-   writeBlock(disk_num, inode, buffer);
+   // Read the inode block to buffer
+   cacheRead(vol->cache, vol->file_table[idx].inode_block, buffer);
+   // Change the Readwrite byte to RW
+   buffer[RW] = 0x03;
+   // Write the buffer back to inode Block
+   cacheWrite(vol->cache, vol->file_table[idx].inode_block, buffer);
+   return 0;
+
+}
+
+//tfs_readFileInfo returns a timestamp struct with  creation time or all info 
+timestamp* tfs_readFileInfo(fileDescriptor FD) {
+   //Initialization
+   file_entry *file = lockFD(FD, LOCK_SHARED | LOCK_META);
+   timestamp* time = (timestamp *) calloc(1, sizeof(timestamp));
+
+   // Find the corresponding file with FD, return BADFILE if not found
+   if (file == NULL)
+      return time;
+
+   // Get the all the timestamp(create, access, modification), the file
+   // table copy is never older than the inode
+   memcpy(time, &file->times, sizeof(timestamp));
+   unlockFD(file->volume, file, LOCK_SHARED | LOCK_META);
+
+   return time;
+}
+
+// Copy the in-memory timestamps of a file into its inode
+static void flushTimes(file_entry *file) {
+   char buffer[BLOCKSIZE];
+
+   if (!file->times_dirty)
+      return;
+   cacheRead(file->volume->cache, file->inode_block, buffer);
+   memcpy(buffer + INODE_TIMES, &file->times, sizeof(timestamp));
+   cacheWrite(file->volume->cache, file->inode_block, buffer);
+   file->times_dirty = 0;
+}
+
+// Note that the timestamps changed, with MOUNT_LAZYTIME the inode waits
+static void markTimes(file_entry *file) {
+   file->times_dirty = 1;
+   if (!(file->volume->mount_flags & MOUNT_LAZYTIME))
+      flushTimes(file);
+}
+
+// Whether an access at 'now' changes the access time of a file. Times are
+// read atomically, so this can be asked without meta_lock
+static int accessChanges(file_entry *file, time_t now) {
+   time_t access = __atomic_load_n(&file->times.access, __ATOMIC_RELAXED);
+
+   if (file->volume->mount_flags & MOUNT_NOATIME)
+      return 0;
+   if ((file->volume->mount_flags & MOUNT_RELATIME) &&
+    access > __atomic_load_n(&file->times.modification, __ATOMIC_RELAXED) &&
+    now - access < RELATIME_WINDOW)
+      return 0;
+   return access != now;
+}
+
+// Whether a change at 'now' changes the timestamps of a file
+static int modifyChanges(file_entry *file, time_t now) {
+   if (__atomic_load_n(&file->times.modification, __ATOMIC_RELAXED) != now)
+      return 1;
+   return !(file->volume->mount_flags & MOUNT_NOATIME) &&
+    __atomic_load_n(&file->times.access, __ATOMIC_RELAXED) != now;
+}
+
+/* Updates the access time of a file. MOUNT_NOATIME skips it, MOUNT_RELATIME only updates an access time that is not newer than the modification time or is older than RELATIME_WINDOW. An access time that already reads the current second is left alone, so a run of reads touches the inode at most once a second. Called with meta_lock held. */
+void accessFile(file_entry *file) {
+   time_t now = time(NULL);
+
+   if (!accessChanges(file, now))
+      return;
+
+   __atomic_store_n(&file->times.access, now, __ATOMIC_RELAXED);
+   markTimes(file);
+}
+
+/* Updates the modification and access times of a file, unless both already read the current second. Called with meta_lock held. */
+void modifyFile(file_entry *file) {
+   time_t now = time(NULL);
+
+   if (!modifyChanges(file, now))
+      return;
+
+   // Update modification and access time
+   __atomic_store_n(&file->times.modification, now, __ATOMIC_RELAXED);
+   if (!(file->volume->mount_flags & MOUNT_NOATIME))
+      __atomic_store_n(&file->times.access, now, __ATOMIC_RELAXED);
+   markTimes(file);
+}
+
+/* accessFile() or, if modified is set, modifyFile() for a call that does not hold meta_lock. The lock is only taken when a timestamp changes, which is at most once a second, so readers of a file do not queue up on it. */
+static void touchFile(file_entry *file, int modified) {
+   time_t now = time(NULL);
+
+   if (modified ? !modifyChanges(file, now) : !accessChanges(file, now))
+      return;
+   pthread_mutex_lock(&file->volume->meta_lock);
+   if (modified)
+      modifyFile(file);
+   else
+      accessFile(file);
+   pthread_mutex_unlock(&file->volume->meta_lock);
+}
+
+/* Sets how many blocks the block cache of volumes mounted from now on may hold. Cannot be changed while tfs_mount() has a file system mounted. */
+int tfs_setCacheSize(int blocks) {
+   int code = 0;
+
+   if (blocks <= 0)
+      return ERROR_BADFILE;
+
+   pthread_mutex_lock(&legacy_lock);
+   if (legacy_volume != NULL)
+      code = ERROR_ALREADY_MOUNTED;
+   else
+      cache_size = blocks;
+   pthread_mutex_unlock(&legacy_lock);
+   return code;
+}
+
+/* Sets the MOUNT_ options of volumes mounted from now on. Cannot be changed while tfs_mount() has a file system mounted. */
+int tfs_setMountOptions(int options) {
+   int code = 0;
+
+   if (options & ~(MOUNT_NOATIME | MOUNT_RELATIME | MOUNT_LAZYTIME))
+      return ERROR_BADFILE;
+
+   pthread_mutex_lock(&legacy_lock);
+   if (legacy_volume != NULL)
+      code = ERROR_ALREADY_MOUNTED;
+   else
+      mount_options = options;
+   pthread_mutex_unlock(&legacy_lock);
+   return code;
+}
+
+/* Writes every dirty cached block of the volume back to disk and makes it durable, timestamps held back by MOUNT_LAZYTIME included. With a journal the commit is the only fsync, a sync that commits nothing or a volume without a journal syncs the disk itself. */
+static int syncFS(tfs_volume *vol) {
+   unsigned int sequence;
+   int idx;
+
+   if (vol == NULL)
+      return ERROR_NOTHING_MOUNTED;
+
+   sequence = vol->log != NULL ? vol->log->sequence : 0;
+   for (idx = 0; idx < vol->num_entries; idx++)
+      flushTimes(vol->file_table + idx);
+   storeBitmap(vol);
+   if (cacheSync(vol->cache) < 0)
+      return ERROR_BADWRITE;
+   if (vol->log != NULL && vol->free_map != NULL)
+      bitmapCommit(vol->free_map);
+   if ((vol->log == NULL || vol->log->sequence == sequence) &&
+    syncDisk(vol->disk) < 0)
+      return ERROR_BADWRITE;
+   return 0;
+}
+
+static int lockVolume(tfs_volume *vol, int mode);
+static void unlockVolume(tfs_volume *vol, int mode);
+
+/* Copies the block cache hit/miss/eviction counters of the volume into stats. */
+int tfs_cacheStatsOn(tfs_volume *volume, cache_stats *stats) {
+   int code;
+
+   if (volume == NULL)
+      return ERROR_NOTHING_MOUNTED;
+
+   code = lockVolume(volume, LOCK_SHARED);
+   if (code == 0) {
+      cacheStats(volume->cache, stats, 0);
+      unlockVolume(volume, LOCK_SHARED);
+   }
+   return code;
+}
+
+int tfs_cacheStats(cache_stats *stats) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_cacheStatsOn(vol, stats);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+/* Copies the call counters of every entry point, counted over all volumes, and the cache counters and the free block count of the volume into stats. */
+int tfs_statsOn(tfs_volume *volume, fs_stats *stats) {
+   int code;
+
+   memset(stats, 0, sizeof(fs_stats));
+   statCopy(stats);
+   code = lockVolume(volume, LOCK_META);
+   if (code == 0 && volume != NULL) {
+      stats->mounted = 1;
+      cacheStats(volume->cache, &stats->cache, 0);
+      stats->free_blocks = volume->free_blocks;
+      unlockVolume(volume, LOCK_META);
+   }
+   return code;
+}
+
+int tfs_stats(fs_stats *stats) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_statsOn(vol, stats);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+/* Sets the call counters and the cache counters of every mounted volume back to zero. */
+int tfs_resetStats(void) {
+   int id;
+
+   statReset();
+   pthread_mutex_lock(&volumes_lock);
+   for (id = 0; id < MAX_VOLUMES; id++) {
+      if (volumes[id] != NULL && !volumes[id]->closing && volumes[id]->cache != NULL)
+         cacheStats(volumes[id]->cache, NULL, 1);
+   }
+   pthread_mutex_unlock(&volumes_lock);
+   return 0;
+}
+
+/* Prints what tfs_stats() reports to stderr, as a table or as JSON. */
+int tfs_dumpStats(int json) {
+   fs_stats stats;
+
+   tfs_stats(&stats);
+   statDump(stderr, &stats, json);
+   return 0;
+}
+
+/* The volume tfs_mount() mounted, NULL if there is none. */
+tfs_volume* tfs_defaultVolume(void) {
+   tfs_volume *vol;
+
+   pthread_mutex_lock(&legacy_lock);
+   vol = legacy_volume;
+   pthread_mutex_unlock(&legacy_lock);
+   return vol;
+}
+
+// Take the locks 'mode' asks for on a call by name, nothing for a NULL volume.
+// Only LOCK_TABLE and LOCK_META mean anything here. The call is pinned on the
+// slot of the volume, see pinSlot(), so an unmount started meanwhile waits
+// for it. Returns 0, or ERROR_NOTHING_MOUNTED with nothing taken if the
+// volume is being unmounted
+static int lockVolume(tfs_volume *vol, int mode) {
+   tfs_volume *pinned;
+
+   if (vol == NULL)
+      return 0;
+   pinned = pinSlot(vol->id);
+   if (pinned != vol) {
+      if (pinned != NULL)
+         unpinVolume(pinned);
+      return ERROR_NOTHING_MOUNTED;
+   }
+   if (mode & LOCK_TABLE)
+      pthread_rwlock_wrlock(&vol->table_lock);
+   else
+      pthread_rwlock_rdlock(&vol->table_lock);
+   if (mode & LOCK_META)
+      pthread_mutex_lock(&vol->meta_lock);
+   return 0;
+}
+
+static void unlockVolume(tfs_volume *vol, int mode) {
+   if (vol == NULL)
+      return;
+   if (mode & LOCK_META)
+      pthread_mutex_unlock(&vol->meta_lock);
+   pthread_rwlock_unlock(&vol->table_lock);
+   unpinVolume(vol);
+}
+
+/* The entry points below run their implementation between statBegin() and statEnd(), so every call shows up in tfs_stats(). They also take the locks of the volume, see lockFD(): a call on an FD holds table_lock shared and the lock of its file, shared for tfs_read() and exclusive for anything that moves the cursor or changes the file, and meta_lock if it changes metadata. Creating, deleting and renaming files and directories hold table_lock exclusively, and so does every other call that walks a path, since that may load a directory into the file table. An unmount waits for the calls already running on the volume and turns away later ones with ERROR_NOTHING_MOUNTED, but a volume must not be named once tfs_unmountVolume() has returned. The calls without a volume pin the volume of tfs_mount() under legacy_lock, so tfs_unmount() cannot free it under them. They keep the one file system interface: tfs_mount() refuses a second file system and tfs_mkfs() refuses to run while one is mounted. */
+int tfs_mkfs(char *filename, off_t nBytes) {
+   stat_probe probe;
+   int code;
+
+   statBegin(&probe);
+   pthread_mutex_lock(&legacy_lock);
+   if (legacy_volume != NULL)
+      code = ERROR_ALREADY_MOUNTED;
+   else
+      code = makeFS(filename, nBytes);
+   pthread_mutex_unlock(&legacy_lock);
+   statEnd(&probe, STAT_MKFS, code, 0);
+   return code;
+}
+
+int tfs_mount(char *filename) {
+   stat_probe probe;
+   int code;
+
+   statBegin(&probe);
+   pthread_mutex_lock(&legacy_lock);
+   if (legacy_volume != NULL)
+      code = ERROR_ALREADY_MOUNTED;
+   else
+      code = mountFS(filename, &legacy_volume);
+   pthread_mutex_unlock(&legacy_lock);
+   statEnd(&probe, STAT_MOUNT, code, 0);
+   return code;
+}
+
+int tfs_unmount(void) {
+   stat_probe probe;
+   tfs_volume *vol;
+   int code;
+
+   statBegin(&probe);
+   pthread_mutex_lock(&legacy_lock);
+   vol = legacy_volume;
+   legacy_volume = NULL;
+   code = unmountFS(vol);
+   pthread_mutex_unlock(&legacy_lock);
+   statEnd(&probe, STAT_UNMOUNT, code, 0);
+   return code;
+}
+
+/* Mounts the image in filename as a new volume and stores it in *volume. Unlike tfs_mount(), any number of images up to MAX_VOLUMES may be mounted at once, and different threads may work on different volumes at the same time. */
+int tfs_mountVolume(char *filename, tfs_volume **volume) {
+   stat_probe probe;
+   int code;
+
+   statBegin(&probe);
+   code = mountFS(filename, volume);
+   statEnd(&probe, STAT_MOUNT, code, 0);
+   return code;
+}
+
+/* Unmounts a volume, FDs of its files stop working. */
+int tfs_unmountVolume(tfs_volume *volume) {
+   stat_probe probe;
+   int code;
+
+   statBegin(&probe);
+   pthread_mutex_lock(&legacy_lock);
+   if (volume != NULL && volume == legacy_volume)
+      legacy_volume = NULL;
+   pthread_mutex_unlock(&legacy_lock);
+   code = unmountFS(volume);
+   statEnd(&probe, STAT_UNMOUNT, code, 0);
+   return code;
+}
+
+fileDescriptor tfs_openFileOn(tfs_volume *volume, char *name) {
+   stat_probe probe;
+   fileDescriptor FD;
+
+   statBegin(&probe);
+   FD = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (FD == 0) {
+      FD = volume != NULL ? openFile(volume, name) : ERROR_NOTHING_MOUNTED;
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   statEnd(&probe, STAT_OPEN, FD, 0);
+   return FD;
+}
+
+fileDescriptor tfs_openFile(char *name) {
+   tfs_volume *vol = pinLegacy();
+   fileDescriptor FD = tfs_openFileOn(vol, name);
+
+   unpinLegacy(vol);
+   return FD;
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILECLOSE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_FILE | LOCK_META);
+   if (file != NULL) {
+      vol = file->volume;
+      code = closeFile(file);
+      unlockFD(vol, file, LOCK_FILE | LOCK_META);
+   }
+   statEnd(&probe, STAT_CLOSE, code, 0);
+   return code;
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_FILE | LOCK_META);
+   if (file != NULL) {
+      vol = file->volume;
+      code = writeFile(file, buffer, size);
+      unlockFD(vol, file, LOCK_FILE | LOCK_META);
+   }
+   statEnd(&probe, STAT_WRITE_FILE, code, code == WRITE_SUCCESS ? size : 0);
+   return code;
+}
+
+int tfs_write(fileDescriptor FD, char *buf, int n) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_FILE | LOCK_META);
+   if (file != NULL) {
+      vol = file->volume;
+      code = writeAt(file, buf, n, 0);
+      unlockFD(vol, file, LOCK_FILE | LOCK_META);
+   }
+   statEnd(&probe, STAT_WRITE, code, code > 0 ? code : 0);
+   return code;
+}
 
-   // clean up
-   free(buffer);
-   free(filetime);
+int tfs_append(fileDescriptor FD, char *buf, int n) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_FILE | LOCK_META);
+   if (file != NULL) {
+      vol = file->volume;
+      code = writeAt(file, buf, n, 1);
+      unlockFD(vol, file, LOCK_FILE | LOCK_META);
+   }
+   statEnd(&probe, STAT_APPEND, code, code > 0 ? code : 0);
+   return code;
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_TABLE | LOCK_META);
+   if (file != NULL) {
+      vol = file->volume;
+      code = deleteFile(file);
+      unlockFD(vol, file, LOCK_TABLE | LOCK_META);
+   }
+   statEnd(&probe, STAT_DELETE, code, 0);
+   return code;
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_FILE);
+   if (file != NULL) {
+      vol = file->volume;
+      code = readByte(file, buffer);
+      unlockFD(vol, file, LOCK_FILE);
+   }
+   statEnd(&probe, STAT_READ_BYTE, code, code == 0);
+   return code;
+}
+
+int tfs_read(fileDescriptor FD, char *buf, int n) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_SHARED);
+   if (file != NULL) {
+      vol = file->volume;
+      code = readFile(file, buf, n);
+      unlockFD(vol, file, LOCK_SHARED);
+   }
+   statEnd(&probe, STAT_READ, code, code);
+   return code;
+}
+
+int tfs_writeByte(fileDescriptor FD, unsigned char data) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_FILE);
+   if (file != NULL) {
+      vol = file->volume;
+      code = writeByte(file, data);
+      unlockFD(vol, file, LOCK_FILE);
+   }
+   statEnd(&probe, STAT_WRITE_BYTE, code, code == 0);
+   return code;
+}
+
+int tfs_seek(fileDescriptor FD, int offset) {
+   stat_probe probe;
+   tfs_volume *vol;
+   file_entry *file;
+   int code = ERROR_BADFILE;
+
+   statBegin(&probe);
+   file = lockFD(FD, LOCK_FILE);
+   if (file != NULL) {
+      vol = file->volume;
+      code = seekFile(file, offset);
+      unlockFD(vol, file, LOCK_FILE);
+   }
+   statEnd(&probe, STAT_SEEK, code, 0);
+   return code;
+}
+
+int tfs_renameOn(tfs_volume *volume, char *newName, char *oldName) {
+   stat_probe probe;
+   int code;
+
+   statBegin(&probe);
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = renameFile(volume, newName, oldName);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   statEnd(&probe, STAT_RENAME, code, 0);
+   return code;
+}
+
+int tfs_rename(char *newName, char *oldName) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_renameOn(vol, newName, oldName);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+int tfs_syncOn(tfs_volume *volume) {
+   stat_probe probe;
+   int code;
+
+   statBegin(&probe);
+   code = lockVolume(volume, LOCK_META);
+   if (code == 0) {
+      code = syncFS(volume);
+      unlockVolume(volume, LOCK_META);
+   }
+   statEnd(&probe, STAT_SYNC, code, 0);
+   return code;
+}
+
+int tfs_sync(void) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_syncOn(vol);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+int tfs_makeROOn(tfs_volume *volume, char *name) {
+   int code;
+
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = makeRO(volume, name);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   return code;
+}
+
+int tfs_makeRO(char *name) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_makeROOn(vol, name);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+int tfs_makeRWOn(tfs_volume *volume, char *name) {
+   int code;
+
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = makeRW(volume, name);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   return code;
+}
+
+int tfs_makeRW(char *name) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_makeRWOn(vol, name);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+int tfs_readdirOn(tfs_volume *volume) {
+   int code;
+
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = listFiles(volume);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   return code;
+}
+
+int tfs_readdir() {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_readdirOn(vol);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+/* Starts a listing of the root directory of the volume, from its first name or, to pick up a listing where an earlier one stopped, from the first name after 'after'. Nothing is read and nothing has to be freed, tfs_readdirNext() does the work, but a listing must not be used once its volume is unmounted. Names created or deleted between two calls are seen or not depending on where they sort. Returns 0, ERROR_NOTHING_MOUNTED or ERROR_BADFILE for a name that is too long. */
+int tfs_opendirOn(tfs_volume *volume, tfs_dir *dir, char *after) {
+   if (volume == NULL)
+      return ERROR_NOTHING_MOUNTED;
+   if (after != NULL && strlen(after) > 8)
+      return ERROR_BADFILE;
+   dir->volume = volume;
+   dir->node = 0;
+   dir->node_inode = 0;
+   dir->next = after != NULL ? dirKey(after) + 1 : 0;
+   dir->done = after != NULL && dirKey(after) == UINT64_MAX;
+   return 0;
+}
+
+int tfs_opendir(tfs_dir *dir, char *after) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_opendirOn(vol, dir, after);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+/* Starts a listing of the directory path names, like tfs_opendirOn() does for the root. Walking the path loads the directories on it. Once the directory is removed tfs_readdirNext() returns ERROR_BADFILE. Returns 0, ERROR_NOTHING_MOUNTED or ERROR_BADFILE. */
+int tfs_opendirPathOn(tfs_volume *volume, tfs_dir *dir, char *path, char *after) {
+   int code = tfs_opendirOn(volume, dir, after);
+
+   if (code < 0)
+      return code;
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = openDirectory(volume, dir, path);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   return code;
+}
+
+int tfs_opendirPath(tfs_dir *dir, char *path, char *after) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_opendirPathOn(vol, dir, path, after);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+/* Copies the next files of the listing into entries, at most max of them, without allocating anything per entry. Returns how many were copied, 0 at the end of the listing, or an error code. */
+int tfs_readdirNext(tfs_dir *dir, tfs_dirent *entries, int max) {
+   stat_probe probe;
+   int code;
+
+   if (dir == NULL || dir->volume == NULL || entries == NULL || max <= 0)
+      return ERROR_BADFILE;
+   statBegin(&probe);
+   code = lockVolume(dir->volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = readEntries(dir, entries, max);
+      unlockVolume(dir->volume, LOCK_TABLE | LOCK_META);
+   }
+   statEnd(&probe, STAT_READDIR, code, 0);
+   return code;
+}
+
+int tfs_mkdirOn(tfs_volume *volume, char *path) {
+   stat_probe probe;
+   int code;
+
+   if (volume == NULL)
+      return ERROR_NOTHING_MOUNTED;
+   statBegin(&probe);
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = makeDir(volume, path);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   statEnd(&probe, STAT_MKDIR, code, 0);
+   return code;
+}
+
+int tfs_mkdir(char *path) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_mkdirOn(vol, path);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+int tfs_rmdirOn(tfs_volume *volume, char *path) {
+   stat_probe probe;
+   int code;
+
+   if (volume == NULL)
+      return ERROR_NOTHING_MOUNTED;
+   statBegin(&probe);
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = removeDir(volume, path);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   statEnd(&probe, STAT_RMDIR, code, 0);
+   return code;
+}
+
+int tfs_rmdir(char *path) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_rmdirOn(vol, path);
+
+   unpinLegacy(vol);
+   return code;
+}
+
+/* Tells whether path names a file or directory and, unless entry is NULL, fills it in like tfs_readdirNext() would. Returns 0, ERROR_BADFILE if there is nothing there, or another error code. */
+int tfs_lookupOn(tfs_volume *volume, char *path, tfs_dirent *entry) {
+   stat_probe probe;
+   int code;
+
+   if (volume == NULL)
+      return ERROR_NOTHING_MOUNTED;
+   statBegin(&probe);
+   code = lockVolume(volume, LOCK_TABLE | LOCK_META);
+   if (code == 0) {
+      code = lookupPath(volume, path, entry);
+      unlockVolume(volume, LOCK_TABLE | LOCK_META);
+   }
+   statEnd(&probe, STAT_LOOKUP, code, 0);
+   return code;
+}
+
+int tfs_lookup(char *path, tfs_dirent *entry) {
+   tfs_volume *vol = pinLegacy();
+   int code = tfs_lookupOn(vol, path, entry);
+
+   unpinLegacy(vol);
+   return code;
 }
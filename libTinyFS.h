@@ -1,45 +1,186 @@
 #ifndef LIBTINYFS_H
 #define LIBTINYFS_H
-//inode 0-type, 1-magic, 2-file extent, 3,4- size, 5-name, 14-RW, 15-timestamp
+//superblock 0-type, 1-magic, 2-version, 4-bitmap blocks, 8-total blocks, 12-free blocks, 16-total files and directories, 20-journal blocks, 24-first block of the root directory
+//directory block 0-type, 1-magic, 4-number of entries, 8-next directory block, 12-entries
+//directory entry 0-name padded with zeros to 8 bytes, 8-inode block, with DIR_ENTRY_DIR set for a directory. Entries are sorted by name within a block and across the chain
+//directory inode 0-type, 1-magic, 4-first directory block, 12-name, 24-timestamp
+//inode 0-type, 1-magic, 4-number of extents, 8-size, 12-name, 21-RW, 24-timestamp, 48-extent list
+//extent list entry 0-first block, 4-number of blocks, the blocks of an extent are consecutive
+//file data block 0-type, 1-magic, 8-data
+//free space bitmap in blocks 1 to bitmap blocks, see libBitmap.h
+//metadata journal in the journal blocks right after the bitmap, see libJournal.h
+//block numbers, counts and sizes are 32-bit little endian words
 //r-0x01, w-0x03
+#include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "libCache.h"
+#include "libBitmap.h"
+#include "libStats.h"
+
 typedef int fileDescriptor;
-#define RW 14
-char*  initSuperBlock();
-void initFS(int nBytes);
-
-struct file_entry; 
-struct file_entry* file_table; //files that are open in the mounted filesystem
-struct free_block* freeblock_head;
-int nextFD; //used to assign the nextFD
-int total_files; //total number of files stored in the file system
-int free_blocks;
-int disk_num;
-int mounted;
-
-typedef struct free_block {
-   int block_number;
-   struct free_block* next; //pointer to enxt free block in chain
-} free_block;
+#define SB_VERSION 2
+#define SB_BITMAP_BLOCKS 4
+#define SB_TOTAL_BLOCKS 8
+#define SB_FREE_BLOCKS 12
+#define SB_TOTAL_FILES 16
+#define SB_JOURNAL_BLOCKS 20
+#define SB_DIRECTORY 24 //0 while there are no files
+#define DIR_COUNT 4
+#define DIR_NEXT 8 //0 in the last directory block
+#define DIR_ENTRIES 12
+#define DIR_ENTRY_SIZE 12
+#define DIR_ENTRY_INODE 8
+#define DIR_ENTRY_DIR 0x80000000u //inode word flag of a subdirectory
+#define DIR_MAX_ENTRIES ((BLOCKSIZE - DIR_ENTRIES) / DIR_ENTRY_SIZE)
+#define DIRNODE_FIRST 4 //0 while the directory is empty
+#define MAX_FILES 65536 //directory entries, files and directories together
+#define MAX_BLOCKS 0x7FFFFFFF //block numbers are kept in an int in memory
+#define INODE_NUM_EXTENTS 4
+#define INODE_SIZE 8
+#define INODE_NAME 12
+#define RW 21
+#define INODE_TIMES 24
+#define INODE_EXTENTS 48 //right after the three time_t of the timestamp
+#define INODE_MAX_EXTENTS ((BLOCKSIZE - INODE_EXTENTS) / 8)
+#define EXTENT_DATA 8
+#define EXTENT_PAYLOAD (BLOCKSIZE - EXTENT_DATA) //file bytes per data block
+//options for tfs_setMountOptions, the default updates every timestamp at once
+#define MOUNT_NOATIME 0x01 //never update access times
+#define MOUNT_RELATIME 0x02 //update access times only if older than the modification time or RELATIME_WINDOW
+#define MOUNT_LAZYTIME 0x04 //keep timestamps in memory until close, sync or unmount
+#define RELATIME_WINDOW (24 * 60 * 60) //seconds
+#define MAX_VOLUMES 64 //volumes that may be mounted at the same time
+#define VOLUME_SHIFT 24 //an FD holds the volume id above this bit, a number local to the volume below
+unsigned int getWord(const char *block, int offset);
+void putWord(char *block, int offset, unsigned int value);
+char*  initSuperBlock(off_t nBytes);
+int initFS(int disk, off_t nBytes);
+
+extern int cache_size; //capacity in blocks used by the next mount
+extern int mount_options; //MOUNT_ flags used by the next mount
+
+typedef struct timestamp {
+   time_t creation;
+   time_t modification;
+   time_t access;
+} timestamp;
+
+//run of consecutive data blocks of a file
+typedef struct file_extent {
+   int start; //first block
+   int length; //number of blocks
+} file_extent;
 
 //holds information for each open file in the file table
 typedef struct file_entry {
    int fd; //file descriptor of the open file
    int inode_block; //block number of the inode in the file_system
-   int file_block; //block number of the file_extent in the file_system
+   int num_extents;
+   file_extent *extents; //copy of the inode extent list
    int open;
    int file_offset; //file pointer used in seek & readByte
+   int file_size; //copy of the inode size in bytes
+   int cursor_index; //data block index the cursor is on, -1 if not placed
+   int cursor_extent; //extent holding that block
+   int cursor_base; //data block index of the first block of that extent
+   int cursor_block; //disk block number of that block
+   char *cursor_data; //pinned copy of that block
+   int ra_next; //data block index a sequential read starts on next
+   int ra_window; //readahead window in blocks, 0 while reads are random
+   int ra_end; //data blocks before this index have been read ahead
+   timestamp times; //newest timestamps, ahead of the inode while times_dirty
+   int times_dirty;
    char name[9];
+   int parent; //index in the volume's dirs of the directory holding the entry
+   int dir; //index in dirs if the entry is a directory, -1 for a file
+   int loaded; //0 until loadEntry() read the inode, only name, parent, dir and inode_block are set before
+   struct tfs_volume *volume; //volume the file lives on
+   //shared by tfs_read() calls, held exclusively by anything that moves the
+   //cursor or changes the file. Allocated on its own, so the entry can be
+   //moved around the table without moving the lock
+   pthread_rwlock_t *lock;
 } file_entry;
 
-typedef struct timestamp {
-   time_t creation;
-   time_t modification;
-   time_t access;
-} timestamp;
+//one file of a directory listing, filled in by tfs_readdirNext()
+typedef struct tfs_dirent {
+   char name[9];
+   int inode; //block number of the inode
+   int is_dir; //1 for a directory, which has size 0
+   int size; //bytes
+   int read_only; //1 after tfs_makeRO()
+   timestamp times;
+} tfs_dirent;
+
+//position in a directory listing, see tfs_opendir(). A plain value that
+//holds nothing, it can be copied, kept between calls or dropped at any time
+typedef struct tfs_dir {
+   struct tfs_volume *volume;
+   int node; //index in the volume's dirs of the directory listed
+   int node_inode; //its inode block, the listing ends if it is removed
+   uint64_t next; //sort key of the first name not returned yet
+   int done;
+} tfs_dir;
+
+//one directory of a volume: its blocks in name order and the sort key of
+//the first name in each, see dirKey()
+typedef struct dir_node {
+   int inode; //block of the directory inode, 0 for the root, -1 once removed
+   int parent; //index in dirs of the directory holding it
+   int loaded; //1 once its entries are in file_table, see loadDirectory()
+   int *blocks;
+   uint64_t *first;
+   int count;
+   int capacity;
+} dir_node;
+
+//state of one mounted file system, returned by tfs_mountVolume(). Calls on
+//different volumes share nothing but the disk table, so each volume can be
+//served by its own thread. Within a volume locks are taken in the order
+//table_lock, the lock of a file, meta_lock, then the cache lock
+typedef struct tfs_volume {
+   int id; //slot in the volume table, also in the high bits of every FD
+   char *filename; //image the volume was mounted from
+   int disk;
+   file_entry *file_table; //entries of every loaded directory, open or not
+   int num_entries; //used entries of file_table
+   int table_capacity;
+   int total_files; //files and directories stored in the file system
+   //every directory seen so far, dirs[0] is the root. A directory gets an
+   //entry when its parent is loaded, see loadDirectory()
+   dir_node *dirs;
+   int num_dirs;
+   int free_blocks; //from the superblock until the bitmap is loaded
+   int next_fd; //used to assign the next FD, local to the volume
+   block_bitmap *free_map; //free space bitmap, NULL until loadAllocator()
+   block_cache *cache;
+   journal *log; //metadata journal, NULL if the volume has none
+   int mount_flags; //MOUNT_ flags the volume was mounted with
+   int closing; //set once unmountFS() starts, calls on the volume and its FDs are turned away
+   //open addressing hash of (directory, name), name_slots holds file_table
+   //indices. Every loaded directory is in it whole, so a name it does not
+   //find is not there either
+   uint64_t *name_keys;
+   int *name_slots; //-1 marks an empty slot
+   int name_capacity; //power of two, at least twice num_entries
+   //file_table index of every local FD handed out, -1 once it is gone
+   int *fd_slots;
+   int fd_capacity;
+   //journal sequence when blocks were last deferred or went to the cache,
+   //they can be handed out again once a later transaction is committed
+   unsigned int freed_at;
+   //file_table, dirs, both indexes, total_files and next_fd. Shared by calls
+   //on an FD, held exclusively while files are created, deleted or renamed
+   //and by path lookups, which may load a directory into file_table
+   pthread_rwlock_t table_lock;
+   //allocator, superblock and every inode and bitmap write. Held for all the
+   //metadata of a call, so it goes into the journal as one transaction
+   pthread_mutex_t meta_lock;
+} tfs_volume;
 
 
 /********** Required Functions for TinyFS **********/
-int tfs_mkfs(char *filename, int nBytes);
+int tfs_mkfs(char *filename, off_t nBytes);
 
 int tfs_mount(char *filename);
 
@@ -57,21 +198,59 @@ int tfs_readByte(fileDescriptor FD, char *buffer);
 
 int tfs_seek(fileDescriptor FD, int offset);   
 
-void accessFile(int inode);
+void accessFile(file_entry *file);
 
-void modifyFile(int inode);
+void modifyFile(file_entry *file);
 
 /********** END Requre Functions **********/
 
 /********** Additional Features start **********/
-void modifyFile(int inode);
-void accessFile(int inode);
+void modifyFile(file_entry *file);
+void accessFile(file_entry *file);
 timestamp* tfs_readFileInfo(fileDescriptor FD);
 int tfs_makeRW(char *name);
 int tfs_makeRO(char *name);
 int tfs_readdir();
+int tfs_opendir(tfs_dir *dir, char *after);
+int tfs_readdirNext(tfs_dir *dir, tfs_dirent *entries, int max);
+int tfs_opendirPath(tfs_dir *dir, char *path, char *after);
+int tfs_mkdir(char *path);
+int tfs_rmdir(char *path);
+int tfs_lookup(char *path, tfs_dirent *entry);
 int tfs_rename(char *newName, char *oldName);
 int tfs_writeByte(fileDescriptor FD, unsigned char data);
+int tfs_read(fileDescriptor FD, char *buf, int n);
+int tfs_write(fileDescriptor FD, char *buf, int n);
+int tfs_append(fileDescriptor FD, char *buf, int n);
+int tfs_setCacheSize(int blocks);
+int tfs_setMountOptions(int options);
+int tfs_sync(void);
+int tfs_cacheStats(cache_stats *stats);
+int tfs_stats(fs_stats *stats);
+int tfs_resetStats(void);
+int tfs_dumpStats(int json);
+
+/********* Volumes: any number of file systems mounted at once *********/
+//The tfs_ calls above that take a name work on the volume mounted by
+//tfs_mount(), calls that take an FD work on whichever volume the FD
+//came from. A name may be a path like "dir/sub/file", with directories
+//separated by '/' and an optional leading '/'
+int tfs_mountVolume(char *filename, tfs_volume **volume);
+int tfs_unmountVolume(tfs_volume *volume);
+tfs_volume* tfs_defaultVolume(void);
+fileDescriptor tfs_openFileOn(tfs_volume *volume, char *name);
+int tfs_renameOn(tfs_volume *volume, char *newName, char *oldName);
+int tfs_makeROOn(tfs_volume *volume, char *name);
+int tfs_makeRWOn(tfs_volume *volume, char *name);
+int tfs_readdirOn(tfs_volume *volume);
+int tfs_opendirOn(tfs_volume *volume, tfs_dir *dir, char *after);
+int tfs_opendirPathOn(tfs_volume *volume, tfs_dir *dir, char *path, char *after);
+int tfs_mkdirOn(tfs_volume *volume, char *path);
+int tfs_rmdirOn(tfs_volume *volume, char *path);
+int tfs_lookupOn(tfs_volume *volume, char *path, tfs_dirent *entry);
+int tfs_syncOn(tfs_volume *volume);
+int tfs_cacheStatsOn(tfs_volume *volume, cache_stats *stats);
+int tfs_statsOn(tfs_volume *volume, fs_stats *stats);
 
 /********* END additional Features *********/
 #endif
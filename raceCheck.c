@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+
+// Calls racing an unmount, run by make check under a sanitizer, which
+// reports a call that touches a volume after it was freed
+
+#define RACE_IMAGE "raceCheck.img"
+#define RACE_ROUNDS 200
+#define RACE_THREADS 4
+
+static int failures;
+static fileDescriptor shared_fd;
+static int started;
+
+static void expect(int ok, const char *what) {
+   printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+   if (!ok)
+      failures++;
+}
+
+static void waitForStart(void) {
+   __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+}
+
+// Works on the shared FD until it stops resolving
+static void* fdCaller(void *arg) {
+   char buf[512];
+
+   (void)arg;
+   waitForStart();
+   while (tfs_seek(shared_fd, 0) == 0 && tfs_read(shared_fd, buf, sizeof(buf)) >= 0)
+      tfs_writeByte(shared_fd, 'x');
+   return NULL;
+}
+
+// Calls by name on the volume of tfs_mount() until it is gone
+static void* nameCaller(void *arg) {
+   fs_stats stats;
+   cache_stats counters;
+
+   (void)arg;
+   waitForStart();
+   while (tfs_stats(&stats) == 0 && stats.mounted) {
+      tfs_cacheStats(&counters);
+      tfs_lookup("f", NULL);
+      tfs_openFile("g");
+      tfs_sync();
+   }
+   return NULL;
+}
+
+// Starts RACE_THREADS threads running fn once a volume with file f is up
+static void startCallers(pthread_t *threads, void *(*fn)(void *)) {
+   int idx;
+
+   started = 0;
+   for (idx = 0; idx < RACE_THREADS; idx++)
+      pthread_create(threads + idx, NULL, fn, NULL);
+   while (__atomic_load_n(&started, __ATOMIC_SEQ_CST) < RACE_THREADS)
+      sched_yield();
+}
+
+static void joinCallers(pthread_t *threads) {
+   int idx;
+
+   for (idx = 0; idx < RACE_THREADS; idx++)
+      pthread_join(threads[idx], NULL);
+}
+
+// tfs_unmountVolume() while other threads work on FDs of the volume
+static void unmountUnderFDs(void) {
+   pthread_t threads[RACE_THREADS];
+   char data[4000];
+   tfs_volume *vol;
+   int round, bad = 0;
+
+   memset(data, 'a', sizeof(data));
+   for (round = 0; round < RACE_ROUNDS; round++) {
+      if (tfs_mkfs(RACE_IMAGE, 256 * BLOCKSIZE) != MAKEFS_SUCCESS ||
+       tfs_mountVolume(RACE_IMAGE, &vol) != MOUNT_SUCCESS) {
+         bad++;
+         break;
+      }
+      shared_fd = tfs_openFileOn(vol, "f");
+      tfs_writeFile(shared_fd, data, sizeof(data));
+      startCallers(threads, fdCaller);
+      if (tfs_unmountVolume(vol) != UNMOUNT_SUCCESS)
+         bad++;
+      joinCallers(threads);
+   }
+   expect(bad == 0, "unmount while FDs of the volume are in use");
+}
+
+// tfs_unmount() while other threads make calls without a volume
+static void unmountUnderNames(void) {
+   pthread_t threads[RACE_THREADS];
+   int round, bad = 0;
+
+   for (round = 0; round < RACE_ROUNDS; round++) {
+      if (tfs_mkfs(RACE_IMAGE, 256 * BLOCKSIZE) != MAKEFS_SUCCESS ||
+       tfs_mount(RACE_IMAGE) != MOUNT_SUCCESS) {
+         bad++;
+         break;
+      }
+      tfs_openFile("f");
+      startCallers(threads, nameCaller);
+      if (tfs_unmount() != UNMOUNT_SUCCESS)
+         bad++;
+      joinCallers(threads);
+   }
+   expect(bad == 0, "unmount while calls by name are running");
+}
+
+int main(void) {
+   setDiskBackend(DISK_MEMORY);
+   unmountUnderFDs();
+   unmountUnderNames();
+   removeMemoryDisk(RACE_IMAGE);
+   printf("%d failed\n", failures);
+   return failures != 0;
+}
@@ -4,9 +4,17 @@
 #define BLOCKSIZE 256
 #define DEFAULT_DISK_SIZE 10240 
 #define DEFAULT_DISK_NAME “tinyFSDisk”    
+#define DEFAULT_CACHE_SIZE 64 //blocks held by the block cache
 #define SUPERBLOCK 1 
 #define INODE 2
 #define FILE_EXTENT 3
 #define FREEBLOCK 4
+#define BITMAP 5
+#define JOURNAL 6 //journal descriptor, see libJournal.h
+#define DIRECTORY 7 //block of name to inode entries, see libTinyFS.h
+#define DIRNODE 8 //inode of a subdirectory
+#define MAGIC 0x46 //byte 1 of every block
+#define LEGACY_MAGIC 0x45 //one-byte block address format, converted on mount
+#define FS_VERSION 6 //superblock byte 2, bumped on layout changes
 
 #endif
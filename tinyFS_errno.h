@@ -15,6 +15,9 @@
 #define ERROR_UNMOUNT_FAIL -15
 #define ERROR_ALREADY_MOUNTED -16
 #define ERROR_NOTHING_MOUNTED -17
+#define ERROR_NO_SPACE -18
+#define ERROR_EXISTS -19
+#define ERROR_NOT_EMPTY -20
 #define WRITE_SUCCESS 1
 #define RENAME_SUCCESS 2
 #define READDIR_SUCCESS 3
@@ -22,3 +25,5 @@
 #define UNMOUNT_SUCCESS 5
 #define DELETE_SUCCESS 6
 #define MAKEFS_SUCCESS 7
+#define MKDIR_SUCCESS 8
+#define RMDIR_SUCCESS 9
@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+
+#define BENCH_IMAGE "tinyFsBench.img"
+#define MKFS_REPS 5
+#define MOUNT_REPS 20
+#define RANDOM_OPS 2000 //random reads and byte writes per configuration
+#define SMALL_OPS 20000 //sequential small reads per configuration
+#define SMALL_READ 64 //bytes per sequential small read
+#define MAX_FILE_BLOCKS 256 //data blocks per file at most
+
+//volumes and file counts every operation is measured on
+static const int disk_sizes[] = {1024, 4096, 16384}; //blocks
+static const int file_counts[] = {8, 64, 256};
+
+//latency samples and I/O of one measured operation
+typedef struct bench_op {
+   char *name;
+   double *samples; //seconds per call
+   int count;
+   int capacity;
+   disk_stats before; //counters when the operation started
+   unsigned long reads; //blocks read by all calls, syncs included
+   unsigned long writes;
+   unsigned long calls; //libDisk calls that moved blocks
+   long long busy_ns; //simulated device time
+   long long busy_before;
+   int has_io; //0 if the disk was not open, as for mkfs
+} bench_op;
+
+static const disk_profile *profile; //NULL to run without simulated timing
+
+static double now() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void opInit(bench_op *op, char *name) {
+   memset(op, 0, sizeof(bench_op));
+   op->name = name;
+}
+
+static void opSample(bench_op *op, double seconds) {
+   if (op->count == op->capacity) {
+      op->capacity = op->capacity ? op->capacity * 2 : 64;
+      op->samples = (double *)realloc(op->samples, sizeof(double) * op->capacity);
+   }
+   op->samples[op->count++] = seconds;
+}
+
+// Snapshot the counters of the mounted disk before a run of calls
+static void opStart(bench_op *op) {
+   diskStats(tfs_defaultVolume()->disk, &op->before);
+   op->busy_before = diskBusyTime(tfs_defaultVolume()->disk);
+}
+
+// Sync so deferred writes are charged to the calls that caused them, then
+// add up what the disk did since opStart()
+static void opStop(bench_op *op) {
+   disk_stats after;
+
+   tfs_sync();
+   diskStats(tfs_defaultVolume()->disk, &after);
+   op->reads += after.reads - op->before.reads;
+   op->writes += after.writes - op->before.writes;
+   op->calls += after.read_calls + after.write_calls -
+    op->before.read_calls - op->before.write_calls;
+   op->busy_ns += diskBusyTime(tfs_defaultVolume()->disk) - op->busy_before;
+   op->has_io = 1;
+}
+
+static int compareSamples(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+// Sample at percentile p of the sorted samples, in microseconds
+static double percentile(bench_op *op, double p) {
+   int idx = (int)(p * op->count + 0.999999) - 1;
+
+   if (idx < 0)
+      idx = 0;
+   return op->samples[idx] * 1e6;
+}
+
+static void opReport(bench_op *op) {
+   double total = 0;
+   int idx;
+
+   if (op->count == 0)
+      return;
+   qsort(op->samples, op->count, sizeof(double), compareSamples);
+   for (idx = 0; idx < op->count; idx++)
+      total += op->samples[idx];
+
+   printf("  %-12s %6d %10.0f %9.1f %9.1f %9.1f", op->name, op->count,
+    op->count / total, percentile(op, 0.5), percentile(op, 0.9),
+    percentile(op, 0.99));
+   if (op->has_io)
+      printf(" %8.2f %8.2f %8.2f", (double)op->reads / op->count,
+       (double)op->writes / op->count, (double)op->calls / op->count);
+   else
+      printf(" %8s %8s %8s", "-", "-", "-");
+   if (profile != NULL && op->has_io)
+      printf(" %10.1f", op->busy_ns / 1e3 / op->count);
+   printf("\n");
+   free(op->samples);
+}
+
+static void mountImage() {
+   if (tfs_mount(BENCH_IMAGE) != MOUNT_SUCCESS) {
+      printf("Cannot mount %s\n", BENCH_IMAGE);
+      exit(1);
+   }
+   setDiskProfile(tfs_defaultVolume()->disk, profile);
+}
+
+/* Measures every operation on a fresh volume of num_blocks blocks holding num_files files, each filling an equal share of half the volume. */
+static void benchVolume(int num_blocks, int num_files) {
+   bench_op mkfs, mount, create, write, seqRead, randRead, writeByte, rename,
+    smallRead, del;
+   char name[16], newName[16];
+   char *data, *buf;
+   fileDescriptor *fds;
+   int file_bytes, blocks, idx, rep, offset;
+   double start;
+
+   blocks = num_blocks / 2 / num_files;
+   blocks = blocks < MAX_FILE_BLOCKS ? blocks : MAX_FILE_BLOCKS;
+   file_bytes = (blocks > 0 ? blocks : 1) * EXTENT_PAYLOAD;
+   data = (char *)malloc(file_bytes);
+   buf = (char *)malloc(file_bytes);
+   fds = (fileDescriptor *)malloc(sizeof(fileDescriptor) * num_files);
+   for (idx = 0; idx < file_bytes; idx++)
+      data[idx] = (char)(idx * 7);
+
+   printf("\n%d blocks (%d KB), %d files of %d bytes\n", num_blocks,
+    num_blocks * BLOCKSIZE / 1024, num_files, file_bytes);
+   printf("  %-12s %6s %10s %9s %9s %9s %8s %8s %8s%s\n", "operation", "calls",
+    "ops/s", "p50 us", "p90 us", "p99 us", "rd/op", "wr/op", "io/op",
+    profile != NULL ? "   dev us/op" : "");
+
+   opInit(&mkfs, "mkfs");
+   for (rep = 0; rep < MKFS_REPS; rep++) {
+      start = now();
+      tfs_mkfs(BENCH_IMAGE, (off_t)num_blocks * BLOCKSIZE);
+      opSample(&mkfs, now() - start);
+   }
+   opReport(&mkfs);
+
+   mountImage();
+   opInit(&create, "create");
+   opStart(&create);
+   for (idx = 0; idx < num_files; idx++) {
+      snprintf(name, sizeof(name), "b%d", idx);
+      start = now();
+      fds[idx] = tfs_openFile(name);
+      opSample(&create, now() - start);
+   }
+   opStop(&create);
+   opReport(&create);
+
+   opInit(&write, "writeFile");
+   opStart(&write);
+   for (idx = 0; idx < num_files; idx++) {
+      start = now();
+      tfs_writeFile(fds[idx], data, file_bytes);
+      opSample(&write, now() - start);
+   }
+   opStop(&write);
+   opReport(&write);
+
+   opInit(&seqRead, "seq read");
+   opStart(&seqRead);
+   for (idx = 0; idx < num_files; idx++) {
+      start = now();
+      tfs_seek(fds[idx], 0);
+      tfs_read(fds[idx], buf, file_bytes);
+      opSample(&seqRead, now() - start);
+   }
+   opStop(&seqRead);
+   opReport(&seqRead);
+
+   srand(42);
+   opInit(&randRead, "random read");
+   opStart(&randRead);
+   for (rep = 0; rep < RANDOM_OPS; rep++) {
+      idx = rand() % num_files;
+      offset = rand() % file_bytes;
+      start = now();
+      tfs_seek(fds[idx], offset);
+      tfs_read(fds[idx], buf, EXTENT_PAYLOAD);
+      opSample(&randRead, now() - start);
+   }
+   opStop(&randRead);
+   opReport(&randRead);
+
+   opInit(&writeByte, "writeByte");
+   opStart(&writeByte);
+   for (rep = 0; rep < RANDOM_OPS; rep++) {
+      idx = rand() % num_files;
+      offset = rand() % file_bytes;
+      start = now();
+      tfs_seek(fds[idx], offset);
+      tfs_writeByte(fds[idx], (unsigned char)rep);
+      opSample(&writeByte, now() - start);
+   }
+   opStop(&writeByte);
+   opReport(&writeByte);
+
+   opInit(&rename, "rename");
+   opStart(&rename);
+   for (idx = 0; idx < num_files; idx++) {
+      snprintf(name, sizeof(name), "b%d", idx);
+      snprintf(newName, sizeof(newName), "r%d", idx);
+      start = now();
+      tfs_rename(newName, name);
+      opSample(&rename, now() - start);
+   }
+   opStop(&rename);
+   opReport(&rename);
+   tfs_unmount();
+
+   // Mounting only reads the superblock, it is measured populated to show
+   // it does not depend on the number of files. The profile is only set once the disk is open, the device time of a
+   // mount covers its sync and nothing else
+   opInit(&mount, "mount");
+   for (rep = 0; rep < MOUNT_REPS; rep++) {
+      start = now();
+      mountImage();
+      opSample(&mount, now() - start);
+      memset(&mount.before, 0, sizeof(disk_stats));
+      mount.busy_before = 0;
+      opStop(&mount);
+      tfs_unmount();
+   }
+   opReport(&mount);
+
+   mountImage();
+   for (idx = 0; idx < num_files; idx++) {
+      snprintf(name, sizeof(name), "r%d", idx);
+      fds[idx] = tfs_openFile(name);
+   }
+
+   // Small reads from a cold cache, front to back one file after another,
+   // which is what readahead is for
+   opInit(&smallRead, "small read");
+   opStart(&smallRead);
+   for (idx = 0, rep = 0; idx < num_files && rep < SMALL_OPS; rep++) {
+      start = now();
+      offset = tfs_read(fds[idx], buf, SMALL_READ);
+      opSample(&smallRead, now() - start);
+      if (offset < SMALL_READ)
+         idx++;
+   }
+   opStop(&smallRead);
+   opReport(&smallRead);
+
+   opInit(&del, "delete");
+   opStart(&del);
+   for (idx = 0; idx < num_files; idx++) {
+      start = now();
+      tfs_deleteFile(fds[idx]);
+      opSample(&del, now() - start);
+   }
+   opStop(&del);
+   opReport(&del);
+   tfs_unmount();
+
+   free(data);
+   free(buf);
+   free(fds);
+}
+
+static void usage(char *program) {
+   printf("usage: %s [file|mmap|memory] [hdd|ssd|nvme]\n", program);
+   exit(1);
+}
+
+/* Runs every operation on every volume size and file count. The backend defaults to DISK_FILE, a device profile adds the simulated device time per call. Latencies are wall clock per call, block I/Os per call include the tfs_sync() at the end of each run of calls. */
+int main(int argc, char **argv) {
+   int backend = DISK_FILE, size, count;
+
+   if (argc > 1) {
+      if (strcmp(argv[1], "file") == 0)
+         backend = DISK_FILE;
+      else if (strcmp(argv[1], "mmap") == 0)
+         backend = DISK_MMAP;
+      else if (strcmp(argv[1], "memory") == 0)
+         backend = DISK_MEMORY;
+      else
+         usage(argv[0]);
+   }
+   if (argc > 2) {
+      if (strcmp(argv[2], "hdd") == 0)
+         profile = &disk_profile_hdd;
+      else if (strcmp(argv[2], "ssd") == 0)
+         profile = &disk_profile_ssd;
+      else if (strcmp(argv[2], "nvme") == 0)
+         profile = &disk_profile_nvme;
+      else
+         usage(argv[0]);
+   }
+   setDiskBackend(backend);
+
+   printf("TinyFS benchmark, %s backend%s%s\n", argc > 1 ? argv[1] : "file",
+    profile != NULL ? ", simulated " : "", profile != NULL ? argv[2] : "");
+   for (size = 0; size < (int)(sizeof(disk_sizes) / sizeof(int)); size++) {
+      for (count = 0; count < (int)(sizeof(file_counts) / sizeof(int)); count++)
+         benchVolume(disk_sizes[size], file_counts[count]);
+   }
+
+   if (backend == DISK_MEMORY)
+      removeMemoryDisk(BENCH_IMAGE);
+   else
+      unlink(BENCH_IMAGE);
+   return 0;
+}
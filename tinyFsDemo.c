@@ -171,7 +171,72 @@ int main() {
    tfs_readByte(test3, &temp);
    printf("%c", temp);
    printf("\n");
-   
+   printf("\n");
+
+   printf("Appending 10 log records to file: log\n");
+   fileDescriptor log = tfs_openFile("log");
+   char record[64];
+   for (int idx = 0; idx < 10; idx++) {
+      sprintf(record, "record %d: all quiet on the TinyFS front\n", idx);
+      tfs_append(log, record, strlen(record));
+   }
+   printf("Overwriting record 0 in place with tfs_write\n");
+   tfs_seek(log, 0);
+   tfs_write(log, "RECORD", strlen("RECORD"));
+   printf("Reading the log back with tfs_read\n");
+   char logbuf[512];
+   tfs_seek(log, 0);
+   result = tfs_read(log, logbuf, sizeof(logbuf) - 1);
+   logbuf[result > 0 ? result : 0] = '\0';
+   printf("%s", logbuf);
+   printf("\n");
+
+   printf("Listing every file with tfs_readdirNext, two entries per page\n");
+   tfs_dir dir;
+   tfs_dirent page[2];
+   int page_num = 0;
+   tfs_opendir(&dir, NULL);
+   while ((result = tfs_readdirNext(&dir, page, 2)) > 0) {
+      printf("page %d:\n", ++page_num);
+      for (int idx = 0; idx < result; idx++)
+         printf("   %-8s %5d bytes %s\n", page[idx].name, page[idx].size,
+          page[idx].read_only ? "read only" : "read write");
+   }
+   printf("Listing again from after \"log\"\n");
+   tfs_opendir(&dir, "log");
+   while ((result = tfs_readdirNext(&dir, page, 2)) > 0) {
+      for (int idx = 0; idx < result; idx++)
+         printf("   %s\n", page[idx].name);
+   }
+   printf("\n");
+
+   printf("Making directories docs and docs/old\n");
+   tfs_mkdir("docs");
+   tfs_mkdir("docs/old");
+   printf("Creating docs/notes and moving test3 to docs/old/test3\n");
+   fileDescriptor notes = tfs_openFile("docs/notes");
+   tfs_writeFile(notes, "nested", strlen("nested") + 1);
+   tfs_rename("docs/old/test3", "test3");
+   tfs_readdir();
+   tfs_dirent found;
+   if (tfs_lookup("docs/old/test3", &found) == 0)
+      printf("docs/old/test3 is there, %d bytes\n", found.size);
+   if (tfs_lookup("docs/missing", NULL) == ERROR_BADFILE)
+      printf("docs/missing is not there\n");
+   printf("Listing docs\n");
+   tfs_opendirPath(&dir, "docs", NULL);
+   while ((result = tfs_readdirNext(&dir, page, 2)) > 0) {
+      for (int idx = 0; idx < result; idx++)
+         printf("   %s%s\n", page[idx].name, page[idx].is_dir ? "/" : "");
+   }
+   result = tfs_rmdir("docs/old");
+   if (result == ERROR_NOT_EMPTY)
+      printf("docs/old is not empty, moving test3 back before removing it\n");
+   tfs_rename("test3", "docs/old/test3");
+   if (tfs_rmdir("docs/old") == RMDIR_SUCCESS)
+      printf("Removed docs/old\n");
+   printf("\n");
+
    printf("Unmounting test.txt\n");
    tfs_unmount();
 }
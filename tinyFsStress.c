@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "libTinyFS.h"
+#include "libDisk.h"
+#include "tinyFS.h"
+#include "tinyFS_errno.h"
+
+#define STRESS_IMAGE "tinyFsStress.img"
+#define STRESS_BLOCKS 16384 //blocks in the volume
+#define STRESS_FILES 32
+#define FILE_BLOCKS 64 //data blocks per file
+#define READ_SIZE (16 * EXTENT_PAYLOAD) //bytes per tfs_read() call
+#define RUN_SECONDS 0.5 //per thread count
+#define MAX_THREADS 64
+
+//one measured thread
+typedef struct worker {
+   pthread_t thread;
+   fileDescriptor fd;
+   unsigned long long bytes;
+   unsigned long errors;
+} worker;
+
+static tfs_volume *volume;
+static fileDescriptor fds[STRESS_FILES];
+static volatile int running; //cleared to stop the workers
+static pthread_barrier_t start_line;
+
+static double now() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads its file front to back in READ_SIZE calls until told to stop. A worker on a shared FD moves the one file pointer with the others, whoever reaches the end seeks back to the start. */
+static void* readLoop(void *arg) {
+   worker *self = (worker *)arg;
+   char *buf = (char *)malloc(READ_SIZE);
+   int code;
+
+   pthread_barrier_wait(&start_line);
+   while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+      code = tfs_read(self->fd, buf, READ_SIZE);
+      if (code == END_OF_FILE) {
+         tfs_seek(self->fd, 0);
+         continue;
+      }
+      if (code < 0) {
+         self->errors++;
+         continue;
+      }
+      self->bytes += code;
+   }
+   free(buf);
+   return NULL;
+}
+
+// Run num_threads readers for RUN_SECONDS, returns bytes read per second
+static double runReaders(int num_threads, int shared, unsigned long *errors) {
+   worker workers[MAX_THREADS];
+   unsigned long long total = 0;
+   double start, elapsed;
+   int idx;
+
+   pthread_barrier_init(&start_line, NULL, num_threads + 1);
+   running = 1;
+   for (idx = 0; idx < num_threads; idx++) {
+      memset(workers + idx, 0, sizeof(worker));
+      workers[idx].fd = shared ? fds[0] : fds[idx % STRESS_FILES];
+      pthread_create(&workers[idx].thread, NULL, readLoop, workers + idx);
+   }
+   pthread_barrier_wait(&start_line);
+   start = now();
+   usleep((useconds_t)(RUN_SECONDS * 1e6));
+   __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+   for (idx = 0; idx < num_threads; idx++) {
+      pthread_join(workers[idx].thread, NULL);
+      total += workers[idx].bytes;
+      *errors += workers[idx].errors;
+   }
+   elapsed = now() - start;
+   pthread_barrier_destroy(&start_line);
+   return total / elapsed;
+}
+
+// Measure every thread count from 1 up to max_threads, doubling each time
+static void benchReaders(int max_threads, int shared) {
+   unsigned long errors;
+   double rate, base = 0;
+   int threads;
+
+   printf("\n%s\n", shared ? "all threads on one FD" : "one file per thread");
+   printf("  %7s %10s %8s %7s\n", "threads", "MB/s", "speedup", "errors");
+   for (threads = 1; threads <= max_threads; threads *= 2) {
+      errors = 0;
+      tfs_seek(fds[0], 0);
+      rate = runReaders(threads, shared, &errors);
+      if (threads == 1)
+         base = rate;
+      printf("  %7d %10.1f %8.2f %7lu\n", threads, rate / 1e6,
+       base > 0 ? rate / base : 0, errors);
+   }
+}
+
+static void usage(char *program) {
+   printf("usage: %s [file|mmap|memory] [threads]\n", program);
+   exit(1);
+}
+
+/* Reads files of one volume from 1, 2, 4, ... threads and reports the throughput of each thread count, first with every thread on a file of its own, then with all of them on one FD. The files fit the block cache, so the numbers show how far the locking lets reads scale rather than how fast the disk is. The thread count defaults to twice the number of online cores. */
+int main(int argc, char **argv) {
+   int backend = DISK_FILE, max_threads, idx;
+   unsigned long errors = 0;
+   char name[9];
+   char *data;
+
+   max_threads = 2 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (argc > 1) {
+      if (strcmp(argv[1], "file") == 0)
+         backend = DISK_FILE;
+      else if (strcmp(argv[1], "mmap") == 0)
+         backend = DISK_MMAP;
+      else if (strcmp(argv[1], "memory") == 0)
+         backend = DISK_MEMORY;
+      else
+         usage(argv[0]);
+   }
+   if (argc > 2)
+      max_threads = atoi(argv[2]);
+   if (max_threads < 1)
+      usage(argv[0]);
+   max_threads = max_threads < MAX_THREADS ? max_threads : MAX_THREADS;
+   setDiskBackend(backend);
+
+   if (tfs_mkfs(STRESS_IMAGE, (off_t)STRESS_BLOCKS * BLOCKSIZE) != MAKEFS_SUCCESS) {
+      printf("Cannot make %s\n", STRESS_IMAGE);
+      return 1;
+   }
+   tfs_setCacheSize(2 * STRESS_FILES * (FILE_BLOCKS + 1));
+   if (tfs_mountVolume(STRESS_IMAGE, &volume) != MOUNT_SUCCESS) {
+      printf("Cannot mount %s\n", STRESS_IMAGE);
+      return 1;
+   }
+
+   data = (char *)malloc(FILE_BLOCKS * EXTENT_PAYLOAD);
+   for (idx = 0; idx < FILE_BLOCKS * EXTENT_PAYLOAD; idx++)
+      data[idx] = (char)(idx * 7);
+   for (idx = 0; idx < STRESS_FILES; idx++) {
+      sprintf(name, "s%d", idx);
+      fds[idx] = tfs_openFileOn(volume, name);
+      tfs_writeFile(fds[idx], data, FILE_BLOCKS * EXTENT_PAYLOAD);
+   }
+   free(data);
+   tfs_syncOn(volume);
+
+   printf("TinyFS read scaling, %s backend, %d files of %d bytes, %ld cores\n",
+    argc > 1 ? argv[1] : "file", STRESS_FILES, FILE_BLOCKS * EXTENT_PAYLOAD,
+    sysconf(_SC_NPROCESSORS_ONLN));
+   // One pass first, so every block is cached before anything is measured
+   runReaders(STRESS_FILES, 0, &errors);
+   benchReaders(max_threads, 0);
+   benchReaders(max_threads, 1);
+
+   tfs_unmountVolume(volume);
+   if (backend == DISK_MEMORY)
+      removeMemoryDisk(STRESS_IMAGE);
+   else
+      unlink(STRESS_IMAGE);
+   return 0;
+}